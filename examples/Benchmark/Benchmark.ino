@@ -0,0 +1,152 @@
+// Measures the cost of going through a registry with 10, 100 and 1000 entries. The modules used to keep their registries
+// in a LinkedList and go through it with get(i). Now they use an EvtSlotMap. Evt32 no longer depends on the LinkedList
+// library, so the list it was compared with is made here, and works the same way
+#include "EvtLogger.h"
+#include "EvtSlotMap.h"
+
+#define BENCHMARK_ROUNDS 20   // Each measurement is done this many times. The average is shown
+
+
+/*	A list of nodes on the heap, like LinkedList by Ivan Seidel. get(i) walks from the first node, except when i is the
+	node after the last one it got. Then it takes one step, so going through the list in order is not quadratic
+*/
+template<typename T> class LinkedList {
+private:
+	struct Node {
+		T data;
+		Node* next;
+	};
+	Node* first = nullptr;
+	Node* last = nullptr;
+	Node* lastNodeGot = nullptr;
+	int lastIndexGot = -1;
+	int count = 0;
+public:
+	int size() {
+		return(count);
+	}
+	void add(T data) {
+		Node *node = new Node{ data, nullptr };
+		if (last != nullptr) {
+			last->next = node;
+		} else {
+			first = node;
+		}
+		last = node;
+		count++;
+	}
+	T get(int index) {
+		Node *node = first;
+		int at = 0;
+		if (lastNodeGot != nullptr && index == lastIndexGot + 1) {
+			node = lastNodeGot->next;
+			at = index;
+		}
+		for (; at < index; at++) node = node->next;
+		lastNodeGot = node;
+		lastIndexGot = index;
+		return(node->data);
+	}
+	T shift() {   // Removes the first node
+		Node *node = first;
+		first = node->next;
+		if (first == nullptr) last = nullptr;
+		T data = node->data;
+		delete node;
+		count--;
+		lastNodeGot = nullptr;
+		lastIndexGot = -1;
+		return(data);
+	}
+};
+
+
+// An entry like the triggers of EvtTime
+struct Entry {
+	unsigned long ms;
+	unsigned long startedAtMs;
+	void* callback;
+};
+
+
+EvtSlotMap<Entry, 10> slotMap10;
+EvtSlotMap<Entry, 100> slotMap100;
+EvtSlotMap<Entry, 1000> slotMap1000;
+volatile unsigned long sink;   // Keeps the compiler from removing the loops
+
+
+/*	Fills a LinkedList and a slot map with the same entries and measures two things on both, in cpu cycles:
+	scan: going through all entries, like the time launcher does every ms
+	find: looking for the last entry by its value, like triggerInRemove() does
+	Every third entry is removed from the slot map and added again, so it has the holes a long running registry gets
+*/
+template<uint16_t N> void runBenchmark(EvtSlotMap<Entry, N> &slotMap) {
+	LinkedList<Entry*> linkedList;
+	for (uint16_t i = 0; i < N; i++) {
+		Entry entry = { i, millis(), nullptr };
+		linkedList.add(new Entry(entry));
+		slotMap.add(entry);
+	}
+	for (uint16_t i = 0; i < N; i += 3) {
+		Entry *entry = slotMap.at(i);
+		Entry copy = *entry;
+		slotMap.remove(entry);
+		slotMap.add(copy);   // Gets the free slot back
+	}
+
+	uint32_t start = ESP.getCycleCount();
+	for (uint8_t round = 0; round < BENCHMARK_ROUNDS; round++) {
+		unsigned long sum = 0;
+		for (uint16_t i = 0; i < linkedList.size(); i++) sum += linkedList.get(i)->ms;   // How the modules did it
+		sink = sum;
+	}
+	uint32_t listScan = (ESP.getCycleCount() - start) / BENCHMARK_ROUNDS;
+
+	start = ESP.getCycleCount();
+	for (uint8_t round = 0; round < BENCHMARK_ROUNDS; round++) {
+		unsigned long sum = 0;
+		for (Entry &entry : slotMap) sum += entry.ms;
+		sink = sum;
+	}
+	uint32_t slotMapScan = (ESP.getCycleCount() - start) / BENCHMARK_ROUNDS;
+
+	start = ESP.getCycleCount();
+	for (uint8_t round = 0; round < BENCHMARK_ROUNDS; round++) {
+		for (uint16_t i = 0; i < linkedList.size(); i++) {
+			if (linkedList.get(i)->ms == N - 1) {
+				sink = i;
+				break;
+			}
+		}
+	}
+	uint32_t listFind = (ESP.getCycleCount() - start) / BENCHMARK_ROUNDS;
+
+	start = ESP.getCycleCount();
+	for (uint8_t round = 0; round < BENCHMARK_ROUNDS; round++) {
+		for (Entry &entry : slotMap) {
+			if (entry.ms == N - 1) {
+				sink = slotMap.indexOf(&entry);
+				break;
+			}
+		}
+	}
+	uint32_t slotMapFind = (ESP.getCycleCount() - start) / BENCHMARK_ROUNDS;
+
+	logger.send(NOTICE, "BEN", "%4d entries. Scan: LinkedList %u, EvtSlotMap %u cycles. Find: LinkedList %u, EvtSlotMap %u cycles",
+		N, listScan, slotMapScan, listFind, slotMapFind);
+	while (linkedList.size() > 0) delete linkedList.shift();
+}
+
+
+void setup(void)
+{
+	logger.setup(INFO, false);   // We don't want to much logging
+	runBenchmark(slotMap10);
+	runBenchmark(slotMap100);
+	runBenchmark(slotMap1000);
+}
+
+void loop(void)
+{
+	delay(1000);   // Do nothing forever
+}
@@ -15,8 +15,16 @@ void setup(void)
 		We want a resolution of 12 bits (this means it will take about 700ms to read )
 		We want a reading every 5 seconds on each bus
 	*/
+	evtDS18B20.onSensorChange(cbSensor);   // Sensors can be plugged in and out while running
 	evtDS18B20.addBus(BUS_A, 12, 5, cbTemperature);
 	evtDS18B20.addBus(BUS_B, 12, 5, cbTemperature);
+	evtDS18B20.enableAlarmSearch(BUS_B, 1, 300);   // On bus B only sensors that moved about 1C are read. All are read every 5 minutes
+
+	ReportSettings reporting;   // On bus A the noise of the last bit is not reported
+	reporting.deadband = 0.2;   // Only changes of more than 0.2C
+	reporting.smoothing = SMOOTH_MEDIAN;   // A single bad reading is ignored
+	reporting.heartbeat = 600;   // But we hear from every sensor at least every 10 minutes
+	evtDS18B20.setReporting(BUS_A, reporting);
 }
 
 
@@ -29,4 +37,10 @@ void loop(void)
 /* This callback is only called whenever there is a change in temperature */
 void cbTemperature(uint8_t pinNumber, uint8_t sensorIndex, char* sensorAddress, float temperature) {
 	logger.send(NOTICE, "TST", "Temperature change on pin: #%d. Sensor Addr: %s. Temperature: %f", pinNumber, sensorAddress, temperature);
+}
+
+
+/* This callback is called when a sensor is plugged in or has gone missing */
+void cbSensor(uint8_t pinNumber, uint8_t sensorIndex, char* sensorAddress, bool present) {
+	logger.send(NOTICE, "TST", "Sensor %d on pin: #%d with Addr: %s was %s", sensorIndex, pinNumber, sensorAddress, present ? "added" : "removed");
 }
\ No newline at end of file
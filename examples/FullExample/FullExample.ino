@@ -1,7 +1,8 @@
 /* This is a simple temperature regulator that can be controlled and watched via mqtt. Hardware: 
 	1) A relay(with a heater) connected to pin RELAY_PIN. 
 	2) A Dallas DS18B20 sensor connected to pin TEMPERATURE_SENSOR_PIN
-	All temperature changes are reported to mqtt topic MQTT_TOPIC_TEMPERATURE. All changes on the relay are reported to MQTT_TOPIC_RELAY
+	Temperatures are collected for a minute, and min/max/mean is reported to mqtt topic MQTT_TOPIC_TEMPERATURE. A jump of more
+	than half a degree is reported at once. All changes on the relay are reported to MQTT_TOPIC_RELAY
 	When temperature drops below a setpoint (initially 23C) the relay/heater turns on. If it's under it turns off
 	The setpoint can be changed from the server by publishing the wanted temperature to the mqtt topic MQTT_TOPIC_SETPOINT_TEMPERATURE
 */
@@ -15,29 +16,56 @@
 #include "EvtMqtt.h"
 #include "EvtDS18B20.h"
 #include "EvtIO.h"
+#include "EvtAggregate.h"
+#include "EvtAlloc.h"
 
 EvtTimeNet evtTime;
 EvtWiFi evtWiFi;
 EvtMqtt evtMqtt;
 EvtDS18B20 evtDS18B20;
 EvtIO evtIO;
+EvtAggregate evtAggregate;
 
 
-float setpointTemperature = 23;   // The initial temperature setpoint for the relay
+MqttTopic temperatureTopic;   // Registered once, so publishing only passes a small handle around
+
+
+// The state of the regulator. The callbacks are given a pointer to it, so there could be one for each room
+struct Regulator {
+	uint8_t relayPin;
+	float setpoint;   // The temperature we regulate to
+	int temperatureSeries;   // The aggregated series of temperatures
+};
+
+Regulator heater = { RELAY_PIN, 23, -1 };   // The initial temperature setpoint is 23C
 
 
 void setup(void)
 {
 	logger.setup(INFO, true);   // We want to timestamp logentries with our real time from RTC. And not too much log info.
 
+	evtWiFi.enableFastConnect();	// After the first boot we connect straight to the last AP without scanning
 	evtWiFi.begin(WIFI_SSID, WIFI_PASSWORD);	// Connect to wifi and keep connected forever
 	evtTime.begin(0, 0, NTP_SERVER);			// Connect to the NTP server for getting time
 
+	evtMqtt.setTls(MQTT_CA_CERT);														// The mqtt server is on a TLS port
 	evtMqtt.begin(MQTT_SERVER, MQTT_PORT, MQTT_CLIENT_ID, MQTT_USER, MQTT_PASS);		//Connect to Mqtt and keep connected forever
-	evtMqtt.subscribe(MQTT_TOPIC_SETPOINT_TEMPERATURE, receivedSetpointTemperature);	// Subscribe to a topic to receive setpoint temperature from server.
-
-	evtIO.outputSetup(RELAY_PIN, false, relayOutputChanged);				// Setup a pin for the output relay.
-	evtDS18B20.addBus(TEMPERATURE_SENSOR_PIN, 12, 5, temperatureChanged);	// Configure temperature sensor. We want readings every 5 seconds.
+	Regulator *regulator = &heater;
+	evtMqtt.subscribe<float>(MQTT_TOPIC_SETPOINT_TEMPERATURE, [regulator](char* topic, float temperature) {	// Subscribe to a topic to receive setpoint temperature from server.
+		receivedSetpointTemperature(regulator, temperature);
+	});
+	temperatureTopic = evtMqtt.registerTopic(MQTT_TOPIC_TEMPERATURE);	// Topics can also be made from a template like "%s/%s/temperature"
+	evtMqtt.latestValueOnly(temperatureTopic);	// If mqtt can't keep up, only the newest temperature is sent.
+
+	evtIO.outputSetup(heater.relayPin, false, OutputCbFunc(relayOutputChanged, regulator));	// Setup a pin for the output relay. A C style callback with a context
+	heater.temperatureSeries = evtAggregate.addSeries(60000, 1, 0.5, temperatureSummary);	// One summary per minute, or at once on a jump of 0.5C
+	evtDS18B20.addBus(TEMPERATURE_SENSOR_PIN, 12, 5, [regulator](uint8_t pinNumber, uint8_t sensorIndex, char* sensorAddress, float temperature) {
+		temperatureChanged(regulator, sensorAddress, temperature);	// Configure temperature sensor. We want readings every 5 seconds.
+	});
+
+	EvtAlloc::report();	// Shows the heap, and the static pools if EVT_STATIC_ALLOCATION is set
+	evtTime.triggerIn(10000, [](unsigned long msPassed) { EvtAlloc::lock(); });	// The mqtt task sets up the subscriptions shortly after setup(). Then boot is done
+	evtTime.triggerEvery(3600000, [](unsigned long msPassed, unsigned long triggerCount) { EvtAlloc::check(); });	// Warns if the heap shrinks
 }
 
 
@@ -47,36 +75,47 @@ void loop(void)
 }
 
 
-/*	This callback function is called whenever a change in temperature is registred. It publishes the temperature to the Mqtt server
-	If it's under the global setpoint value it turns on the relay for the heater
+/*	This function is called whenever a change in temperature is registred. It adds the temperature to the aggregated series
+	If it's under the setpoint of the regulator it turns on the relay for the heater
 	If it's over it turns off the relay for the heater.
 	So this is a very simple heating regulator 
 */
-void temperatureChanged(uint8_t pinNumber, uint8_t sensorIndex, char* sensorAddress, float temperature) {
+void temperatureChanged(Regulator* regulator, char* sensorAddress, float temperature) {
 	logger.send(NOTICE, "REG", "Temperature changed on sensor %s to: %.2f C", sensorAddress, temperature);
-	evtMqtt.publish(MQTT_TOPIC_TEMPERATURE, temperature, 2);
-	if (temperature > setpointTemperature) {
-		evtIO.outputSet(RELAY_PIN, false);
+	evtAggregate.add(regulator->temperatureSeries, temperature);
+	if (temperature > regulator->setpoint) {
+		evtIO.outputSet(regulator->relayPin, false);
 	}
 	else {
-		evtIO.outputSet(RELAY_PIN, true);
+		evtIO.outputSet(regulator->relayPin, true);
 	}
 }
 
 
+/*	This callback function is called once per minute with the statistics of the temperatures. They are published as JSON */
+void temperatureSummary(uint8_t seriesIndex, AggregateSummary &summary) {
+	char json[100];
+	snprintf(json, sizeof(json), "{\"min\":%.2f,\"max\":%.2f,\"mean\":%.2f,\"last\":%.2f,\"count\":%u}",
+		summary.min, summary.max, summary.mean, summary.last, summary.count);
+	evtMqtt.publish(temperatureTopic, json);
+}
+
+
 /*	This callback function just sends the state of the heater relay to the mqtt server.
 	It's called whenever the output pin of the relay changes. This means that we will be able to datalog every change on the server
+	context is the regulator that was given when the callback was set up
 */
-void relayOutputChanged(uint8_t pinNumber, bool pinState, unsigned long triggerCount) {
+void relayOutputChanged(void* context, uint8_t pinNumber, bool pinState, unsigned long triggerCount) {
+	Regulator *regulator = (Regulator*)context;
 	evtMqtt.publish(MQTT_TOPIC_RELAY, pinState, "On", "Off");
-	logger.send(NOTICE, "REG", "Relay turned %s because setpoint of %.2f C is crossed", pinState ? "On" : "Off", setpointTemperature);
+	logger.send(NOTICE, "REG", "Relay turned %s because setpoint of %.2f C is crossed", pinState ? "On" : "Off", regulator->setpoint);
 }
 
 
 /*	If we receive a mqtt message in the setpoint-topic, we change the setpoint to this.
 	This means that we can change the regulators behaveour via MQTT
 */
-void receivedSetpointTemperature(char* topic, float temperature) {
+void receivedSetpointTemperature(Regulator* regulator, float temperature) {
 	logger.send(NOTICE, "REG", "Received a new setpoint temperature from MQTT: %.2f C", temperature);
-	setpointTemperature = temperature;
+	regulator->setpoint = temperature;
 }
\ No newline at end of file
@@ -0,0 +1,52 @@
+#include "EvtLogger.h"
+#include "EvtModbus.h"
+
+EvtModbus evtModbus;   // Our modbus class instance
+
+#define RX_PIN 16
+#define TX_PIN 17
+#define DE_PIN 4   // The driver enable pin of the RS485 transceiver
+#define METER_ADDRESS 1
+#define HEATER_ADDRESS 2
+
+
+void setup(void)
+{
+	logger.setup(INFO, false);   // We don't want to much logging
+
+	if (!evtModbus.begin(Serial2, 9600, RX_PIN, TX_PIN, DE_PIN)) return;
+
+	// A power meter. The two blocks are close, so they are read in one request
+	evtModbus.addBlock(METER_ADDRESS, MODBUS_READ_INPUT_REGISTERS, 0, 6, 1000, cbMeter);   // Voltages, every second
+	evtModbus.addBlock(METER_ADDRESS, MODBUS_READ_INPUT_REGISTERS, 10, 2, 5000, cbMeter);   // Energy, every 5 seconds
+
+	// A heater that is read now and then, and gets a new setpoint
+	evtModbus.addBlock(HEATER_ADDRESS, MODBUS_READ_HOLDING_REGISTERS, 100, 1, 10000, cbHeater);
+	evtModbus.writeRegister(HEATER_ADDRESS, 100, 215, cbHeater);   // 21.5 degrees
+
+	delay(60000);
+
+	ModbusStats stats = evtModbus.getStats(METER_ADDRESS);
+	logger.send(NOTICE, "TST", "Meter: %lu requests, %lu timeouts, %lu crc errors, longest answer %lu ms",
+		stats.requests, stats.timeouts, stats.crcErrors, stats.longestLatency);
+}
+
+void loop(void)
+{
+	delay(1000);   // Do nothing forever
+}
+
+
+// This is called with the registers of the meter
+void cbMeter(uint8_t deviceAddress, uint16_t firstRegister, const uint16_t* values, uint8_t count, ModbusResult result) {
+	if (result != MODBUS_OK) return;   // It's logged by EvtModbus
+	for (uint8_t i = 0; i < count; i++) {
+		logger.send(NOTICE, "TST", "Meter register %d is %d", firstRegister + i, values[i]);
+	}
+}
+
+
+// This is called when the setpoint of the heater is read or written
+void cbHeater(uint8_t deviceAddress, uint16_t firstRegister, const uint16_t* values, uint8_t count, ModbusResult result) {
+	if (result == MODBUS_OK) logger.send(NOTICE, "TST", "Heater setpoint is %d", values[0]);
+}
@@ -19,6 +19,10 @@ void setup(void)
 
 	// Connect to wifi and mqtt
 	evtWiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+	evtMqtt.enableSpool(8, 16384);   // Messages published while offline are kept on flash (8 files of 16kB) and sent when we are back
+	evtMqtt.setQos(MQTT_TOPIC_BOOL_REPLY, 1);   // Bool replies are sent again until the mqtt server has acknowledged them
+	evtMqtt.setDispatch(1, DISPATCH_DROP_OLDEST);   // Callbacks run in their own task. If they can't keep up, the oldest messages are dropped
+	evtMqtt.setTls(MQTT_CA_CERT);   // Encrypt the connection. The TLS session is reused when we reconnect
 	evtMqtt.begin(MQTT_SERVER, MQTT_PORT, MQTT_CLIENT_ID, MQTT_USER, MQTT_PASS);
 
 	// Subscribe to 3 different topics, expecting 3 different variable types. Int, float and bool
@@ -48,7 +52,7 @@ void cbFloat(char* topic, float value) {
 
 
 /*	Boolean values accepted and interpreted correctly are false=off,false,0,low and true=on,true,1,high. All case insensitive
-	If you want to add others it can be done in EvtMqtt.h
+	If you want to add others it can be done in EvtMqttCodec.h
 	Whenever something is received in the topic this callback function is called
 */
 void cbBool(char* topic, bool value) { 
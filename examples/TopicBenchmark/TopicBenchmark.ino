@@ -0,0 +1,84 @@
+// Measures the cost of finding the subscriptions of a received mqtt topic with 100, 300 and 1000 subscriptions. EvtMqtt used
+// to go through all subscriptions and compare each topic with strcmp. Now it matches the topic level by level in a
+// MqttTopicTree, which is what runs here. The subscriptions have no wildcards, so both ways find the same ones
+#include "EvtLogger.h"
+#include "EvtMqttTopicTree.h"
+
+#define BENCHMARK_ROUNDS 20   // Each measurement is done this many times. The average is shown
+
+
+// A subscription like the ones of EvtMqtt. The tree needs the topic and nextInNode
+struct BenchSubscription {
+	char topic[48];
+	BenchSubscription* nextInNode = nullptr;
+};
+
+
+volatile unsigned long sink;   // Keeps the compiler from removing the loops
+
+
+/*	Counts the subscriptions of a topic the way EvtMqtt did before the topic tree. All of them are compared, because more
+	than one may match. Parameters:
+	subscriptions, count: all subscriptions
+	topic: the received topic
+*/
+unsigned long linearScan(BenchSubscription* subscriptions, uint16_t count, const char* topic) {
+	unsigned long found = 0;
+	for (uint16_t i = 0; i < count; i++) {
+		if (strcmp(subscriptions[i].topic, topic) == 0) found++;
+	}
+	return(found);
+}
+
+
+/*	Subscribes N topics like those of a house full of sensors, and measures in cpu cycles how long it takes to find the
+	subscription of a topic. Two topics are received:
+	match: the topic of the last subscription
+	none: a topic nobody subscribed to
+*/
+template<uint16_t N> void runBenchmark() {
+	static BenchSubscription subscriptions[N];
+	static MqttTopicTree<BenchSubscription> tree;
+	for (uint16_t i = 0; i < N; i++) {
+		sprintf(subscriptions[i].topic, "home/floor%d/room%d/sensor%d/temperature", i / 100, (i / 10) % 10, i % 10);
+		if (!tree.add(&subscriptions[i])) {
+			logger.send(ERR, "BEN", "No memory for the topic tree with %d subscriptions", N);
+			return;
+		}
+	}
+
+	const char* topics[] = { subscriptions[N - 1].topic, "home/floor0/room0/sensor0/humidity" };
+	const char* names[] = { "match", "none" };
+	for (uint8_t t = 0; t < 2; t++) {
+		uint32_t start = ESP.getCycleCount();
+		for (uint8_t round = 0; round < BENCHMARK_ROUNDS; round++) sink = linearScan(subscriptions, N, topics[t]);
+		uint32_t linearCycles = (ESP.getCycleCount() - start) / BENCHMARK_ROUNDS;
+		unsigned long linearFound = sink;
+
+		unsigned long treeFound = 0;
+		start = ESP.getCycleCount();
+		for (uint8_t round = 0; round < BENCHMARK_ROUNDS; round++) {
+			treeFound = 0;
+			tree.match(topics[t], [&treeFound](BenchSubscription* subscription) { treeFound++; });
+			sink = treeFound;
+		}
+		uint32_t treeCycles = (ESP.getCycleCount() - start) / BENCHMARK_ROUNDS;
+
+		logger.send(NOTICE, "BEN", "%4d subscriptions, %-5s topic. Linear scan %u, topic tree %u cycles. Found %lu and %lu",
+			N, names[t], linearCycles, treeCycles, linearFound, treeFound);
+	}
+}
+
+
+void setup(void)
+{
+	logger.setup(INFO, false);   // We don't want to much logging
+	runBenchmark<100>();
+	runBenchmark<300>();
+	runBenchmark<1000>();
+}
+
+void loop(void)
+{
+	delay(1000);   // Do nothing forever
+}
@@ -0,0 +1,277 @@
+// Runs the modbus master on Linux against a simulated device on a pseudo terminal. The master gets the slave end of the
+// terminal like a serial port, and the simulated device answers on the master end from its own thread:
+// device 1 answers holding register n with 1000 + n and input register n with 2000 + n. Reads of registers from 1000 are refused
+// device 2 answers with a wrong crc
+// device 3 never answers
+// The answers are sent one character at a time at the speed of 9600 baud, like on a real bus
+// Build and run it with make in this folder. It prints the failed checks, and returns 1 if there were any
+#include "EvtModbusMaster.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#define CHECK(condition) check(condition, #condition, __LINE__)
+#define SIMULATED_BAUD 9600
+
+static int failures = 0;
+static void check(bool condition, const char* text, int line) {
+	if (condition) return;
+	printf("Line %d: %s failed\n", line, text);
+	failures++;
+}
+
+
+
+// The device on the master end of the pseudo terminal
+struct Request {
+	uint8_t deviceAddress;
+	uint8_t function;
+	uint16_t firstRegister;
+	uint16_t count;   // The value for a write
+};
+
+static int deviceFd;
+static volatile bool running = true;
+static std::vector<Request> requests;
+static pthread_mutex_t requestsMutex = PTHREAD_MUTEX_INITIALIZER;
+static uint16_t writtenValue = 0;
+
+
+static void* simulatedDevice(void*) {
+	uint8_t request[8];
+	uint8_t length = 0;
+	while (running) {
+		struct pollfd ready = { deviceFd, POLLIN, 0 };
+		if (poll(&ready, 1, 10) <= 0) continue;
+		if (read(deviceFd, request + length, 1) != 1) continue;
+		if (++length < 8) continue;   // All requests of the master are 8 bytes
+		length = 0;
+
+		Request seen = { request[0], request[1], (uint16_t)(request[2] << 8 | request[3]), (uint16_t)(request[4] << 8 | request[5]) };
+		pthread_mutex_lock(&requestsMutex);
+		requests.push_back(seen);
+		pthread_mutex_unlock(&requestsMutex);
+		if (seen.deviceAddress == 3) continue;
+
+		uint8_t response[MODBUS_FRAME_SIZE];
+		uint16_t responseLength;
+		if (seen.function == MODBUS_WRITE_SINGLE_REGISTER) {
+			writtenValue = seen.count;
+			memcpy(response, request, 6);
+			responseLength = 6;
+		} else if (seen.firstRegister + seen.count > 1000) {
+			response[0] = seen.deviceAddress;
+			response[1] = seen.function | 0x80;
+			response[2] = 2;   // Illegal data address
+			responseLength = 3;
+		} else {
+			response[0] = seen.deviceAddress;
+			response[1] = seen.function;
+			response[2] = 2 * seen.count;
+			for (uint16_t i = 0; i < seen.count; i++) {
+				uint16_t value = (seen.function == MODBUS_READ_INPUT_REGISTERS ? 2000 : 1000) + seen.firstRegister + i;
+				response[3 + 2 * i] = value >> 8;
+				response[4 + 2 * i] = value & 0xFF;
+			}
+			responseLength = 3 + 2 * seen.count;
+		}
+		uint16_t crc = ModbusFrame::crc16(response, responseLength);
+		if (seen.deviceAddress == 2) crc ^= 1;
+		response[responseLength++] = crc & 0xFF;
+		response[responseLength++] = crc >> 8;
+		for (uint16_t i = 0; i < responseLength; i++) {   // A pseudo terminal has no baud rate. Take the time a real bus would
+			if (write(deviceFd, response + i, 1) != 1) printf("The simulated device can't answer\n");
+			usleep(11000000UL / SIMULATED_BAUD);
+		}
+	}
+	return(nullptr);
+}
+
+
+
+// The master on the slave end of the pseudo terminal
+class PtyMaster : public ModbusMaster {
+private:
+	int fd;
+protected:
+	void sendFrame(const uint8_t* frame, uint16_t length) {
+		if (write(fd, frame, length) != length) printf("The master can't send\n");
+		tcdrain(fd);
+	}
+	int receiveByte() {
+		uint8_t received;
+		return(read(fd, &received, 1) == 1 ? received : -1);
+	}
+	void waitForByte() {
+		struct pollfd ready = { fd, POLLIN, 0 };
+		poll(&ready, 1, 1);
+	}
+	unsigned long nowMs() { return(nowUs() / 1000); }
+	unsigned long nowUs() {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return(now.tv_sec * 1000000UL + now.tv_nsec / 1000);
+	}
+	void waitUs(unsigned long us) { usleep(us); }
+public:
+	PtyMaster(int fd, uint32_t baud) : fd(fd) { setBaud(baud); }
+	using ModbusMaster::pollNext;
+	using ModbusMaster::writeNext;
+};
+
+
+
+// What the callbacks got
+struct Answer {
+	uint8_t deviceAddress;
+	uint16_t firstRegister;
+	uint16_t firstValue;
+	uint8_t count;
+	ModbusResult result;
+};
+
+static std::vector<Answer> answers;
+
+
+static void gotRegisters(uint8_t deviceAddress, uint16_t firstRegister, const uint16_t* values, uint8_t count, ModbusResult result) {
+	Answer answer = { deviceAddress, firstRegister, (uint16_t)(result == MODBUS_OK ? values[0] : 0), count, result };
+	answers.push_back(answer);
+}
+
+
+static const Answer* findAnswer(uint8_t deviceAddress, uint16_t firstRegister) {
+	for (const Answer &answer : answers) {
+		if (answer.deviceAddress == deviceAddress && answer.firstRegister == firstRegister) return(&answer);
+	}
+	return(nullptr);
+}
+
+
+static bool wasRequested(uint8_t deviceAddress, uint8_t function, uint16_t firstRegister, uint16_t count) {
+	pthread_mutex_lock(&requestsMutex);
+	bool found = false;
+	for (const Request &request : requests) {
+		if (request.deviceAddress == deviceAddress && request.function == function && request.firstRegister == firstRegister && request.count == count) found = true;
+	}
+	pthread_mutex_unlock(&requestsMutex);
+	return(found);
+}
+
+
+
+int main() {
+	uint8_t frame[8];
+	ModbusFrame::makeRead(frame, 1, MODBUS_READ_HOLDING_REGISTERS, 0, 10);
+	CHECK(frame[6] == 0xC5 && frame[7] == 0xCD);   // The crc from the modbus specification
+
+	deviceFd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (deviceFd < 0 || grantpt(deviceFd) != 0 || unlockpt(deviceFd) != 0) {
+		printf("No pseudo terminal\n");
+		return(1);
+	}
+	int masterFd = open(ptsname(deviceFd), O_RDWR | O_NOCTTY | O_NONBLOCK);
+	struct termios settings;
+	tcgetattr(masterFd, &settings);
+	cfmakeraw(&settings);   // Bytes go through as they are
+	cfsetspeed(&settings, B9600);   // SIMULATED_BAUD
+	tcsetattr(masterFd, TCSANOW, &settings);
+	pthread_t deviceThread;
+	pthread_create(&deviceThread, nullptr, simulatedDevice, nullptr);
+
+	PtyMaster master(masterFd, SIMULATED_BAUD);
+	CHECK(!master.addBlock(1, MODBUS_WRITE_SINGLE_REGISTER, 0, 1, 1000, gotRegisters));
+	CHECK(!master.addBlock(1, MODBUS_READ_HOLDING_REGISTERS, 0, MODBUS_MAX_READ + 1, 1000, gotRegisters));
+	CHECK(master.addBlock(1, MODBUS_READ_HOLDING_REGISTERS, 0, 4, 1000, gotRegisters));
+	CHECK(master.addBlock(1, MODBUS_READ_HOLDING_REGISTERS, 6, 2, 1000, gotRegisters));   // Goes along with the one above
+	CHECK(master.addBlock(1, MODBUS_READ_HOLDING_REGISTERS, 100, 2, 1000, gotRegisters));   // Too far away
+	CHECK(master.addBlock(1, MODBUS_READ_INPUT_REGISTERS, 0, 2, 1000, gotRegisters));   // Another function
+	CHECK(master.addBlock(1, MODBUS_READ_HOLDING_REGISTERS, 1000, 1, 5000, gotRegisters));
+	CHECK(master.addBlock(2, MODBUS_READ_HOLDING_REGISTERS, 10, 2, 2000, gotRegisters));
+	CHECK(master.addBlock(3, MODBUS_READ_HOLDING_REGISTERS, 0, 1, 5000, gotRegisters));
+
+	unsigned long sleepTime = 0;
+	for (uint8_t i = 0; i < 20 && sleepTime == 0; i++) sleepTime = master.pollNext();
+	CHECK(sleepTime > 0 && sleepTime <= 1000);   // All blocks are read, and the first is due again within its interval
+
+	CHECK(wasRequested(1, MODBUS_READ_HOLDING_REGISTERS, 0, 8));
+	CHECK(wasRequested(1, MODBUS_READ_HOLDING_REGISTERS, 100, 2));
+	CHECK(wasRequested(1, MODBUS_READ_INPUT_REGISTERS, 0, 2));
+	CHECK(requests.size() == 6);
+
+	const Answer *answer = findAnswer(1, 0);
+	CHECK(answer != nullptr && answer->result == MODBUS_OK && answer->firstValue == 1000 && answer->count == 4);
+	answer = findAnswer(1, 6);
+	CHECK(answer != nullptr && answer->result == MODBUS_OK && answer->firstValue == 1006 && answer->count == 2);
+	answer = findAnswer(1, 100);
+	CHECK(answer != nullptr && answer->result == MODBUS_OK && answer->firstValue == 1100);
+	answer = findAnswer(1, 1000);
+	CHECK(answer != nullptr && answer->result == MODBUS_EXCEPTION);
+	answer = findAnswer(2, 10);
+	CHECK(answer != nullptr && answer->result == MODBUS_BAD_CRC);
+	answer = findAnswer(3, 0);
+	CHECK(answer != nullptr && answer->result == MODBUS_TIMEOUT);
+	for (const Answer &answer : answers) {
+		if (answer.deviceAddress == 1 && answer.firstRegister == 0 && answer.count == 2) CHECK(answer.firstValue == 2000);   // The input registers
+	}
+
+	ModbusStats stats = master.getStats(1);
+	CHECK(stats.requests == 4 && stats.exceptions == 1 && stats.timeouts == 0);
+	stats = master.getStats(2);
+	CHECK(stats.requests == 1 && stats.crcErrors == 1);
+	stats = master.getStats(3);
+	CHECK(stats.requests == 1 && stats.timeouts == 1);
+
+	answers.clear();
+	ModbusWrite write = { 1, 5, 4711, gotRegisters };
+	master.writeNext(write);
+	answer = findAnswer(1, 5);
+	CHECK(answer != nullptr && answer->result == MODBUS_OK && answer->firstValue == 4711);
+	CHECK(writtenValue == 4711);
+
+	answers.clear();
+	CHECK(master.pollNext() > 0);   // Nothing is due yet
+	CHECK(answers.empty());
+
+	// The longest read. Its answer takes about 290 ms at 9600 baud, longer than MODBUS_RESPONSE_TIMEOUT alone
+	PtyMaster longMaster(masterFd, SIMULATED_BAUD);
+	CHECK(longMaster.addBlock(1, MODBUS_READ_HOLDING_REGISTERS, 200, MODBUS_MAX_READ, 1000, gotRegisters));
+	answers.clear();
+	CHECK(longMaster.pollNext() == 0);
+	answer = findAnswer(1, 200);
+	CHECK(answer != nullptr && answer->result == MODBUS_OK && answer->firstValue == 1200 && answer->count == MODBUS_MAX_READ);
+	CHECK(longMaster.getStats(1).timeouts == 0);
+
+	// A merged read that reaches a refused register. The blocks are read alone after that, also when they are due again
+	PtyMaster mergeMaster(masterFd, SIMULATED_BAUD);
+	CHECK(mergeMaster.addBlock(1, MODBUS_READ_HOLDING_REGISTERS, 995, 3, 50, gotRegisters));
+	CHECK(mergeMaster.addBlock(1, MODBUS_READ_HOLDING_REGISTERS, 1000, 1, 50, gotRegisters));
+	for (uint8_t round = 0; round < 2; round++) {
+		answers.clear();
+		pthread_mutex_lock(&requestsMutex);
+		requests.clear();
+		pthread_mutex_unlock(&requestsMutex);
+		usleep(60000);
+		for (uint8_t i = 0; i < 5 && mergeMaster.pollNext() == 0; i++);
+		CHECK(wasRequested(1, MODBUS_READ_HOLDING_REGISTERS, 995, 3));
+		CHECK(wasRequested(1, MODBUS_READ_HOLDING_REGISTERS, 1000, 1));
+		CHECK(requests.size() == (round == 0 ? 3 : 2));   // Only the first round tries the merge
+		answer = findAnswer(1, 995);
+		CHECK(answer != nullptr && answer->result == MODBUS_OK && answer->firstValue == 1995);
+		answer = findAnswer(1, 1000);
+		CHECK(answer != nullptr && answer->result == MODBUS_EXCEPTION);
+		CHECK(answers.size() == 2);   // The refused merge is not called back
+	}
+
+	running = false;
+	pthread_join(deviceThread, nullptr);
+	close(masterFd);
+	close(deviceFd);
+	printf("%s\n", failures == 0 ? "All checks passed" : "Some checks failed");
+	return(failures == 0 ? 0 : 1);
+}
@@ -0,0 +1,126 @@
+// Tests the onewire codec on Linux with waveforms in the form the RMT receiver gives them: one symbol per low pulse and the
+// high time after it, in us. The last symbol of a receive has a high time of 0, because the receiver stops when the bus
+// has been idle for ONEWIRE_RMT_IDLE. The waveforms follow the DS18B20 datasheet timing, with the spread in pulse lengths
+// that comes from rise times and from devices that are slower or faster than nominal.
+// Build and run it with make in this folder. It prints the failed checks, and returns 1 if there were any
+#include "EvtOneWire.h"
+#include <stdio.h>
+
+#define CHECK(condition) check(condition, #condition, __LINE__)
+
+static int failures = 0;
+static void check(bool condition, const char* text, int line) {
+	if (condition) return;
+	printf("Line %d: %s failed\n", line, text);
+	failures++;
+}
+
+
+// Low and high time of each symbol
+struct Pulse {
+	uint16_t low;
+	uint16_t high;
+};
+
+
+static size_t toSymbols(const Pulse* pulses, size_t count, OneWireSymbol* symbols) {
+	for (size_t i = 0; i < count; i++) {
+		symbols[i].level0 = 0;
+		symbols[i].duration0 = pulses[i].low;
+		symbols[i].level1 = 1;
+		symbols[i].duration1 = pulses[i].high;
+	}
+	return(count);
+}
+
+
+
+// A reset with one device. Our 480 us reset, the device waits 15-60 us and pulls low for 60-240 us
+static const Pulse presence[] = { { 482, 31 }, { 117, 0 } };
+
+// A reset on a long cable with a slow device: a late and long presence pulse
+static const Pulse slowPresence[] = { { 481, 58 }, { 236, 0 } };
+
+// A reset with nobody there
+static const Pulse noPresence[] = { { 481, 0 } };
+
+// A reset with a 3 us glitch from a device being plugged in. It's no presence pulse
+static const Pulse glitch[] = { { 480, 40 }, { 3, 0 } };
+
+// The power on scratchpad of a DS18B20, read with 72 read slots: 85 degrees, TH 75, TL 70, 12 bit. Our read slots are
+// 6 us low. A 1 comes back as 6-9 us, because of the rise time. A device pulls a 0 low for 15-60 us after the slot started
+static const uint8_t scratchpad[9] = { 0x50, 0x05, 0x4B, 0x46, 0x7F, 0xFF, 0x0C, 0x10, 0x1C };
+static Pulse scratchpadSlots[72];
+
+
+static void makeScratchpadSlots() {
+	static const uint8_t oneLow[] = { 7, 6, 8, 9, 7, 6, 7, 8 };
+	static const uint8_t zeroLow[] = { 28, 31, 26, 44, 29, 33, 16, 58 };
+	for (uint8_t i = 0; i < 72; i++) {
+		bool bit = (scratchpad[i / 8] >> (i % 8)) & 1;
+		scratchpadSlots[i].low = bit ? oneLow[i % 8] : zeroLow[i % 8];
+		scratchpadSlots[i].high = i == 71 ? 0 : 70 - scratchpadSlots[i].low;
+	}
+}
+
+
+
+int main() {
+	OneWireSymbol symbols[80];
+	uint8_t data[9];
+
+	// Encoding
+	OneWireCodec::encodeReset(symbols);
+	CHECK(symbols[0].level0 == 0 && symbols[0].duration0 == ONEWIRE_RESET_LOW && symbols[0].level1 == 1 && symbols[0].duration1 == ONEWIRE_RESET_WAIT);
+	uint8_t command = ONEWIRE_SKIP_ROM;   // 0xCC, sent 0 0 1 1 0 0 1 1
+	OneWireCodec::encodeBits(&command, 8, symbols);
+	for (uint8_t i = 0; i < 8; i++) {
+		bool bit = (command >> i) & 1;
+		CHECK(symbols[i].level0 == 0 && symbols[i].level1 == 1);
+		CHECK(symbols[i].duration0 == (bit ? ONEWIRE_SLOT_1_LOW : ONEWIRE_SLOT_0_LOW));
+		CHECK(symbols[i].duration1 == (bit ? ONEWIRE_SLOT_1_HIGH : ONEWIRE_SLOT_0_HIGH));
+	}
+
+	// Presence
+	CHECK(OneWireCodec::decodePresence(symbols, toSymbols(presence, 2, symbols)));
+	CHECK(OneWireCodec::decodePresence(symbols, toSymbols(slowPresence, 2, symbols)));
+	CHECK(!OneWireCodec::decodePresence(symbols, toSymbols(noPresence, 1, symbols)));
+	CHECK(!OneWireCodec::decodePresence(symbols, toSymbols(glitch, 2, symbols)));
+	symbols[0].level0 = 1;   // The presence pulse in the second half of a symbol
+	symbols[0].duration0 = 20;
+	symbols[0].level1 = 0;
+	symbols[0].duration1 = 95;
+	CHECK(OneWireCodec::decodePresence(symbols, 1));
+	CHECK(!OneWireCodec::decodePresence(symbols, 0));
+
+	// A scratchpad read, checked with its crc
+	makeScratchpadSlots();
+	toSymbols(scratchpadSlots, 72, symbols);
+	CHECK(OneWireCodec::decodeBits(symbols, 72, data, 72));
+	CHECK(memcmp(data, scratchpad, 9) == 0);
+	CHECK(EvtOneWire::crc8(data, 8) == data[8]);
+	CHECK((int16_t)(data[0] | data[1] << 8) == 85 * 16);
+
+	// A 1 is shorter than ONEWIRE_READ_THRESHOLD
+	Pulse edge[] = { { ONEWIRE_READ_THRESHOLD - 1, 60 }, { ONEWIRE_READ_THRESHOLD, 0 } };
+	CHECK(OneWireCodec::decodeBits(symbols, toSymbols(edge, 2, symbols), data, 2));
+	CHECK((data[0] & 3) == 1);
+
+	// The receiver stopped early: some slots are missing
+	CHECK(!OneWireCodec::decodeBits(symbols, toSymbols(scratchpadSlots, 40, symbols), data, 72));
+
+	// A symbol that starts high is not a slot
+	toSymbols(scratchpadSlots, 72, symbols);
+	symbols[5].level0 = 1;
+	CHECK(!OneWireCodec::decodeBits(symbols, 72, data, 72));
+
+	// What we send is read back as the same bits, like on a bus where nobody pulls low
+	uint8_t sent[2] = { 0x3A, 0xC5 };
+	uint8_t received[2];
+	OneWireCodec::encodeBits(sent, 16, symbols);
+	CHECK(OneWireCodec::decodeBits(symbols, 16, received, 16));
+	CHECK(memcmp(sent, received, 2) == 0);
+
+	printf("%s\n", failures == 0 ? "All checks passed" : "Some checks failed");
+	return(failures == 0 ? 0 : 1);
+}
@@ -0,0 +1,165 @@
+#!/usr/bin/env python3
+# A stand-in for an mqtt server with TLS, to test the TLS transport of EvtMqtt on a local network. It prints how long each
+# handshake took and whether the TLS session was resumed. It's a tiny broker: it accepts any client, answers QoS 1 and 2
+# publishes, and sends publishes on to the clients that subscribed. --drop closes connections after some seconds, so the
+# ESP32 reconnects and should resume its session.
+#
+# Make a CA and a server certificate for the name the ESP32 connects to (here mqtt.local):
+#   openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes -days 3650 -subj /CN=TestCA -keyout ca.key -out ca.crt
+#   openssl req -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes -subj /CN=mqtt.local -keyout server.key -out server.csr
+#   openssl x509 -req -in server.csr -CA ca.crt -CAkey ca.key -CAcreateserial -days 3650 -extfile <(echo subjectAltName=DNS:mqtt.local) -out server.crt
+# Run it:
+#   python3 TlsBroker.py --cert server.crt --key server.key --drop 30
+# Give ca.crt to evtMqtt.setTls(), and mqtt.local and port 8883 to evtMqtt.begin()
+import argparse
+import select
+import socket
+import ssl
+import struct
+import threading
+import time
+
+CONNECT, CONNACK, PUBLISH, PUBACK, PUBREC, PUBREL, PUBCOMP = 1, 2, 3, 4, 5, 6, 7
+SUBSCRIBE, SUBACK, PINGREQ, PINGRESP, DISCONNECT = 8, 9, 12, 13, 14
+
+subscriptions = {}   # Connection -> list of topic filters
+subscriptionsLock = threading.Lock()
+
+
+def matches(topicFilter, topic):
+    filterLevels = topicFilter.split("/")
+    topicLevels = topic.split("/")
+    for i, level in enumerate(filterLevels):
+        if level == "#":
+            return True
+        if i >= len(topicLevels) or (level != "+" and level != topicLevels[i]):
+            return False
+    return len(filterLevels) == len(topicLevels)
+
+
+def readExactly(connection, length):
+    data = b""
+    while len(data) < length:
+        chunk = connection.recv(length - len(data))
+        if not chunk:
+            raise ConnectionError("closed")
+        data += chunk
+    return data
+
+
+def readPacket(connection):
+    header = readExactly(connection, 1)[0]
+    length, shift = 0, 0
+    while True:
+        byte = readExactly(connection, 1)[0]
+        length |= (byte & 0x7F) << shift
+        shift += 7
+        if byte & 0x80 == 0:
+            break
+    return header, readExactly(connection, length)
+
+
+def packet(header, body=b""):
+    length = len(body)
+    encoded = b""
+    while True:
+        byte = length & 0x7F
+        length >>= 7
+        encoded += bytes([byte | (0x80 if length else 0)])
+        if not length:
+            return bytes([header]) + encoded + body
+
+
+def serve(connection, address, started, drop):
+    name = "%s:%d" % address
+    try:
+        connection.do_handshake()
+        print("%s: TLS %s in %.0f ms, %s %s" % (name, "session resumed" if connection.session_reused else "full handshake",
+              (time.monotonic() - started) * 1000, connection.version(), connection.cipher()[0]))
+        while True:
+            if drop > 0 and time.monotonic() - started > drop:
+                print("%s: dropping the connection" % name)
+                break
+            if not connection.pending() and not select.select([connection], [], [], 0.5)[0]:
+                continue
+            header, body = readPacket(connection)
+            kind = header >> 4
+            if kind == CONNECT:
+                clientIdLength = struct.unpack(">H", body[10:12])[0]
+                print("%s: CONNECT from %s, clean session %d" % (name, body[12:12 + clientIdLength].decode(errors="replace"), (body[7] >> 1) & 1))
+                connection.sendall(packet(CONNACK << 4, b"\x00\x00"))
+            elif kind == SUBSCRIBE:
+                packetId = body[:2]
+                granted, position = b"", 2
+                while position < len(body):
+                    topicLength = struct.unpack(">H", body[position:position + 2])[0]
+                    topic = body[position + 2:position + 2 + topicLength].decode()
+                    granted += bytes([body[position + 2 + topicLength]])
+                    position += 3 + topicLength
+                    with subscriptionsLock:
+                        subscriptions.setdefault(connection, []).append(topic)
+                    print("%s: SUBSCRIBE %s" % (name, topic))
+                connection.sendall(packet(SUBACK << 4, packetId + granted))
+            elif kind == PUBLISH:
+                qos = (header >> 1) & 3
+                topicLength = struct.unpack(">H", body[:2])[0]
+                topic = body[2:2 + topicLength].decode(errors="replace")
+                position = 2 + topicLength
+                packetId = body[position:position + 2] if qos else b""
+                payload = body[position + len(packetId):]
+                print("%s: PUBLISH %s QoS %d%s: %r" % (name, topic, qos, " DUP" if header & 8 else "", payload[:60]))
+                if qos == 1:
+                    connection.sendall(packet(PUBACK << 4, packetId))
+                elif qos == 2:
+                    connection.sendall(packet(PUBREC << 4, packetId))
+                with subscriptionsLock:
+                    receivers = [other for other, filters in subscriptions.items() if any(matches(f, topic) for f in filters)]
+                for other in receivers:   # Sent on with QoS 0
+                    try:
+                        other.sendall(packet(PUBLISH << 4, body[:2 + topicLength] + payload))
+                    except OSError:
+                        pass
+            elif kind == PUBREL:
+                connection.sendall(packet(PUBCOMP << 4, body[:2]))
+            elif kind == PINGREQ:
+                connection.sendall(packet(PINGRESP << 4))
+            elif kind == DISCONNECT:
+                break
+    except (ConnectionError, OSError, ssl.SSLError) as error:
+        print("%s: %s" % (name, error))
+    finally:
+        with subscriptionsLock:
+            subscriptions.pop(connection, None)
+        try:
+            connection.settimeout(1)
+            connection.unwrap()   # Without a close notify OpenSSL forgets the session, and it can't be resumed
+        except (OSError, ValueError, ssl.SSLError):
+            pass
+        connection.close()
+        print("%s: closed" % name)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="A TLS mqtt server stand-in that shows TLS session resumption")
+    parser.add_argument("--cert", required=True, help="the certificate of the server in PEM format")
+    parser.add_argument("--key", required=True, help="the private key of the certificate")
+    parser.add_argument("--port", type=int, default=8883)
+    parser.add_argument("--drop", type=float, default=0, help="close each connection after this many seconds. 0 keeps them")
+    arguments = parser.parse_args()
+
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    context.load_cert_chain(arguments.cert, arguments.key)
+    context.maximum_version = ssl.TLSVersion.TLSv1_2   # Like the ESP32. Sessions are resumed by id, as EvtMqtt asks for
+    context.options |= ssl.OP_NO_TICKET
+
+    listener = socket.create_server(("", arguments.port))
+    print("Listening on port %d" % arguments.port)
+    while True:
+        plain, address = listener.accept()
+        started = time.monotonic()
+        connection = context.wrap_socket(plain, server_side=True, do_handshake_on_connect=False)
+        threading.Thread(target=serve, args=(connection, address, started, arguments.drop), daemon=True).start()
+
+
+if __name__ == "__main__":
+    main()
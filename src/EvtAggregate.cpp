@@ -0,0 +1,152 @@
+#include "EvtAggregate.h"
+
+portMUX_TYPE EvtAggregate::mux = portMUX_INITIALIZER_UNLOCKED;
+AggregateSeries EvtAggregate::series[AGGREGATE_MAX_SERIES];
+uint8_t EvtAggregate::numOfSeries = 0;
+TaskHandle_t EvtAggregate::taskHandle = NULL;
+
+
+
+/* Constructor, starts the task that reports the windows */
+EvtAggregate::EvtAggregate() {
+	if (taskHandle == NULL) {   // One task handles all series
+		logger.send(DEBUG, "AGG", "Starting aggregation task");
+		EvtAlloc::createTask(
+			TaskAggregate,			// Task function to call.
+			"Aggregate",			// Name of task.
+			AGGREGATE_STACK_SIZE,	// Stack size in words
+			NULL,					// We don't need to pass any parameters
+			1,						// Priority of the task.
+			&taskHandle);			// Used to wake the task when a value deviates
+	}
+}
+
+
+
+/*	Adds a series of values to aggregate. Parameters:
+	windowLength: length of the window in ms
+	steps: 1 for a tumbling window that is reported every windowLength. More for a sliding window that is reported every
+		windowLength/steps with the statistics of the last windowLength. Max AGGREGATE_MAX_STEPS
+	deviation: if a value differs more than this from the last reported value, the window is reported at once. Before the
+		first report it is compared with the first value. 0 turns it off
+	callBackFunc: the function that gets the summary of the window
+	Returns the index of the series to use with add(). -1 if it could not be added
+*/
+int EvtAggregate::addSeries(unsigned long windowLength, uint8_t steps, float deviation, AggregateCbFunc callBackFunc) {
+	if (steps == 0 || steps > AGGREGATE_MAX_STEPS || windowLength < steps) {
+		logger.send(ERR, "AGG", "A window of %lu ms can't be split in %d steps", windowLength, steps);
+		return(-1);
+	}
+	if (numOfSeries == AGGREGATE_MAX_SERIES) {
+		logger.send(ERR, "AGG", "No more than %d series can be aggregated", AGGREGATE_MAX_SERIES);
+		return(-1);
+	}
+
+	uint8_t index = numOfSeries;
+	series[index].steps = steps;
+	series[index].stepLength = windowLength / steps;
+	series[index].stepStarted = millis();
+	series[index].deviation = deviation;
+	series[index].callBackFunc = callBackFunc;
+	portENTER_CRITICAL(&mux);
+	numOfSeries++;   // Counted last, so the task never sees a half made series
+	portEXIT_CRITICAL(&mux);
+
+	logger.send(DEBUG, "AGG", "Series %d has a window of %lu ms in %d steps", index, windowLength, steps);
+	xTaskNotifyGive(taskHandle);   // The task must know when the first step of the new series ends
+	return(index);
+}
+
+
+
+/*	Adds a value to a series. It can be called from any task. Parameters:
+	seriesIndex: the series from addSeries()
+	value: the value
+*/
+void EvtAggregate::add(uint8_t seriesIndex, float value) {
+	bool wake = false;
+	portENTER_CRITICAL(&mux);
+	if (seriesIndex < numOfSeries) {
+		AggregateSeries *s = &series[seriesIndex];
+		AggregateBucket *bucket = &s->buckets[s->currentStep];
+		if (bucket->count == 0 || value < bucket->min) bucket->min = value;
+		if (bucket->count == 0 || value > bucket->max) bucket->max = value;
+		bucket->sum += value;
+		bucket->count++;
+		s->last = value;
+		if (!s->hasReference) {   // The first value of the series. A jump in the first window is reported too
+			s->lastReported = value;
+			s->hasReference = true;
+		}
+		if (s->deviation > 0 && fabs(value - s->lastReported) > s->deviation && !s->deviationPending) {
+			s->deviationPending = true;
+			wake = true;
+		}
+	}
+	portEXIT_CRITICAL(&mux);
+	if (wake) xTaskNotifyGive(taskHandle);
+}
+
+
+
+/*	Makes the summary of the whole window and calls the callback. Parameters:
+	seriesIndex: the series to report
+	deviation: true if it's reported early because of a deviation
+*/
+void EvtAggregate::report(uint8_t seriesIndex, bool deviation) {
+	AggregateSeries *s = &series[seriesIndex];
+	AggregateSummary summary;
+	double sum = 0;
+	summary.count = 0;
+	portENTER_CRITICAL(&mux);
+	for (uint8_t i = 0; i < s->steps; i++) {
+		AggregateBucket *bucket = &s->buckets[i];
+		if (bucket->count == 0) continue;
+		if (summary.count == 0 || bucket->min < summary.min) summary.min = bucket->min;
+		if (summary.count == 0 || bucket->max > summary.max) summary.max = bucket->max;
+		sum += bucket->sum;
+		summary.count += bucket->count;
+	}
+	summary.last = s->last;
+	s->deviationPending = false;
+	if (summary.count > 0) {
+		s->lastReported = s->last;
+	}
+	portEXIT_CRITICAL(&mux);
+
+	if (summary.count == 0) return;   // Nothing to report in an empty window
+	summary.mean = sum / summary.count;
+	summary.deviation = deviation;
+	logger.send(DEBUG, "AGG", "Series %d: %d values, min %.2f, max %.2f, mean %.2f", seriesIndex, summary.count, summary.min, summary.max, summary.mean);
+	s->callBackFunc(seriesIndex, summary);   // Done outside the lock, so the callback can take its time
+}
+
+
+
+/*	The task that reports the windows. It sleeps until the next step of a series ends, or until a value deviates.
+	This has to be a static method because eps32 tasks can't call an instance member of a class!
+*/
+void EvtAggregate::TaskAggregate(void *pvParameters) {
+	while (true) {
+		unsigned long now = millis();
+		unsigned long sleepTime = portMAX_DELAY;
+		for (uint8_t i = 0; i < numOfSeries; i++) {
+			AggregateSeries *s = &series[i];
+			if (s->deviationPending) report(i, true);
+
+			if (now - s->stepStarted >= s->stepLength) {
+				report(i, false);
+				portENTER_CRITICAL(&mux);
+				s->currentStep = (s->currentStep + 1) % s->steps;
+				s->buckets[s->currentStep].count = 0;   // The oldest step leaves the window
+				s->buckets[s->currentStep].sum = 0;
+				s->stepStarted += s->stepLength;
+				if (now - s->stepStarted >= s->stepLength) s->stepStarted = now;   // We are far behind. Don't catch up
+				portEXIT_CRITICAL(&mux);
+			}
+			unsigned long untilNextStep = s->stepLength - (now - s->stepStarted);
+			if (untilNextStep < sleepTime) sleepTime = untilNextStep;
+		}
+		ulTaskNotifyTake(pdTRUE, sleepTime == portMAX_DELAY ? portMAX_DELAY : sleepTime / portTICK_PERIOD_MS + 1);   // A deviation or a new series wakes us early
+	}
+}
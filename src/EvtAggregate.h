@@ -0,0 +1,72 @@
+#ifndef _EVTAGGREGATE_h
+#define _EVTAGGREGATE_h
+
+#include <Arduino.h>
+#include "EvtLogger.h"
+#include "EvtAlloc.h"
+#include "EvtCallback.h"
+
+#define AGGREGATE_STACK_SIZE 4000
+#define AGGREGATE_MAX_SERIES 16
+#define AGGREGATE_MAX_STEPS 12   // Max number of steps a sliding window can be split in
+
+
+
+// The statistics of a window. It's given to the callback when the window is reported
+struct AggregateSummary {
+	float min;
+	float max;
+	float mean;
+	float last;   // The newest value
+	uint32_t count;
+	bool deviation;   // True if reported early, because a value moved more than the deviation from the last report
+};
+
+
+// Definition of the callback function that is called with the summary of a window
+typedef EvtCallback<void(uint8_t seriesIndex, AggregateSummary &summary)> AggregateCbFunc;
+
+
+// Running statistics of one step of a window
+struct AggregateBucket {
+	float min;
+	float max;
+	double sum;
+	uint32_t count = 0;
+};
+
+
+/*	A series of values that are aggregated. The window is split in steps. Each step has its own bucket, and when a step is over
+	the buckets of the whole window are reported together. With 1 step the window is tumbling. With more it slides one step at a time.
+*/
+struct AggregateSeries {
+	uint8_t steps;
+	unsigned long stepLength;   // ms
+	unsigned long stepStarted;
+	uint8_t currentStep = 0;
+	AggregateBucket buckets[AGGREGATE_MAX_STEPS];
+	float last = 0;
+	float deviation;   // 0 if there is no report on deviation
+	float lastReported = 0;   // Deviations are measured from it. Until the first report it's the first value of the series
+	bool hasReference = false;   // True when lastReported holds a value
+	bool deviationPending = false;
+	AggregateCbFunc callBackFunc;
+};
+
+
+
+class EvtAggregate {
+private:
+	static portMUX_TYPE mux;
+	static AggregateSeries series[AGGREGATE_MAX_SERIES];
+	static uint8_t numOfSeries;
+	static TaskHandle_t taskHandle;
+	static void TaskAggregate(void *pvParameters);
+	static void report(uint8_t seriesIndex, bool deviation);
+public:
+	EvtAggregate();
+	int addSeries(unsigned long windowLength, uint8_t steps, float deviation, AggregateCbFunc callBackFunc);
+	void add(uint8_t seriesIndex, float value);
+};
+
+#endif
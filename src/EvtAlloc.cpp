@@ -0,0 +1,186 @@
+#include "EvtAlloc.h"
+#include "EvtLogger.h"
+
+// Without static allocation the pools are not used. They get one element, so they take no room
+#if EVT_STATIC_ALLOCATION
+StackType_t EvtAlloc::stackPool[EVT_STATIC_STACK_POOL / sizeof(StackType_t)];
+StaticTask_t EvtAlloc::taskBuffers[EVT_STATIC_MAX_TASKS];
+uint8_t EvtAlloc::queuePool[EVT_STATIC_QUEUE_POOL];
+StaticQueue_t EvtAlloc::queueBuffers[EVT_STATIC_MAX_QUEUES];
+alignas(8) uint8_t EvtAlloc::objectPool[EVT_STATIC_OBJECT_POOL];
+#else
+StackType_t EvtAlloc::stackPool[1];
+StaticTask_t EvtAlloc::taskBuffers[1];
+uint8_t EvtAlloc::queuePool[1];
+StaticQueue_t EvtAlloc::queueBuffers[1];
+uint8_t EvtAlloc::objectPool[1];
+#endif
+AllocStats EvtAlloc::stats;
+bool EvtAlloc::locked = false;
+uint32_t EvtAlloc::lockedFreeHeap = 0;
+portMUX_TYPE EvtAlloc::mux = portMUX_INITIALIZER_UNLOCKED;
+
+
+
+/*	Makes a task. It takes the same parameters as xTaskCreate(). With static allocation the stack and the task control block
+	come from the pools. Returns true if the task was made
+*/
+bool EvtAlloc::createTask(TaskFunction_t function, const char* name, uint32_t stackSize, void* parameters, UBaseType_t priority, TaskHandle_t* handle) {
+	noteAllocation(name);
+#if EVT_STATIC_ALLOCATION
+	StackType_t *stack = nullptr;
+	StaticTask_t *taskBuffer = nullptr;
+	portENTER_CRITICAL(&mux);
+	if (stats.tasks < EVT_STATIC_MAX_TASKS && (stats.stackUsed + stackSize) * sizeof(StackType_t) <= EVT_STATIC_STACK_POOL) {
+		stack = stackPool + stats.stackUsed;   // The stack size is counted in StackType_t. On the ESP32 that is bytes
+		taskBuffer = &taskBuffers[stats.tasks];
+		stats.stackUsed += stackSize;
+		stats.tasks++;
+	} else {
+		stats.fallbacks++;   // Counted here, because several tasks may fall back at once
+	}
+	portEXIT_CRITICAL(&mux);
+	if (stack != nullptr) {
+		TaskHandle_t created = xTaskCreateStatic(function, name, stackSize, parameters, priority, stack, taskBuffer);
+		if (handle != NULL) *handle = created;
+		return(created != NULL);
+	}
+#endif
+	return(xTaskCreate(function, name, stackSize, parameters, priority, handle) == pdPASS);
+}
+
+
+
+/*	Makes a queue. It takes the same parameters as xQueueCreate(). With static allocation the items and the queue control
+	block come from the pools. It may be called before setup(), so it doesn't log. Returns the queue, or NULL if there is no memory
+*/
+QueueHandle_t EvtAlloc::createQueue(UBaseType_t length, UBaseType_t itemSize) {
+	noteAllocation("queue");
+#if EVT_STATIC_ALLOCATION
+	uint8_t *storage = nullptr;
+	StaticQueue_t *queueBuffer = nullptr;
+	uint32_t size = (length * itemSize + 3) & ~3;   // The next queue starts word aligned
+	portENTER_CRITICAL(&mux);
+	if (stats.queues < EVT_STATIC_MAX_QUEUES && stats.queueUsed + size <= EVT_STATIC_QUEUE_POOL) {
+		storage = queuePool + stats.queueUsed;
+		queueBuffer = &queueBuffers[stats.queues];
+		stats.queueUsed += size;
+		stats.queues++;
+	} else {
+		stats.fallbacks++;
+	}
+	portEXIT_CRITICAL(&mux);
+	if (storage != nullptr) return(xQueueCreateStatic(length, itemSize, storage, queueBuffer));
+#endif
+	return(xQueueCreate(length, itemSize));
+}
+
+
+
+/*	Gets memory for an object. Use create() to make objects. Parameters:
+	size: bytes
+	alignment: the alignment the memory must have. A power of 2
+	Returns the memory, or nullptr if there is none
+*/
+void* EvtAlloc::allocate(size_t size, size_t alignment) {
+	noteAllocation("object");
+#if EVT_STATIC_ALLOCATION
+	void *memory = nullptr;
+	portENTER_CRITICAL(&mux);
+	uint32_t start = (stats.objectUsed + alignment - 1) & ~(alignment - 1);
+	if (start + size <= EVT_STATIC_OBJECT_POOL) {
+		memory = objectPool + start;
+		stats.objectUsed = start + size;
+	} else {
+		stats.fallbacks++;
+	}
+	portEXIT_CRITICAL(&mux);
+	if (memory != nullptr) return(memory);
+#endif
+	return(malloc(size));
+}
+
+
+
+/*	Gives memory from allocate() back. In the object pool it's only given back if it's the last that was taken. Parameters:
+	memory: what allocate() returned
+	size: the size that was asked for
+*/
+void EvtAlloc::release(void* memory, size_t size) {
+#if EVT_STATIC_ALLOCATION
+	if ((uint8_t*)memory >= objectPool && (uint8_t*)memory < objectPool + EVT_STATIC_OBJECT_POOL) {
+		portENTER_CRITICAL(&mux);
+		if ((uint8_t*)memory + size == objectPool + stats.objectUsed) stats.objectUsed = (uint8_t*)memory - objectPool;
+		portEXIT_CRITICAL(&mux);
+		return;
+	}
+#endif
+	free(memory);
+}
+
+
+
+/* Counts and logs library allocations that are made after boot. Parameters:
+	what: the name of the task, or the kind of allocation
+*/
+void EvtAlloc::noteAllocation(const char* what) {
+	if (!locked) return;
+	stats.allocationsAfterLock++;
+	logger.send(ERR, "ALC", "Allocation after boot: %s", what);
+}
+
+
+
+/* Returns how much of the pools is used and how the heap looks now */
+AllocStats EvtAlloc::getStats() {
+	portENTER_CRITICAL(&mux);
+	AllocStats current = stats;
+	portEXIT_CRITICAL(&mux);
+	current.freeHeap = ESP.getFreeHeap();
+	current.minFreeHeap = ESP.getMinFreeHeap();
+	current.largestFreeBlock = ESP.getMaxAllocHeap();
+	return(current);
+}
+
+
+
+/* Logs the use of the pools and the heap. Call it at the end of setup(), when everything has been started */
+void EvtAlloc::report() {
+	AllocStats current = getStats();
+	logger.send(NOTICE, "ALC", "Heap: %u bytes free, %u at the lowest, largest block %u", current.freeHeap, current.minFreeHeap, current.largestFreeBlock);
+#if EVT_STATIC_ALLOCATION
+	logger.send(NOTICE, "ALC", "Static stacks: %u of %u bytes for %d tasks", current.stackUsed * sizeof(StackType_t), EVT_STATIC_STACK_POOL, current.tasks);
+	logger.send(NOTICE, "ALC", "Static queues: %u of %u bytes for %d queues", current.queueUsed, EVT_STATIC_QUEUE_POOL, current.queues);
+	logger.send(NOTICE, "ALC", "Static objects: %u of %u bytes", current.objectUsed, EVT_STATIC_OBJECT_POOL);
+	if (current.fallbacks > 0) logger.send(WARN, "ALC", "%d allocations went to the heap because a pool was full", current.fallbacks);
+#else
+	logger.send(NOTICE, "ALC", "Static allocation is off. Tasks, queues and objects are on the heap");
+#endif
+}
+
+
+
+/*	Marks the end of boot. From now on an allocation by the library is logged as an error, and check() compares the free heap
+	with what it is now
+*/
+void EvtAlloc::lock() {
+	locked = true;
+	lockedFreeHeap = ESP.getFreeHeap();
+	logger.send(INFO, "ALC", "Boot done with %u bytes of heap free", lockedFreeHeap);
+}
+
+
+
+/*	Checks that the heap hasn't shrunk since lock(). Call it now and then, like every hour. Returns false and logs a warning if
+	the free heap has dropped more than EVT_HEAP_GUARD_MARGIN, or the library has allocated after lock()
+*/
+bool EvtAlloc::check() {
+	if (!locked) return(true);
+	uint32_t freeHeap = ESP.getFreeHeap();
+	bool ok = stats.allocationsAfterLock == 0;
+	if (freeHeap + EVT_HEAP_GUARD_MARGIN < lockedFreeHeap) {
+		logger.send(WARN, "ALC", "Free heap has dropped %u bytes since boot. Largest block is %u", lockedFreeHeap - freeHeap, ESP.getMaxAllocHeap());
+		ok = false;
+	}
+	return(ok);
+}
@@ -0,0 +1,86 @@
+#ifndef _EVTALLOC_h
+#define _EVTALLOC_h
+
+#include <Arduino.h>
+#include <new>
+#include <utility>
+
+#ifndef EVT_STATIC_ALLOCATION
+#define EVT_STATIC_ALLOCATION false   // true puts task stacks, queues and library objects in the static pools below instead of the heap
+#endif
+#define EVT_STATIC_STACK_POOL 60000   // Bytes for the stacks of all tasks. The sum of the *_STACK_SIZE of the modules in use
+#define EVT_STATIC_MAX_TASKS 14
+#define EVT_STATIC_QUEUE_POOL 10240   // Bytes for the items of all queues. The log queue alone takes about 6000
+#define EVT_STATIC_MAX_QUEUES 10
+#define EVT_STATIC_OBJECT_POOL 8192   // Bytes for buses, onewire backends, sensor drivers, the mqtt client and the subscribed topic tree
+#define EVT_HEAP_GUARD_MARGIN 1024   // check() warns when the free heap has dropped more than this since lock()
+
+
+
+// How much of the static pools is used, and how the heap looks. Sizes are in bytes
+struct AllocStats {
+	uint32_t stackUsed = 0;
+	uint8_t tasks = 0;
+	uint32_t queueUsed = 0;
+	uint8_t queues = 0;
+	uint32_t objectUsed = 0;
+	uint16_t fallbacks = 0;   // Things that went to the heap because a pool was full. Raise the pool size if it isn't 0
+	uint16_t allocationsAfterLock = 0;   // Library allocations made after lock(). They should all be made at boot
+	uint32_t freeHeap = 0;
+	uint32_t minFreeHeap = 0;
+	uint32_t largestFreeBlock = 0;   // The largest allocation that can succeed. It shrinks when the heap fragments
+};
+
+
+
+/*	Where the library gets its memory. All tasks, queues and objects of the library are made through here. With
+	EVT_STATIC_ALLOCATION false they come from the heap as usual. With it true they come from static pools that are part of
+	the program image, so they can't fail or fragment the heap on a device that runs for months. When a pool is full the heap
+	is used anyway, and it's counted in the stats. Objects in the object pool are never freed.
+	Call report() at the end of setup() to see what was used, and lock() to mark the end of boot. After lock() an allocation
+	by the library is logged as an error, and check() warns if the free heap has dropped. Other code (WiFi, TLS) still uses the heap
+*/
+class EvtAlloc {
+private:
+	static StackType_t stackPool[];
+	static StaticTask_t taskBuffers[];
+	static uint8_t queuePool[];
+	static StaticQueue_t queueBuffers[];
+	static uint8_t objectPool[];
+	static AllocStats stats;
+	static bool locked;
+	static uint32_t lockedFreeHeap;
+	static portMUX_TYPE mux;
+	static void noteAllocation(const char* what);
+public:
+	static bool createTask(TaskFunction_t function, const char* name, uint32_t stackSize, void* parameters, UBaseType_t priority, TaskHandle_t* handle);
+	static QueueHandle_t createQueue(UBaseType_t length, UBaseType_t itemSize);
+	static void* allocate(size_t size, size_t alignment = sizeof(void*));
+	static void release(void* memory, size_t size);
+
+	/*	Makes an object with new, or in the object pool. Parameters:
+		args: given to the constructor
+		Returns the object, or nullptr if there is no memory
+	*/
+	template<typename T, typename... Args> static T* create(Args&&... args) {
+		void *memory = allocate(sizeof(T), alignof(T));
+		if (memory == nullptr) return(nullptr);
+		return(new (memory) T(std::forward<Args>(args)...));
+	}
+
+	/*	Destroys an object made with create(). In the object pool the memory is only given back if it was the last object made,
+		like a backend that failed to start. Otherwise it stays used
+	*/
+	template<typename T> static void destroy(T* object) {
+		if (object == nullptr) return;
+		object->~T();
+		release(object, sizeof(T));
+	}
+
+	static AllocStats getStats();
+	static void report();
+	static void lock();
+	static bool check();
+};
+
+#endif
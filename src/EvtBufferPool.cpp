@@ -0,0 +1,53 @@
+#include "EvtBufferPool.h"
+
+
+portMUX_TYPE EvtBufferPool::mux = portMUX_INITIALIZER_UNLOCKED;
+char EvtBufferPool::smallBuffers[BUFFER_POOL_SMALL_COUNT][BUFFER_POOL_SMALL_SIZE];
+char EvtBufferPool::mediumBuffers[BUFFER_POOL_MEDIUM_COUNT][BUFFER_POOL_MEDIUM_SIZE];
+char EvtBufferPool::largeBuffers[BUFFER_POOL_LARGE_COUNT][BUFFER_POOL_LARGE_SIZE];
+
+// From smallest to largest. All buffers start out free.
+BufferClass EvtBufferPool::bufferClasses[3] = {
+	{ &smallBuffers[0][0], BUFFER_POOL_SMALL_SIZE, BUFFER_POOL_SMALL_COUNT, (uint32_t)((1ULL << BUFFER_POOL_SMALL_COUNT) - 1) },
+	{ &mediumBuffers[0][0], BUFFER_POOL_MEDIUM_SIZE, BUFFER_POOL_MEDIUM_COUNT, (uint32_t)((1ULL << BUFFER_POOL_MEDIUM_COUNT) - 1) },
+	{ &largeBuffers[0][0], BUFFER_POOL_LARGE_SIZE, BUFFER_POOL_LARGE_COUNT, (uint32_t)((1ULL << BUFFER_POOL_LARGE_COUNT) - 1) }
+};
+
+
+
+/*	Takes a free buffer from the pool. If all buffers of the best fitting size are taken, a larger one is used. Parameters:
+	length: the number of bytes the buffer must be able to hold
+	Returns a pointer to the buffer or nullptr if no buffer is free. It must be given back with give() when not needed anymore
+*/
+char* EvtBufferPool::take(size_t length) {
+	char* buffer = nullptr;
+	portENTER_CRITICAL(&mux);
+	for (uint8_t c = 0; c < 3 && buffer == nullptr; c++) {
+		BufferClass *bufferClass = &bufferClasses[c];
+		if (length <= bufferClass->bufferSize && bufferClass->freeMask != 0) {
+			uint8_t index = __builtin_ctz(bufferClass->freeMask);   // The lowest free buffer
+			bufferClass->freeMask &= ~(1UL << index);
+			buffer = bufferClass->memory + index * bufferClass->bufferSize;
+		}
+	}
+	portEXIT_CRITICAL(&mux);
+	return(buffer);
+}
+
+
+
+/*	Gives a buffer back to the pool, so it can be used again. Parameters:
+	buffer: a buffer from take(). nullptr is ignored
+*/
+void EvtBufferPool::give(char* buffer) {
+	if (buffer == nullptr) return;
+	portENTER_CRITICAL(&mux);
+	for (uint8_t c = 0; c < 3; c++) {
+		BufferClass *bufferClass = &bufferClasses[c];
+		if (buffer >= bufferClass->memory && buffer < bufferClass->memory + bufferClass->bufferCount * bufferClass->bufferSize) {
+			bufferClass->freeMask |= 1UL << ((buffer - bufferClass->memory) / bufferClass->bufferSize);
+			break;
+		}
+	}
+	portEXIT_CRITICAL(&mux);
+}
@@ -0,0 +1,38 @@
+#ifndef _EVTBUFFERPOOL_h
+#define _EVTBUFFERPOOL_h
+
+#include <Arduino.h>
+
+// The pool has 3 sizes of buffers. A buffer is taken from the smallest size that can hold the data. Max 32 buffers of each size.
+#define BUFFER_POOL_SMALL_SIZE 16
+#define BUFFER_POOL_SMALL_COUNT 16
+#define BUFFER_POOL_MEDIUM_SIZE 128
+#define BUFFER_POOL_MEDIUM_COUNT 4
+#define BUFFER_POOL_LARGE_SIZE 1280   // A received mqtt message must fit. EvtMqtt checks it against MQTT_PACKET_SIZE
+#define BUFFER_POOL_LARGE_COUNT 2
+
+
+
+// One size of buffers in the pool. A bit in freeMask is set for each buffer that is free to take.
+struct BufferClass {
+	char* memory;
+	uint16_t bufferSize;
+	uint8_t bufferCount;
+	uint32_t freeMask;
+};
+
+
+
+class EvtBufferPool {
+private:
+	static portMUX_TYPE mux;
+	static char smallBuffers[BUFFER_POOL_SMALL_COUNT][BUFFER_POOL_SMALL_SIZE];
+	static char mediumBuffers[BUFFER_POOL_MEDIUM_COUNT][BUFFER_POOL_MEDIUM_SIZE];
+	static char largeBuffers[BUFFER_POOL_LARGE_COUNT][BUFFER_POOL_LARGE_SIZE];
+	static BufferClass bufferClasses[3];
+public:
+	static char* take(size_t length);
+	static void give(char* buffer);
+};
+
+#endif
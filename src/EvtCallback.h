@@ -0,0 +1,103 @@
+#ifndef _EVTCALLBACK_h
+#define _EVTCALLBACK_h
+
+#include <cstddef>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+#include <utility>
+
+#define EVT_CALLBACK_SIZE 12   // Bytes a lambda may capture. 3 pointers or ints on the ESP32
+
+
+
+/*	The bytes of a callback of any signature. It's used where callbacks with different signatures are kept together, like
+	the subscriptions of EvtMqtt. invoker is the invoker of the signature, cast to a plain function pointer
+*/
+struct EvtCallbackData {
+	alignas(8) uint8_t storage[EVT_CALLBACK_SIZE];
+	void(*invoker) () = nullptr;
+};
+
+
+template<typename Signature> class EvtCallback;
+
+
+
+/*	Something to call back: a function, a function with a void* context, or a lambda. A lambda is stored inside the callback,
+	so registering one never allocates. The compiler refuses a lambda that captures more than EVT_CALLBACK_SIZE bytes, or
+	captures something that can't be copied byte by byte (like a String). So a callback can be copied with memcpy, and
+	put in a FreeRTOS queue. A call goes through one function pointer, like a plain function pointer did. Examples:
+	evtTime.triggerIn(1000, cbDone);   // A function
+	evtTime.triggerIn(1000, TimeInCbFunc(cbDoneWithContext, &relay));   // C style. The void* is given as the first argument
+	evtTime.triggerIn(1000, [this](unsigned long ms) { done(ms); });   // A lambda
+*/
+template<typename R, typename... Args> class EvtCallback<R(Args...)> {
+private:
+	typedef R(*Invoker) (const void* storage, Args... args);
+	typedef R(*Function) (Args... args);
+	typedef R(*ContextFunction) (void* context, Args... args);
+	struct ContextCall {
+		ContextFunction function;
+		void* context;
+	};
+
+	EvtCallbackData data;
+
+	static R invokeFunction(const void* storage, Args... args) {
+		return((*(const Function*)storage)(std::forward<Args>(args)...));
+	}
+	static R invokeContext(const void* storage, Args... args) {
+		const ContextCall *call = (const ContextCall*)storage;
+		return(call->function(call->context, std::forward<Args>(args)...));
+	}
+	template<typename F> static R invokeFunctor(const void* storage, Args... args) {
+		return((*(F*)storage)(std::forward<Args>(args)...));
+	}
+	void setInvoker(Invoker invoker) {
+		data.invoker = (void(*) ())invoker;
+	}
+public:
+	EvtCallback() {}
+	EvtCallback(std::nullptr_t) {}
+
+	EvtCallback(Function function) {
+		if (function == nullptr) return;
+		memcpy(data.storage, &function, sizeof(function));
+		setInvoker(invokeFunction);
+	}
+
+	EvtCallback(ContextFunction function, void* context) {
+		ContextCall call = { function, context };
+		memcpy(data.storage, &call, sizeof(call));
+		setInvoker(invokeContext);
+	}
+
+	template<typename F, typename = decltype(std::declval<F&>()(std::declval<Args>()...)),
+		typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, EvtCallback>::value>::type> EvtCallback(F functor) {
+		static_assert(sizeof(F) <= EVT_CALLBACK_SIZE, "The lambda captures too much. Capture a pointer to the data, or raise EVT_CALLBACK_SIZE");
+		static_assert(alignof(F) <= alignof(EvtCallbackData), "The lambda captures something with a too large alignment");
+		static_assert(std::is_trivially_copyable<F>::value, "The lambda captures something that can't be copied byte by byte. Capture a pointer to it");
+		memcpy(data.storage, &functor, sizeof(F));
+		setInvoker(invokeFunctor<F>);
+	}
+
+	R operator()(Args... args) const {
+		return(((Invoker)data.invoker)(data.storage, std::forward<Args>(args)...));
+	}
+
+	explicit operator bool() const { return(data.invoker != nullptr); }
+	bool operator==(std::nullptr_t) const { return(data.invoker == nullptr); }
+	bool operator!=(std::nullptr_t) const { return(data.invoker != nullptr); }
+
+	// For keeping callbacks of different signatures together. invoke() must be called with the signature it was made with
+	const EvtCallbackData& erase() const { return(data); }
+	static R invoke(const EvtCallbackData& data, Args... args) {
+		return(((Invoker)data.invoker)(data.storage, std::forward<Args>(args)...));
+	}
+};
+
+
+static_assert(std::is_trivially_copyable<EvtCallback<void(int)> >::value, "Callbacks must be copyable with memcpy. They are put in FreeRTOS queues");
+
+#endif
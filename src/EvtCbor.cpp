@@ -0,0 +1,556 @@
+#include "EvtCbor.h"
+
+static const float powersOf10[] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };   // For scaled integer fields
+
+
+
+/*	Makes a writer. Parameters:
+	buffer: where the CBOR is written
+	size: the size of buffer
+*/
+CborWriter::CborWriter(uint8_t* buffer, size_t size) {
+	_buffer = buffer;
+	_size = size;
+}
+
+
+
+/*	Writes the first byte of an item, and the value or length in the shortest form. Parameters:
+	major: the major type (CBOR_UINT, CBOR_TEXT etc)
+	value: the value or length
+*/
+void CborWriter::writeHead(uint8_t major, uint64_t value) {
+	uint8_t head[9];
+	uint8_t length;
+	major <<= 5;
+	if (value < 24) {
+		head[0] = major | value;
+		length = 1;
+	} else if (value <= 0xFF) {
+		head[0] = major | 24;
+		length = 2;
+	} else if (value <= 0xFFFF) {
+		head[0] = major | 25;
+		length = 3;
+	} else if (value <= 0xFFFFFFFFULL) {
+		head[0] = major | 26;
+		length = 5;
+	} else {
+		head[0] = major | 27;
+		length = 9;
+	}
+	for (uint8_t i = length - 1; i > 0; i--) {   // Big endian
+		head[i] = value & 0xFF;
+		value >>= 8;
+	}
+	writeRaw(head, length);
+}
+
+
+
+/* Copies bytes to the buffer. If they don't fit, nothing is written */
+void CborWriter::writeRaw(const void* data, size_t length) {
+	if (_overflow || _length + length > _size) {
+		_overflow = true;
+		return;
+	}
+	memcpy(_buffer + _length, data, length);
+	_length += length;
+}
+
+
+
+void CborWriter::writeUint(uint64_t value) {
+	writeHead(CBOR_UINT, value);
+}
+
+
+
+void CborWriter::writeInt(int64_t value) {
+	if (value >= 0) {
+		writeHead(CBOR_UINT, value);
+	} else {
+		writeHead(CBOR_NEGINT, -1 - value);   // -1 is sent as 0, -2 as 1 and so on
+	}
+}
+
+
+
+void CborWriter::writeFloat(float value) {
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	uint8_t item[5] = { (CBOR_SIMPLE << 5) | 26, (uint8_t)(bits >> 24), (uint8_t)(bits >> 16), (uint8_t)(bits >> 8), (uint8_t)bits };
+	writeRaw(item, sizeof(item));
+}
+
+
+
+void CborWriter::writeBool(bool value) {
+	uint8_t item = (CBOR_SIMPLE << 5) | (value ? 21 : 20);
+	writeRaw(&item, 1);
+}
+
+
+
+void CborWriter::writeNull() {
+	uint8_t item = (CBOR_SIMPLE << 5) | 22;
+	writeRaw(&item, 1);
+}
+
+
+
+void CborWriter::writeText(const char* text) {
+	writeText(text, strlen(text));
+}
+
+
+
+void CborWriter::writeText(const char* text, size_t length) {
+	writeHead(CBOR_TEXT, length);
+	writeRaw(text, length);
+}
+
+
+
+void CborWriter::writeBytes(const uint8_t* data, size_t length) {
+	writeHead(CBOR_BYTES, length);
+	writeRaw(data, length);
+}
+
+
+
+/*	Starts an array. The next count items are its elements. Parameters:
+	count: number of elements. CBOR_INDEFINITE if it's not known. Then the array must be ended with endIndefinite()
+*/
+void CborWriter::beginArray(uint32_t count) {
+	if (count == CBOR_INDEFINITE) {
+		uint8_t item = (CBOR_ARRAY << 5) | 31;
+		writeRaw(&item, 1);
+	} else {
+		writeHead(CBOR_ARRAY, count);
+	}
+}
+
+
+
+/*	Starts a map. The next count pairs of items are its keys and values. Parameters:
+	count: number of pairs. CBOR_INDEFINITE if it's not known. Then the map must be ended with endIndefinite()
+*/
+void CborWriter::beginMap(uint32_t count) {
+	if (count == CBOR_INDEFINITE) {
+		uint8_t item = (CBOR_MAP << 5) | 31;
+		writeRaw(&item, 1);
+	} else {
+		writeHead(CBOR_MAP, count);
+	}
+}
+
+
+
+/* Ends an array or map started with CBOR_INDEFINITE */
+void CborWriter::endIndefinite() {
+	uint8_t item = 0xFF;
+	writeRaw(&item, 1);
+}
+
+
+
+/*	Throws away what is written after length. Used to remove something that didn't fit. Parameters:
+	length: the new length
+*/
+void CborWriter::truncate(size_t length) {
+	if (length <= _length) {
+		_length = length;
+		_overflow = false;
+	}
+}
+
+
+
+size_t CborWriter::length() {
+	return(_length);
+}
+
+
+
+bool CborWriter::overflow() {
+	return(_overflow);
+}
+
+
+
+uint8_t* CborWriter::data() {
+	return(_buffer);
+}
+
+
+
+/*	Makes a reader. Parameters:
+	data: the CBOR. It must stay in memory while it's read
+	length: number of bytes
+*/
+CborReader::CborReader(const uint8_t* data, size_t length) {
+	_data = data;
+	_length = length;
+}
+
+
+
+/*	Reads the first byte of the next item, and its value or length. Nothing is consumed. Parameters:
+	major: set to the major type
+	info: set to the additional information (the lower 5 bits)
+	value: set to the value or length. For floats it's the raw bits
+	headLength: set to the number of bytes read
+	Returns false if there is no complete item head
+*/
+bool CborReader::readHead(uint8_t &major, uint8_t &info, uint64_t &value, size_t &headLength) {
+	if (_position >= _length) return(false);
+	major = _data[_position] >> 5;
+	info = _data[_position] & 0x1F;
+	headLength = 1;
+	if (info < 24 || info == 31) {
+		value = info;
+		return(true);
+	}
+	if (info > 27) return(false);   // Reserved
+	uint8_t valueLength = 1 << (info - 24);
+	if (_position + 1 + valueLength > _length) return(false);
+	value = 0;
+	for (uint8_t i = 0; i < valueLength; i++) value = (value << 8) | _data[_position + 1 + i];
+	headLength += valueLength;
+	return(true);
+}
+
+
+
+/* Returns the major type of the next item. 0xFF if there is none */
+uint8_t CborReader::peekType() {
+	if (_position >= _length) return(0xFF);
+	return(_data[_position] >> 5);
+}
+
+
+
+/* Returns true if all of the data is read */
+bool CborReader::atEnd() {
+	return(_position >= _length);
+}
+
+
+
+bool CborReader::readUint(uint64_t &value) {
+	uint8_t major, info;
+	size_t headLength;
+	if (!readHead(major, info, value, headLength) || major != CBOR_UINT || info == 31) return(false);
+	_position += headLength;
+	return(true);
+}
+
+
+
+bool CborReader::readInt(int64_t &value) {
+	uint8_t major, info;
+	uint64_t raw;
+	size_t headLength;
+	if (!readHead(major, info, raw, headLength) || (major != CBOR_UINT && major != CBOR_NEGINT) || info == 31) return(false);
+	if (raw > (uint64_t)INT64_MAX) return(false);
+	value = major == CBOR_UINT ? (int64_t)raw : -1 - (int64_t)raw;
+	_position += headLength;
+	return(true);
+}
+
+
+
+/* Reads a half, single or double float. Integers are also accepted */
+bool CborReader::readFloat(float &value) {
+	uint8_t major, info;
+	uint64_t raw;
+	size_t headLength;
+	if (!readHead(major, info, raw, headLength)) return(false);
+	if (major == CBOR_UINT || major == CBOR_NEGINT) {
+		int64_t number;
+		if (!readInt(number)) return(false);
+		value = number;
+		return(true);
+	}
+	if (major != CBOR_SIMPLE || info < 25 || info > 27) return(false);
+
+	if (info == 25) {   // Half float
+		uint16_t half = raw;
+		int exponent = (half >> 10) & 0x1F;
+		float mantissa = half & 0x3FF;
+		if (exponent == 0) {
+			value = ldexp(mantissa, -24);
+		} else if (exponent == 31) {
+			value = mantissa == 0 ? INFINITY : NAN;
+		} else {
+			value = ldexp(mantissa + 1024, exponent - 25);
+		}
+		if (half & 0x8000) value = -value;
+	} else if (info == 26) {
+		uint32_t bits = raw;
+		memcpy(&value, &bits, sizeof(value));
+	} else {
+		double number;
+		memcpy(&number, &raw, sizeof(number));
+		value = number;
+	}
+	_position += headLength;
+	return(true);
+}
+
+
+
+bool CborReader::readBool(bool &value) {
+	if (_position >= _length || (_data[_position] != 0xF4 && _data[_position] != 0xF5)) return(false);
+	value = _data[_position++] == 0xF5;
+	return(true);
+}
+
+
+
+bool CborReader::readNull() {
+	if (_position >= _length || _data[_position] != 0xF6) return(false);
+	_position++;
+	return(true);
+}
+
+
+
+/*	Reads a text string. It's not zero terminated. Parameters:
+	text: set to point at the text in the buffer
+	length: set to the length of the text
+*/
+bool CborReader::readText(const char* &text, size_t &length) {
+	uint8_t major, info;
+	uint64_t value;
+	size_t headLength;
+	if (!readHead(major, info, value, headLength) || major != CBOR_TEXT || info == 31) return(false);   // Chunked strings are not supported
+	if (_position + headLength + value > _length) return(false);
+	text = (const char*)_data + _position + headLength;
+	length = value;
+	_position += headLength + value;
+	return(true);
+}
+
+
+
+/*	Reads a byte string. Parameters:
+	data: set to point at the bytes in the buffer
+	length: set to the number of bytes
+*/
+bool CborReader::readBytes(const uint8_t* &data, size_t &length) {
+	uint8_t major, info;
+	uint64_t value;
+	size_t headLength;
+	if (!readHead(major, info, value, headLength) || major != CBOR_BYTES || info == 31) return(false);
+	if (_position + headLength + value > _length) return(false);
+	data = _data + _position + headLength;
+	length = value;
+	_position += headLength + value;
+	return(true);
+}
+
+
+
+/*	Starts reading an array. Its elements are read next. Parameters:
+	count: set to the number of elements. CBOR_INDEFINITE if it ends with a break. Then use readBreak() to find the end
+*/
+bool CborReader::enterArray(uint32_t &count) {
+	uint8_t major, info;
+	uint64_t value;
+	size_t headLength;
+	if (!readHead(major, info, value, headLength) || major != CBOR_ARRAY || value > 0xFFFFFFFE) return(false);
+	count = info == 31 ? CBOR_INDEFINITE : value;
+	_position += headLength;
+	return(true);
+}
+
+
+
+/*	Starts reading a map. Its keys and values are read next. Parameters:
+	count: set to the number of pairs. CBOR_INDEFINITE if it ends with a break
+*/
+bool CborReader::enterMap(uint32_t &count) {
+	uint8_t major, info;
+	uint64_t value;
+	size_t headLength;
+	if (!readHead(major, info, value, headLength) || major != CBOR_MAP || value > 0xFFFFFFFE) return(false);
+	count = info == 31 ? CBOR_INDEFINITE : value;
+	_position += headLength;
+	return(true);
+}
+
+
+
+/* Reads the break that ends an indefinite array or map. Returns false if the next item is not a break */
+bool CborReader::readBreak() {
+	if (_position >= _length || _data[_position] != 0xFF) return(false);
+	_position++;
+	return(true);
+}
+
+
+
+/* Skips the next item, with all its elements if it's an array or map. Returns false if it's broken or nested more than CBOR_MAX_DEPTH */
+bool CborReader::skip() {
+	return(skip(0));
+}
+
+
+
+/* Skips one item. depth is the number of arrays, maps and tags it's inside. Returns false if they are nested too deep */
+bool CborReader::skip(uint8_t depth) {
+	if (depth >= CBOR_MAX_DEPTH) return(false);
+	uint8_t major, info;
+	uint64_t value;
+	size_t headLength;
+	if (!readHead(major, info, value, headLength) || (info == 31 && major != CBOR_ARRAY && major != CBOR_MAP)) return(false);
+	_position += headLength;
+	switch (major) {
+	case CBOR_BYTES:
+	case CBOR_TEXT:
+		if (_position + value > _length) return(false);
+		_position += value;
+		return(true);
+	case CBOR_ARRAY:
+	case CBOR_MAP: {
+		uint64_t items = major == CBOR_MAP ? value * 2 : value;
+		if (info == 31) {
+			while (!readBreak()) {
+				if (!skip(depth + 1)) return(false);
+			}
+			return(true);
+		}
+		for (uint64_t i = 0; i < items; i++) {
+			if (!skip(depth + 1)) return(false);
+		}
+		return(true);
+	}
+	case CBOR_TAG:
+		return(skip(depth + 1));   // The tagged item
+	default:
+		return(true);
+	}
+}
+
+
+
+/*	Makes a batch. Parameters:
+	schema: the layout of the rows. It must stay in memory
+	buffer: where the batch is written
+	size: the size of buffer. When a row doesn't fit, the batch must be published and a new one started
+*/
+CborBatch::CborBatch(const CborSchema &schema, uint8_t* buffer, size_t size) : writer(buffer, size > 0 ? size - 1 : 0) {   // Room for the break at the end
+	_schema = &schema;
+}
+
+
+
+/*	Adds a row to the batch. Parameters:
+	timestamp: time of the readings, in any unit. Rows should be added oldest first
+	values: one value for each field of the schema
+	Returns false if the row didn't fit, or a field of the schema has negative decimals other than CBOR_FLOAT_FIELD. The batch is as it was before
+*/
+bool CborBatch::addRow(uint32_t timestamp, const float* values) {
+	for (uint8_t i = 0; i < _schema->fieldCount; i++) {
+		if (_schema->fields[i].decimals < CBOR_FLOAT_FIELD) return(false);
+	}
+	size_t lengthBefore = writer.length();
+	if (rows == 0) {
+		baseTime = timestamp;
+		writer.beginArray();
+		writer.writeUint(_schema->id);
+		writer.writeUint(baseTime);
+	}
+	writer.beginArray(_schema->fieldCount + 1);
+	writer.writeInt((int64_t)timestamp - baseTime);
+	for (uint8_t i = 0; i < _schema->fieldCount; i++) {
+		int8_t decimals = _schema->fields[i].decimals;
+		if (decimals == CBOR_FLOAT_FIELD || decimals >= (int8_t)(sizeof(powersOf10) / sizeof(powersOf10[0]))) {
+			writer.writeFloat(values[i]);
+		} else {
+			writer.writeInt(lroundf(values[i] * powersOf10[decimals]));   // 21.53 with 2 decimals is sent as 2153 in 3 bytes
+		}
+	}
+	if (writer.overflow()) {
+		writer.truncate(lengthBefore);
+		return(false);
+	}
+	rows++;
+	return(true);
+}
+
+
+
+/* Ends the batch. Returns its length in bytes. Call it before publishing data() */
+size_t CborBatch::finish() {
+	if (rows == 0) return(0);
+	uint8_t* end = writer.data() + writer.length();
+	*end = 0xFF;   // The break is written in the byte that was kept free
+	return(writer.length() + 1);
+}
+
+
+
+uint16_t CborBatch::rowCount() {
+	return(rows);
+}
+
+
+
+const uint8_t* CborBatch::data() {
+	return(writer.data());
+}
+
+
+
+/*	Makes a reader for a batch. Parameters:
+	schema: the layout of the rows
+	data, length: the batch, like a received mqtt payload
+*/
+CborBatchReader::CborBatchReader(const CborSchema &schema, const uint8_t* data, size_t length) : reader(data, length) {
+	_schema = &schema;
+	uint32_t count;
+	uint64_t schemaId = 0;
+	uint64_t time = 0;
+	valid = reader.enterArray(count) && count == CBOR_INDEFINITE && reader.readUint(schemaId) && schemaId == schema.id && reader.readUint(time);
+	baseTime = valid ? time : 0;
+}
+
+
+
+/* Returns true if the data is a batch made with the same schema */
+bool CborBatchReader::isValid() {
+	return(valid);
+}
+
+
+
+/*	Reads the next row. Parameters:
+	timestamp: set to the time of the row
+	values: filled with one value for each field of the schema
+	Returns false when there are no more rows, or the data is broken
+*/
+bool CborBatchReader::nextRow(uint32_t &timestamp, float* values) {
+	if (!valid || reader.readBreak()) return(false);
+	uint32_t count;
+	int64_t dt;
+	if (!reader.enterArray(count) || count != (uint32_t)_schema->fieldCount + 1 || !reader.readInt(dt)) {
+		valid = false;
+		return(false);
+	}
+	timestamp = baseTime + dt;
+	for (uint8_t i = 0; i < _schema->fieldCount; i++) {
+		int8_t decimals = _schema->fields[i].decimals;
+		bool scaled = reader.peekType() == CBOR_UINT || reader.peekType() == CBOR_NEGINT;
+		if (!reader.readFloat(values[i])) {   // Integers are read as floats too
+			valid = false;
+			return(false);
+		}
+		if (scaled && decimals > 0 && decimals < (int8_t)(sizeof(powersOf10) / sizeof(powersOf10[0]))) {
+			values[i] /= powersOf10[decimals];
+		}
+	}
+	return(true);
+}
@@ -0,0 +1,144 @@
+#ifndef _EVTCBOR_h
+#define _EVTCBOR_h
+
+#include <Arduino.h>
+#include "EvtMqttCodec.h"
+
+#define CBOR_INDEFINITE 0xFFFFFFFF   // Count of an array or map that ends with a break instead of having a length
+#define CBOR_FLOAT_FIELD -1   // Decimals of a schema field that is sent as a 32 bit float instead of a scaled integer
+#define CBOR_MAX_DEPTH 16   // Max nesting of arrays, maps and tags that skip() goes into. Data from the network can't overflow the stack
+
+// CBOR major types
+#define CBOR_UINT 0
+#define CBOR_NEGINT 1
+#define CBOR_BYTES 2
+#define CBOR_TEXT 3
+#define CBOR_ARRAY 4
+#define CBOR_MAP 5
+#define CBOR_TAG 6
+#define CBOR_SIMPLE 7
+
+
+
+/*	Writes CBOR (RFC 8949) into a buffer. If the buffer gets full nothing more is written and overflow() returns true.
+	Numbers use the shortest form, so small integers take one byte
+*/
+class CborWriter {
+private:
+	uint8_t* _buffer;
+	size_t _size;
+	size_t _length = 0;
+	bool _overflow = false;
+	void writeHead(uint8_t major, uint64_t value);
+	void writeRaw(const void* data, size_t length);
+public:
+	CborWriter(uint8_t* buffer, size_t size);
+	void writeUint(uint64_t value);
+	void writeInt(int64_t value);
+	void writeFloat(float value);
+	void writeBool(bool value);
+	void writeNull();
+	void writeText(const char* text);
+	void writeText(const char* text, size_t length);
+	void writeBytes(const uint8_t* data, size_t length);
+	void beginArray(uint32_t count = CBOR_INDEFINITE);
+	void beginMap(uint32_t count = CBOR_INDEFINITE);
+	void endIndefinite();
+	void truncate(size_t length);
+	size_t length();
+	bool overflow();
+	uint8_t* data();
+};
+
+
+
+/*	Reads CBOR from a buffer without copying. Text and byte strings point into the buffer. Every read returns false if the
+	next item is not of the wanted type, and then nothing is consumed
+*/
+class CborReader {
+private:
+	const uint8_t* _data = nullptr;
+	size_t _length = 0;
+	size_t _position = 0;
+	bool readHead(uint8_t &major, uint8_t &info, uint64_t &value, size_t &headLength);
+	bool skip(uint8_t depth);
+public:
+	CborReader() {}
+	CborReader(const uint8_t* data, size_t length);
+	uint8_t peekType();
+	bool atEnd();
+	bool readUint(uint64_t &value);
+	bool readInt(int64_t &value);
+	bool readFloat(float &value);
+	bool readBool(bool &value);
+	bool readNull();
+	bool readText(const char* &text, size_t &length);
+	bool readBytes(const uint8_t* &data, size_t &length);
+	bool enterArray(uint32_t &count);
+	bool enterMap(uint32_t &count);
+	bool readBreak();
+	bool skip();
+};
+
+
+
+// A field of a schema. The name is for the users. It's not sent
+struct CborField {
+	const char* name;
+	int8_t decimals;   // The value is sent as an integer multiplied by 10^decimals. CBOR_FLOAT_FIELD sends it as a float. Other negative values are not allowed
+};
+
+
+// The layout of the rows in a batch. Both sides of the connection must have the same schema
+struct CborSchema {
+	uint16_t id;   // Sent in the batch, so a reader can check it has the right schema
+	uint8_t fieldCount;
+	const CborField* fields;
+};
+
+
+
+/*	Packs many rows of readings with timestamps into one message. The batch is an indefinite CBOR array:
+	[schemaId, baseTime, [dt, value1, value2...], [dt, value1, value2...], ...]
+	baseTime is the timestamp of the first row and dt is the time of each row after it, so most timestamps take 1-3 bytes
+*/
+class CborBatch {
+private:
+	CborWriter writer;
+	const CborSchema* _schema;
+	uint32_t baseTime;
+	uint16_t rows = 0;
+public:
+	CborBatch(const CborSchema &schema, uint8_t* buffer, size_t size);
+	bool addRow(uint32_t timestamp, const float* values);
+	size_t finish();
+	uint16_t rowCount();
+	const uint8_t* data();
+};
+
+
+
+// Reads the rows of a batch made by CborBatch
+class CborBatchReader {
+private:
+	CborReader reader;
+	const CborSchema* _schema;
+	uint32_t baseTime = 0;
+	bool valid = false;
+public:
+	CborBatchReader(const CborSchema &schema, const uint8_t* data, size_t length);
+	bool isValid();
+	bool nextRow(uint32_t &timestamp, float* values);
+};
+
+
+
+/* A subscription callback with a CborReader gets the payload as it is, ready to be read */
+template<> struct MqttCodec<CborReader> {
+	static bool decode(const byte* payload, unsigned int length, CborReader &value) {
+		value = CborReader(payload, length);
+		return(length > 0);
+	}
+};
+
+#endif
@@ -1,108 +1,547 @@
 #include "EvtDS18B20.h"
 
 
-LinkedList<BusSetup*> EvtDS18B20::busList;
+EvtSlotMap<BusSetup*, DS18B20_MAX_BUSES> EvtDS18B20::busList;
+SensorCbFunc EvtDS18B20::sensorCallBackFunc = nullptr;
+portMUX_TYPE EvtDS18B20::mux = portMUX_INITIALIZER_UNLOCKED;
 
 
 
+/* The buses are run by the EvtSensor task. It's started with the first bus */
 EvtDS18B20::EvtDS18B20() {
-	logger.send(DEBUG, "TMP", "Starting task for ds18b20 temperature sensors");
-
-	// A task is created that is responsible of constantly getting data from thermometers on the busses
-	xTaskCreate(
-		TaskGetTemperature,				// Task to run
-		"TemperatureTask",				// Name of the task
-		TEMPERATURE_STACK_SIZE,	// Stack size in words
-		NULL,							// Parameters for the task
-		1,								// Priority of the task
-		NULL);
 }
 
 
 
-/*	Add a onewire bus. The bus will be scanned for temperature sensors and they will be added to the list for probing. Parameters:
+/*	Add a onewire bus. It returns at once. The sensors found on the bus last time are read from NVS and used right away. The
+	bus is searched for sensors in the background, and again every DS18B20_RESCAN_INTERVAL seconds, so sensors can be added
+	and removed while running. Parameters:
 	pinNumber:		physical IO pin where sensors are connected. one or more sensors can be connected in parallel on the pin
 	precision:		Precision on temperature sensors in bits (9 to 12). 9 is coarse but fast, 12 is fine but slow.
 	fetchInterval:	How often the task will check for temperature changes in seconds
 	callBackFunc:	The function that should be called when a new tempereture is measured 
+	Returns true if sensors were known from last time. Otherwise they are found by the first scan
 */
 bool EvtDS18B20::addBus(uint8_t pinNumber, uint8_t precision, uint16_t fetchInterval, TempCbFunc callBackFunc) {
 	logger.send(DEBUG, "TMP", "Setup ds18b20 bus on pin=%d, prec=%dbit, upd interval=%dsec", pinNumber, precision, fetchInterval);
+	if (busList.isFull()) {
+		logger.send(ERR, "TMP", "No room for more than %d buses", DS18B20_MAX_BUSES);
+		return(false);
+	}
 	// Make a bus entry that will be filled with all setup information
-	BusSetup *bus = new BusSetup;
+	BusSetup *bus = EvtAlloc::create<BusSetup>();
 	bus->pinNumber = pinNumber;
 	bus->precision = precision;
 	bus->fetchInterval = fetchInterval;
 	bus->callBackFunc = callBackFunc;
-	bus->oneWire = new OneWire(pinNumber);
-	bus->sensors = new DallasTemperature(bus->oneWire);
-
-	for (int searchAttempts = 0; searchAttempts < MAX_BUS_SEARCHES; searchAttempts++) {
-		// Start the dallas library and count devices on the bus
-		bus->sensors->begin();
-		uint8_t devicesFound = bus->sensors->getDeviceCount();
-
-		if (devicesFound > 0) {
-			// Traverse all devices found on the bus
-			for (uint8_t dev = 0; dev < devicesFound; dev++) {
-				Thermometer *thermometer = new Thermometer;
-
-				if (bus->sensors->getAddress(thermometer->address, dev)) {   // A found sensor address is stored in a thermometer struct.
-					bus->sensors->setResolution(thermometer->address, bus->precision); // And precision is setup on the sensor
-
-					// Calculate the hex string representation of the address and also put it in the thermometer struct.
-					for (uint8_t i = 0; i < 8; i++) sprintf(thermometer->addressStr + i * 2, "%02X", thermometer->address[i]);
-
-					logger.send(INFO, "TMP", "Found sensor on bus %d:%d with address %s", bus->pinNumber, dev, thermometer->addressStr);
-					bus->thermometerList.add(thermometer); // A found device is added to the linked list "thermometerList" (resides inside the bus struct).
-				}
-				else {
-					logger.send(ERR, "TMP", "Could not find sensor at %d:%d", bus->pinNumber, dev);
-				}
+	bus->wire = nullptr;
+#if DS18B20_USE_RMT
+	EvtOneWireRmt *rmtWire = EvtAlloc::create<EvtOneWireRmt>();
+	if (rmtWire->begin(pinNumber)) {
+		bus->wire = rmtWire;
+	} else {
+		EvtAlloc::destroy(rmtWire);
+	}
+#endif
+	if (bus->wire == nullptr) bus->wire = EvtAlloc::create<EvtOneWireBitBang>(pinNumber);
+	static const uint16_t conversionTimes[] = { 94, 188, 375, 750 };   // ms for 9 to 12 bits
+	bus->conversionTime = conversionTimes[constrain(precision, 9, 12) - 9];
+	loadSensorCache(bus);
+
+	portENTER_CRITICAL(&mux);   // Buses may be added from several tasks at once
+	bool added = busList.add(bus) != nullptr; // Add the bus to the busList. It's used to find the bus by its pin
+	portEXIT_CRITICAL(&mux);
+	if (!added) {
+		logger.send(ERR, "TMP", "No room for more than %d buses", DS18B20_MAX_BUSES);
+		EvtAlloc::destroy(bus->wire);
+		EvtAlloc::destroy(bus);
+		return(false);
+	}
+	EvtSensor::add(EvtAlloc::create<DS18B20Driver>(bus));   // The new bus is scanned at once
+	return(bus->thermometerList.size() > 0);
+}
+
+
+
+/*	Sets a function that is called when a sensor is found on a bus, or has gone missing. Parameters:
+	callBackFunc: the function. present is true for a found sensor
+*/
+void EvtDS18B20::onSensorChange(SensorCbFunc callBackFunc) {
+	sensorCallBackFunc = callBackFunc;
+}
+
+
+
+/*	Searches a bus for sensors. New sensors are added to the thermometerList, and sensors that have been missing in
+	DS18B20_MISSED_SCANS scans are marked as removed. The index of a sensor never changes. Parameters:
+	bus: the bus to search
+*/
+void EvtDS18B20::scanBus(BusSetup* bus) {
+	bool firstScan = bus->lastScan == 0;
+	if (firstScan) bus->parasite = readPowerSupply(bus);
+	if (firstScan && bus->parasite && !bus->wire->supportsPower()) {   // The RMT pin can't power the sensors while they convert
+		logger.send(WARN, "TMP", "Parasite powered sensor on bus %d. It's bit-banged instead of using RMT", bus->pinNumber);
+		EvtAlloc::destroy(bus->wire);   // Frees the RMT channels and the pin. In the static object pool its memory stays used
+		bus->wire = EvtAlloc::create<EvtOneWireBitBang>(bus->pinNumber);
+	}
+	bus->lastScan = millis();
+	for (Thermometer &thermometer : bus->thermometerList) thermometer.missedScans++;
+
+	bool changed = false;
+	uint8_t address[8];
+	bus->wire->resetSearch();
+	while (bus->wire->search(address)) {   // The crc of the address is checked by the search
+
+		Thermometer *thermometer = nullptr;
+		for (Thermometer &known : bus->thermometerList) {
+			if (memcmp(known.address, address, sizeof(address)) == 0) {
+				thermometer = &known;
+				break;
+			}
+		}
+		if (thermometer == nullptr) {
+			thermometer = addThermometer(bus, address);
+			if (thermometer == nullptr) continue;
+		}
+		thermometer->missedScans = 0;
+		if (!thermometer->present || firstScan) setPrecision(bus, thermometer); // And precision is setup on the sensor
+		if (!thermometer->present) {
+			thermometer->present = true;
+			changed = true;
+			thermometer->alarmSet = false;
+			thermometer->reportFilter.reset();   // Old readings say nothing about a sensor that was gone
+			uint8_t deviceIndex = bus->thermometerList.indexOf(thermometer);
+			logger.send(INFO, "TMP", "Found sensor on bus %d:%d with address %s", bus->pinNumber, deviceIndex, thermometer->addressStr);
+			if (sensorCallBackFunc != nullptr) sensorCallBackFunc(bus->pinNumber, deviceIndex, thermometer->addressStr, true);
+		}
+	}
+
+	for (Thermometer &thermometer : bus->thermometerList) {
+		if (thermometer.present && thermometer.missedScans >= DS18B20_MISSED_SCANS) {
+			uint8_t deviceIndex = bus->thermometerList.indexOf(&thermometer);
+			thermometer.present = false;
+			changed = true;
+			logger.send(WARN, "TMP", "Sensor %d:%d with address %s is gone", bus->pinNumber, deviceIndex, thermometer.addressStr);
+			if (sensorCallBackFunc != nullptr) sensorCallBackFunc(bus->pinNumber, deviceIndex, thermometer.addressStr, false);
+		}
+	}
+	if (changed) saveSensorCache(bus);   // Sensors that came or went
+}
+
+
+
+/*	Adds a thermometer to a bus. If the list is full, the slot of a removed thermometer is used. Parameters:
+	bus: the bus
+	address: the ROM address of the thermometer
+	Returns the thermometer, or nullptr if there is no room
+*/
+Thermometer* EvtDS18B20::addThermometer(BusSetup* bus, const uint8_t* address) {
+	char addressStr[17];   // The hex string representation of the address. It's also put in the thermometer struct
+	for (uint8_t i = 0; i < 8; i++) sprintf(addressStr + i * 2, "%02X", address[i]);
+
+	Thermometer *thermometer = nullptr;
+	portENTER_CRITICAL(&mux);   // setReporting() gives the thermometers their settings from the user task
+	if (!bus->thermometerList.isFull()) {
+		thermometer = bus->thermometerList.add(Thermometer()); // A found device is added to "thermometerList" (resides inside the bus struct). Its slot is its index
+	} else {
+		for (Thermometer &removed : bus->thermometerList) {
+			if (!removed.present) {
+				thermometer = &removed;
+				break;
 			}
+		}
+		if (thermometer != nullptr) *thermometer = Thermometer();
+	}
+	if (thermometer != nullptr) {
+		memcpy(thermometer->address, address, sizeof(thermometer->address));
+		memcpy(thermometer->addressStr, addressStr, sizeof(addressStr));
+		findReportSettings(bus, thermometer);
+	}
+	portEXIT_CRITICAL(&mux);
+	if (thermometer == nullptr) logger.send(ERR, "TMP", "No room for more than %d sensors on bus %d", DS18B20_MAX_SENSORS, bus->pinNumber);
+	return(thermometer);
+}
+
+
 
-			busList.add(bus); // Add the bus with it's found thermometers to the busList. This is used by the "TaskGetTemperature"
-			return(true);
-		} else {   // No devices found on the bus
-			logger.send(WARN, "TMP", "No sensors found on bus/pin number %d", bus->pinNumber);
-			vTaskDelay(BUS_SEARCH_RETRY_TIME / portTICK_PERIOD_MS);   // Give some time to other tasks for one second
+/*	Gives a thermometer its own report settings, if it has any. Otherwise it uses those of the bus. Call it with mux taken. Parameters:
+	bus: the bus of the thermometer
+	thermometer: the thermometer
+*/
+void EvtDS18B20::findReportSettings(BusSetup* bus, Thermometer* thermometer) {
+	thermometer->reportSettings = nullptr;
+	for (SensorReporting &reporting : bus->sensorReportingList) {
+		if (strcasecmp(reporting.addressStr, thermometer->addressStr) == 0) {
+			thermometer->reportSettings = &reporting.settings;
+			return;
 		}
 	}
-	logger.send(ERR, "TMP", "Giving up finding sensors on bus/pin number %d", bus->pinNumber);
-	return(false);   // No sensors found on the bus
 }
 
 
 
-/*	A task that periodically gets temperature for the busses. 
-	This has to be a static method because eps32 tasks can't call an instance member of a class! 
+/*	Adds the sensors that were on the bus last time, so they get the same index as before the reboot. They are not present
+	until the first scan finds them. Then they are announced like new sensors. Parameters:
+	bus: the bus. Its pin number is the key in NVS
+*/
+void EvtDS18B20::loadSensorCache(BusSetup* bus) {
+	uint8_t addresses[DS18B20_MAX_SENSORS][8];
+	char key[8];
+	sprintf(key, "bus%d", bus->pinNumber);
+	Preferences preferences;
+	if (!preferences.begin(DS18B20_CACHE_NAMESPACE, true)) return;
+	size_t length = preferences.getBytes(key, addresses, sizeof(addresses));
+	preferences.end();
+
+	for (uint8_t i = 0; i < length / 8; i++) {
+		Thermometer *thermometer = addThermometer(bus, addresses[i]);
+		if (thermometer == nullptr) break;
+		logger.send(DEBUG, "TMP", "Cached sensor on bus %d:%d with address %s", bus->pinNumber, i, thermometer->addressStr);
+	}
+}
+
+
+
+/*	Stores the addresses of the sensors that are on a bus in NVS, in the order of their index. Sensors that are gone are
+	left out, so they are forgotten at the next boot. Parameters:
+	bus: the bus
+*/
+void EvtDS18B20::saveSensorCache(BusSetup* bus) {
+	uint8_t addresses[DS18B20_MAX_SENSORS][8];
+	uint8_t count = 0;
+	for (Thermometer &thermometer : bus->thermometerList) {
+		if (thermometer.present) memcpy(addresses[count++], thermometer.address, 8);
+	}
+
+	char key[8];
+	sprintf(key, "bus%d", bus->pinNumber);
+	Preferences preferences;
+	if (preferences.begin(DS18B20_CACHE_NAMESPACE, false)) {
+		preferences.putBytes(key, addresses, count * 8);
+		preferences.end();
+	}
+}
+
+
+
+DS18B20Driver::DS18B20Driver(BusSetup* bus) {
+	this->bus = bus;
+	sprintf(name, "DS18B20:%d", bus->pinNumber);
+}
+
+
+
+const char* DS18B20Driver::getName() {
+	return(name);
+}
+
+
+
+/*	Searches the bus for sensors when it's due. The scheduler only calls it between conversions, so the search doesn't
+	disturb them. Returns ms until the next search
+*/
+unsigned long DS18B20Driver::maintain() {
+	if (bus->lastScan == 0 || millis() - bus->lastScan >= 1000UL * DS18B20_RESCAN_INTERVAL) EvtDS18B20::scanBus(bus);
+	unsigned long sinceScan = millis() - bus->lastScan;
+	return(sinceScan < 1000UL * DS18B20_RESCAN_INTERVAL ? 1000UL * DS18B20_RESCAN_INTERVAL - sinceScan : 0);
+}
+
+
+
+/* All the devices on the bus start converting. It doesn't wait */
+bool DS18B20Driver::start() {
+	EvtDS18B20::startConversion(bus);
+	return(true);
+}
+
+
+
+unsigned long DS18B20Driver::getConversionTime() {
+	return(bus->conversionTime);
+}
+
+
+
+void DS18B20Driver::read() {
+	EvtDS18B20::readBus(bus);
+}
+
+
+
+unsigned long DS18B20Driver::getInterval() {
+	return(1000UL * bus->fetchInterval);
+}
+
+
+
+/*	Makes a bus only read the sensors whose temperature has changed. Each sensor gets its alarm registers (TH and TL) set
+	around its last temperature. After a conversion an ALARM SEARCH finds the sensors that are outside their band, and only
+	they are read. So the bus time depends on the number of sensors that change, not the number of sensors. Every
+	fullReadInterval all sensors are read anyway. The alarm registers are only written to the scratchpad, not to the
+	EEPROM of the sensor, so they don't wear it out. Parameters:
+	pinNumber: the pin of a bus added with addBus()
+	alarmBand: whole degrees C. A sensor is read when it has moved about this much. Smaller changes are seen at the next full read
+	fullReadInterval: seconds between reading all sensors
+	Returns false if there is no bus on the pin
+*/
+bool EvtDS18B20::enableAlarmSearch(uint8_t pinNumber, uint8_t alarmBand, uint16_t fullReadInterval) {
+	BusSetup *bus = findBus(pinNumber);
+	if (bus == nullptr) {
+		logger.send(ERR, "TMP", "No bus on pin %d for alarm search", pinNumber);
+		return(false);
+	}
+	bus->alarmBand = alarmBand > 0 ? alarmBand : 1;
+	bus->fullReadInterval = fullReadInterval;
+	bus->lastFullRead = 0;   // The first read is a full read. It sets the alarm bands of all sensors
+	bus->alarmSearch = true;
+	return(true);
+}
+
+
+
+/*	Sets when the readings of the sensors on a bus are reported. Without it every change is reported, which at 12 bits is
+	mostly noise. See ReportSettings for the options. Sensors with their own settings keep them. In alarm search mode a
+	sensor that stays in its band is only read every fullReadInterval, so the heartbeat can't be faster than that. Parameters:
+	pinNumber: the pin of a bus added with addBus()
+	settings: the report options. They are copied
+	Returns false if there is no bus on the pin
+*/
+bool EvtDS18B20::setReporting(uint8_t pinNumber, const ReportSettings &settings) {
+	BusSetup *bus = findBus(pinNumber);
+	if (bus == nullptr) {
+		logger.send(ERR, "TMP", "No bus on pin %d for report settings", pinNumber);
+		return(false);
+	}
+	portENTER_CRITICAL(&mux);   // The sensor task reads them while we copy
+	bus->reportSettings = settings;
+	portEXIT_CRITICAL(&mux);
+	return(true);
+}
+
+
+
+/*	Sets when the readings of one sensor are reported. It overrides the settings of the bus. The sensor doesn't have to be
+	found yet. Parameters:
+	pinNumber: the pin of a bus added with addBus()
+	sensorAddress: the address of the sensor as hex. The same as the callbacks get
+	settings: the report options. They are copied
+	Returns false if there is no bus on the pin
 */
-void EvtDS18B20::TaskGetTemperature(void *pvParameters) {
-	while (true) {
-		for (uint b = 0; b < busList.size(); b++) {   // Go through one bus at the time
-			BusSetup *bus = busList.get(b);
-			if (millis() - bus->lastFetched > 1000UL * bus->fetchInterval) { // If it's time to fetch another temperature
-				bus->sensors->requestTemperatures();   // Request temperatures from all the devices on the bus
+bool EvtDS18B20::setReporting(uint8_t pinNumber, const char* sensorAddress, const ReportSettings &settings) {
+	BusSetup *bus = findBus(pinNumber);
+	if (bus == nullptr || strlen(sensorAddress) != 16) {
+		logger.send(ERR, "TMP", "No bus on pin %d or bad sensor address for report settings", pinNumber);
+		return(false);
+	}
+	SensorReporting newReporting;
+	strcpy(newReporting.addressStr, sensorAddress);
+	newReporting.settings = settings;
+
+	SensorReporting *reporting = nullptr;
+	portENTER_CRITICAL(&mux);   // The sensor task adds thermometers and reads their settings
+	for (SensorReporting &known : bus->sensorReportingList) {
+		if (strcasecmp(known.addressStr, sensorAddress) == 0) {
+			reporting = &known;
+			break;
+		}
+	}
+	if (reporting != nullptr) {
+		reporting->settings = settings;   // The thermometer already points at them
+	} else {
+		reporting = bus->sensorReportingList.add(newReporting);
+		for (Thermometer &thermometer : bus->thermometerList) {   // Only the sensor with this address gets them
+			if (reporting != nullptr && strcasecmp(thermometer.addressStr, sensorAddress) == 0) thermometer.reportSettings = &reporting->settings;
+		}
+	}
+	portEXIT_CRITICAL(&mux);
+
+	if (reporting == nullptr) {
+		logger.send(ERR, "TMP", "No room for report settings of more than %d sensors on bus %d", DS18B20_MAX_SENSORS, pinNumber);
+		return(false);
+	}
+	return(true);
+}
+
+
+
+/* Returns the bus on a pin, or nullptr if there is none */
+BusSetup* EvtDS18B20::findBus(uint8_t pinNumber) {
+	for (BusSetup *bus : busList) {
+		if (bus->pinNumber == pinNumber) return(bus);
+	}
+	return(nullptr);
+}
+
 
-				for (uint8_t deviceIndex = 0; deviceIndex < bus->thermometerList.size(); deviceIndex++) {   // Traverse one thermometer on the bus at the time
-					Thermometer *thermometer = bus->thermometerList.get(deviceIndex);
 
-					float temperature = bus->sensors->getTempC(thermometer->address);   // Get the temperature
+/*	Reads the temperatures of the thermometers on a bus after a conversion. Normally all of them are read. In alarm search
+	mode only the ones that are outside their alarm band, and those whose band isn't set yet, except for a full read every
+	fullReadInterval. Parameters:
+	bus: the bus to read
+*/
+void EvtDS18B20::readBus(BusSetup* bus) {
+	if (!bus->alarmSearch || bus->lastFullRead == 0 || millis() - bus->lastFullRead >= 1000UL * bus->fullReadInterval) {
+		for (Thermometer &thermometer : bus->thermometerList) {   // Traverse one thermometer on the bus at the time
+			if (thermometer.present) readThermometer(bus, &thermometer);
+		}
+		bus->lastFullRead = millis();
+		return;
+	}
 
-					if (temperature != thermometer->lastTemperature) {   // If the temperature has changed since last reading
-						if (temperature > -127) {   // And we got a good valid temperature reading
-							logger.send(DEBUG, "TMP", "Device %d:%d changed temperature to %fC. Doing Callback", bus->pinNumber, deviceIndex, temperature);
-							bus->callBackFunc(bus->pinNumber, deviceIndex, thermometer->addressStr, temperature);   // Do the callback
-							thermometer->lastTemperature = temperature;
-						}
-						else {
-							logger.send(ERR, "TMP", "Invalid temperature from device %d:%d", bus->pinNumber, deviceIndex);
-						}
-					}
-				}
-				bus->lastFetched = millis();
+	uint8_t address[8];
+	uint8_t alarmCount = 0;
+	bus->wire->resetSearch();
+	while (bus->wire->search(address, true)) {   // ALARM SEARCH. Only sensors outside their band answer
+		alarmCount++;
+		for (Thermometer &thermometer : bus->thermometerList) {
+			if (memcmp(thermometer.address, address, sizeof(address)) == 0) {
+				readThermometer(bus, &thermometer);
+				break;
 			}
 		}
-		vTaskDelay(100 / portTICK_PERIOD_MS);   // Give some time to other tasks
 	}
-}
\ No newline at end of file
+	// Sensors found since the last full read still have the TH and TL of their EEPROM, so they may never answer the search.
+	// Reading them sets their band
+	for (Thermometer &thermometer : bus->thermometerList) {
+		if (thermometer.present && !thermometer.alarmSet) readThermometer(bus, &thermometer);
+	}
+	logger.send(DEBUG, "TMP", "%d of %d sensors on bus %d have left their alarm band", alarmCount, bus->thermometerList.size(), bus->pinNumber);
+}
+
+
+
+/*	Reads the temperature of a thermometer, and does the callback if the report settings say the change is worth it. Parameters:
+	bus: the bus of the thermometer
+	thermometer: the thermometer. Its slot in the thermometerList of the bus is its index
+*/
+void EvtDS18B20::readThermometer(BusSetup* bus, Thermometer* thermometer) {
+	uint8_t deviceIndex = bus->thermometerList.indexOf(thermometer);
+
+	uint8_t scratchpad[9];
+	if (!readScratchpad(bus, thermometer->address, scratchpad)) {   // No answer or a bad crc
+		logger.send(ERR, "TMP", "Invalid temperature from device %d:%d", bus->pinNumber, deviceIndex);
+		return;
+	}
+	thermometer->lastTemperature = scratchpadToCelsius(scratchpad, thermometer->address[0]);
+
+	portENTER_CRITICAL(&mux);   // A copy, because setReporting() may change them from the user task
+	ReportSettings settings = thermometer->reportSettings != nullptr ? *thermometer->reportSettings : bus->reportSettings;
+	portEXIT_CRITICAL(&mux);
+	float temperature;
+	if (thermometer->reportFilter.update(settings, thermometer->lastTemperature, millis(), temperature)) {   // If the change is worth reporting
+		logger.send(DEBUG, "TMP", "Device %d:%d changed temperature to %fC. Doing Callback", bus->pinNumber, deviceIndex, temperature);
+		bus->callBackFunc(bus->pinNumber, deviceIndex, thermometer->addressStr, temperature);   // Do the callback
+	}
+	if (bus->alarmSearch) setAlarmBand(bus, thermometer);
+}
+
+
+
+/*	Sets the alarm registers of a thermometer around its last temperature. The sensor compares the whole degrees of a
+	conversion with them, and is found by ALARM SEARCH when it's at or above TH, or at or below TL. The registers are
+	written to the scratchpad only. Nothing is copied to EEPROM. Parameters:
+	bus: the bus of the thermometer
+	thermometer: the thermometer
+*/
+void EvtDS18B20::setAlarmBand(BusSetup* bus, Thermometer* thermometer) {
+	int wholeDegrees = floor(thermometer->lastTemperature);
+	int8_t alarmHigh = constrain(wholeDegrees + bus->alarmBand, -55, 125);
+	int8_t alarmLow = constrain(wholeDegrees - bus->alarmBand, -55, 125);
+	if (thermometer->alarmSet && alarmHigh == thermometer->alarmHigh && alarmLow == thermometer->alarmLow) return;
+
+	writeScratchpad(bus, thermometer->address, alarmHigh, alarmLow, ((bus->precision - 9) << 5) | 0x1F, false);   // The configuration register holds the precision. It's written too
+	thermometer->alarmHigh = alarmHigh;
+	thermometer->alarmLow = alarmLow;
+	thermometer->alarmSet = true;
+}
+
+
+
+/*	Starts a conversion on all sensors of a bus. With parasite powered sensors the bus is driven high until they are read */
+void EvtDS18B20::startConversion(BusSetup* bus) {
+	bus->wire->reset();
+	bus->wire->skip();
+	bus->wire->writeByte(DS18B20_CONVERT, bus->parasite);
+}
+
+
+
+/*	Reads the 9 bytes of the scratchpad of a sensor. Parameters:
+	bus: the bus of the sensor
+	address: the ROM address of the sensor
+	scratchpad: filled with the bytes
+	Returns false if the sensor didn't answer or the crc is wrong
+*/
+bool EvtDS18B20::readScratchpad(BusSetup* bus, const uint8_t* address, uint8_t* scratchpad) {
+	bus->wire->depower();
+	if (!bus->wire->reset()) return(false);
+	bus->wire->select(address);
+	bus->wire->writeByte(DS18B20_READ_SCRATCHPAD);
+	bus->wire->read(scratchpad, 9);
+	bool allOnes = true;   // A missing sensor reads as all ones. Don't let that pass as a reading
+	for (uint8_t i = 0; i < 9; i++) allOnes &= scratchpad[i] == 0xFF;
+	return(!allOnes && EvtOneWire::crc8(scratchpad, 8) == scratchpad[8]);
+}
+
+
+
+/*	Writes the alarm and configuration registers of a sensor. Parameters:
+	bus: the bus of the sensor
+	address: the ROM address of the sensor
+	alarmHigh, alarmLow: the TH and TL registers
+	config: the configuration register. It holds the precision
+	copy: if true the registers are also copied to EEPROM, so the sensor keeps them without power. EEPROM wears out, so only do it when they change
+*/
+void EvtDS18B20::writeScratchpad(BusSetup* bus, const uint8_t* address, int8_t alarmHigh, int8_t alarmLow, uint8_t config, bool copy) {
+	uint8_t registers[4] = { DS18B20_WRITE_SCRATCHPAD, (uint8_t)alarmHigh, (uint8_t)alarmLow, config };
+	bus->wire->reset();
+	bus->wire->select(address);
+	bus->wire->write(registers, address[0] == DS18S20_FAMILY ? 3 : 4);   // The DS18S20 has no configuration register
+	if (copy) {
+		bus->wire->reset();
+		bus->wire->select(address);
+		bus->wire->writeByte(DS18B20_COPY_SCRATCHPAD, bus->parasite);
+		vTaskDelay(20 / portTICK_PERIOD_MS);   // Time to write the EEPROM
+		bus->wire->depower();
+	}
+}
+
+
+
+/*	Sets the precision of a sensor, if it's not already right. The alarm registers are kept. Parameters:
+	bus: the bus of the sensor. It has the precision
+	thermometer: the sensor
+*/
+void EvtDS18B20::setPrecision(BusSetup* bus, Thermometer* thermometer) {
+	uint8_t scratchpad[9];
+	if (thermometer->address[0] == DS18S20_FAMILY || !readScratchpad(bus, thermometer->address, scratchpad)) return;
+	uint8_t config = ((bus->precision - 9) << 5) | 0x1F;
+	if (scratchpad[4] == config) return;
+	writeScratchpad(bus, thermometer->address, scratchpad[2], scratchpad[3], config, true);
+}
+
+
+
+/* Returns true if any sensor on the bus is parasite powered. They answer READ POWER SUPPLY with a 0 */
+bool EvtDS18B20::readPowerSupply(BusSetup* bus) {
+	if (!bus->wire->reset()) return(false);
+	bus->wire->skip();
+	bus->wire->writeByte(DS18B20_READ_POWER_SUPPLY);
+	return(!bus->wire->readBit());
+}
+
+
+
+/*	Calculates the temperature in a scratchpad. Parameters:
+	scratchpad: the 9 bytes read from the sensor
+	family: the first byte of the ROM address
+*/
+float EvtDS18B20::scratchpadToCelsius(const uint8_t* scratchpad, uint8_t family) {
+	int16_t raw = (scratchpad[1] << 8) | scratchpad[0];
+	if (family == DS18S20_FAMILY) {   // Half degrees. The count registers give the rest of the precision
+		return((raw >> 1) - 0.25f + (16 - scratchpad[6]) / 16.0f);
+	}
+	uint8_t unusedBits = 3 - ((scratchpad[4] >> 5) & 0x03);   // The lowest bits are undefined at less than 12 bits
+	raw &= ~((1 << unusedBits) - 1);
+	return(raw / 16.0f);
+}
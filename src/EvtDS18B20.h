@@ -2,27 +2,62 @@
 #define _EVTDS18B20_h
 
 #include "EvtLogger.h"
-#include <OneWire.h> // use the one for ESP32 here: https://github.com/stickbreaker/OneWire. See this thread: https://github.com/espressif/arduino-esp32/issues/755
-#include <DallasTemperature.h>
-#include <LinkedList.h>
+#include "EvtAlloc.h"
+#include "EvtCallback.h"
+#include "EvtOneWire.h"
+#include "EvtOneWireBitBang.h"
+#include "EvtOneWireRmt.h"
+#include "EvtReportFilter.h"
+#include "EvtSensor.h"
+#include "EvtSlotMap.h"
+#include <Preferences.h>
 
-#define TEMPERATURE_STACK_SIZE 5000
-#define MAX_BUS_SEARCHES 5   // Number of times to probe a bus for sensors before giving up
-#define BUS_SEARCH_RETRY_TIME 1000   // in ms
+#define DS18B20_RESCAN_INTERVAL 60   // Seconds between searching the buses for added and removed sensors
+#define DS18B20_MISSED_SCANS 2   // A sensor is removed when it has been missing in this many scans in a row
+#define DS18B20_MAX_SENSORS 32   // Max sensors on a bus, including removed ones that keep their index
+#define DS18B20_MAX_BUSES 4
+#define DS18B20_CACHE_NAMESPACE "evtds18b20"   // NVS namespace of the sensor addresses of each bus
+#define DS18B20_USE_RMT true   // Buses use the RMT peripheral while there are free channels. Otherwise they are bit-banged
+
+// DS18B20 function commands
+#define DS18B20_CONVERT 0x44
+#define DS18B20_READ_SCRATCHPAD 0xBE
+#define DS18B20_WRITE_SCRATCHPAD 0x4E
+#define DS18B20_COPY_SCRATCHPAD 0x48
+#define DS18B20_READ_POWER_SUPPLY 0xB4
+#define DS18S20_FAMILY 0x10   // The old 9 bit sensor. It has no precision setting
 
 
 
 // Definition of the callback function that handles a new incoming temperature
-typedef void(*TempCbFunc) (uint8_t pinNumber, uint8_t sensorIndex, char* sensorAddress, float temperature); 
+typedef EvtCallback<void(uint8_t pinNumber, uint8_t sensorIndex, char* sensorAddress, float temperature)> TempCbFunc;
+
+// Definition of the callback function that is called when a sensor is found on a bus or removed from it
+typedef EvtCallback<void(uint8_t pinNumber, uint8_t sensorIndex, char* sensorAddress, bool present)> SensorCbFunc;
 
 
 
 // Each thermometer on the bus is controlled with this struct. 
-// A linked list of this struct keeps track of all the thermometers on the bus that the class instance maintains.
+// A slot map of this struct keeps track of all the thermometers on the bus that the class instance maintains. The slot is the index of the sensor.
+// A removed thermometer stays in the list, so the index of the others doesn't change. If it comes back it gets its old index
 struct Thermometer {
 	uint8_t address[8];
 	char addressStr[17] ="";
-	float lastTemperature = 0;
+	bool present = false;   // False until it has been found by a scan of the bus
+	uint8_t missedScans = 0;
+	float lastTemperature = 0;   // The last reading. It's not always reported
+	EvtReportFilter reportFilter;
+	const ReportSettings* reportSettings = nullptr;   // Settings of this sensor. nullptr if it uses those of the bus
+	int8_t alarmHigh = 0;   // The TH and TL registers of the sensor in alarm search mode
+	int8_t alarmLow = 0;
+	bool alarmSet = false;
+};
+
+
+// Report settings for one sensor, given by its address. It's kept even while the sensor is not on the bus
+struct SensorReporting {
+	char addressStr[17];
+	ReportSettings settings;
 };
 
 
@@ -31,17 +66,57 @@ struct BusSetup {
 	uint8_t precision;
 	uint16_t fetchInterval;
 	TempCbFunc callBackFunc;
-	OneWire *oneWire;
-	DallasTemperature *sensors;
-	LinkedList<Thermometer*> thermometerList;   // A dynamic list of all the thermometers found on the bus
-	unsigned long lastFetched = 0;
+	EvtOneWire *wire;
+	bool parasite = false;   // True if a sensor takes its power from the data line
+	EvtSlotMap<Thermometer, DS18B20_MAX_SENSORS> thermometerList;   // All the thermometers found on the bus
+	uint16_t conversionTime;   // ms. Depends on the precision
+	bool alarmSearch = false;   // Only the sensors that have left their alarm band are read. See enableAlarmSearch()
+	uint8_t alarmBand;   // Whole degrees C
+	uint16_t fullReadInterval;   // Seconds between reading all the sensors in alarm search mode
+	unsigned long lastFullRead = 0;
+	unsigned long lastScan = 0;   // When the bus was last searched for sensors. 0 if never
+	ReportSettings reportSettings;   // When a reading is reported. The defaults report every change
+	EvtSlotMap<SensorReporting, DS18B20_MAX_SENSORS> sensorReportingList;   // Sensors with their own report settings
+};
+
+
+// A bus as a driver of the sensor scheduler. The steps are done by EvtDS18B20
+class DS18B20Driver : public EvtSensorDriver {
+private:
+	BusSetup *bus;
+	char name[12];
+public:
+	DS18B20Driver(BusSetup* bus);
+	const char* getName();
+	unsigned long maintain();
+	bool start();
+	unsigned long getConversionTime();
+	void read();
+	unsigned long getInterval();
 };
 
 
 class EvtDS18B20 {
+	friend class DS18B20Driver;
 private:
-	static LinkedList<BusSetup*> busList;
-	static void TaskGetTemperature(void *pvParameters);
+	static EvtSlotMap<BusSetup*, DS18B20_MAX_BUSES> busList;
+	static SensorCbFunc sensorCallBackFunc;
+	static portMUX_TYPE mux;   // Around the buses and the report settings, which are set from user tasks
+	static void readBus(BusSetup* bus);
+	static void readThermometer(BusSetup* bus, Thermometer* thermometer);
+	static void setAlarmBand(BusSetup* bus, Thermometer* thermometer);
+	static void startConversion(BusSetup* bus);
+	static bool readScratchpad(BusSetup* bus, const uint8_t* address, uint8_t* scratchpad);
+	static void writeScratchpad(BusSetup* bus, const uint8_t* address, int8_t alarmHigh, int8_t alarmLow, uint8_t config, bool copy);
+	static void setPrecision(BusSetup* bus, Thermometer* thermometer);
+	static bool readPowerSupply(BusSetup* bus);
+	static float scratchpadToCelsius(const uint8_t* scratchpad, uint8_t family);
+	static BusSetup* findBus(uint8_t pinNumber);
+	static void scanBus(BusSetup* bus);
+	static Thermometer* addThermometer(BusSetup* bus, const uint8_t* address);
+	static void loadSensorCache(BusSetup* bus);
+	static void findReportSettings(BusSetup* bus, Thermometer* thermometer);
+	static void saveSensorCache(BusSetup* bus);
 
 	uint8_t _pinNumber;
 	uint8_t _precision;
@@ -50,6 +125,10 @@ private:
 public:
 	EvtDS18B20();
 	bool addBus(uint8_t pinNumber, uint8_t precision, uint16_t fetchInterval, TempCbFunc callBackFunc);
+	bool enableAlarmSearch(uint8_t pinNumber, uint8_t alarmBand, uint16_t fullReadInterval);
+	void onSensorChange(SensorCbFunc callBackFunc);
+	bool setReporting(uint8_t pinNumber, const ReportSettings &settings);
+	bool setReporting(uint8_t pinNumber, const char* sensorAddress, const ReportSettings &settings);
 };
 
 #endif
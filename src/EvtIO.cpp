@@ -2,6 +2,7 @@
 
 portMUX_TYPE EvtIO::mux = portMUX_INITIALIZER_UNLOCKED;
 volatile Interrupt EvtIO::interruptPin[10];
+InputCbFunc EvtIO::inputCallbacks[10];
 uint8_t EvtIO::numOfTriggers = 0;
 
 
@@ -10,7 +11,7 @@ uint8_t EvtIO::numOfTriggers = 0;
 EvtIO::EvtIO() {
 	if (numOfTriggers == 0) { // We want one task to handle all interrupts
 		logger.send(DEBUG, "IOP", "Starting IO handling taks");
-		xTaskCreate(
+		EvtAlloc::createTask(
 			taskHandleInterrupts,	// Task function to call.
 			"HandleInterrupts",		// Name of task.
 			IO_STACK_SIZE,			// Stack size in words 
@@ -34,11 +35,10 @@ void EvtIO::taskHandleInterrupts(void *pvParameters) {
 				uint8_t pinNumber = interruptPin[i].pinNumber;
 				bool pinState = interruptPin[i].pinValue;
 				uint32_t cbCalledTimes = ++interruptPin[i].triggerCount;
-				InputCbFunc inputCbFunction = interruptPin[i].inputCbFunction;
 				interruptPin[i].lastInterruptCount = interruptPin[i].interruptCount;
 				portEXIT_CRITICAL(&mux);   // Not critical anymore bacause we have a copy
 				logger.send(DEBUG, "IOP", "Received interrupt%d on pin %d. Doing Callback", i, pinNumber);
-				inputCbFunction(pinNumber, pinState, cbCalledTimes);   // Do the callback
+				inputCallbacks[i](pinNumber, pinState, cbCalledTimes);   // Do the callback
 			}
 			else { portEXIT_CRITICAL(&mux); }
 		}
@@ -58,9 +58,9 @@ bool EvtIO::trigger(uint8_t pinNumber, uint8_t mode, InputCbFunc cbFunc) {
 	if (numOfTriggers < 10) {   // If we havn't added too many triggers.
 		logger.send(DEBUG, "IOP", "Setup interrupt trigger on pin %d", pinNumber);
 
-		// Save pin and callback in our volatile shared array.
+		// Save pin in our volatile shared array, and the callback beside it.
 		interruptPin[numOfTriggers].pinNumber = pinNumber; 
-		interruptPin[numOfTriggers].inputCbFunction = cbFunc;
+		inputCallbacks[numOfTriggers] = cbFunc;
 
 		pinMode(pinNumber, mode);
 		// We now attach an interrupt handler to our pin. Each pin needs it's own handler function (from 0-9)
@@ -92,16 +92,25 @@ bool EvtIO::trigger(uint8_t pinNumber, uint8_t mode, InputCbFunc cbFunc) {
 	Returns true if pin is successfully setup. If it's already setup we return false.
 */
 bool EvtIO::outputSetup(uint8_t pinNumber, bool reversedOutput, OutputCbFunc cbFunc) {
-	for (uint8_t t = 0; t < outputConfList.size(); t++) {   // Go through each pin in the output config-list
-		if (outputConfList.get(t)->pinNumber == pinNumber) {
-			logger.send(ERR, "IOP", "Setup pin %d has already been set up", pinNumber);
-			return(false);   // If the pin already is configure, we return error.
-		}
+	bool alreadySetup = false;
+	bool added = false;
+	portENTER_CRITICAL(&mux);   // Pins may be set up from several tasks at once
+	for (OutputConf &outputConfig : outputConfList) {   // Go through each pin in the output config-list
+		if (outputConfig.pinNumber == pinNumber) alreadySetup = true;
+	}
+	if (!alreadySetup) added = outputConfList.add({ pinNumber, reversedOutput, cbFunc, 0 }) != nullptr;
+	portEXIT_CRITICAL(&mux);
+
+	if (alreadySetup) {
+		logger.send(ERR, "IOP", "Setup pin %d has already been set up", pinNumber);
+		return(false);   // If the pin already is configure, we return error.
+	}
+	if (!added) {
+		logger.send(ERR, "IOP", "Can't setup pin %d. There is room for %d outputs", pinNumber, IO_MAX_OUTPUTS);
+		return(false);
 	}
 	logger.send(DEBUG, "IOP", "Setup pin %d as output", pinNumber);
 	pinMode(pinNumber, OUTPUT);
-	OutputConf *output = new OutputConf({ pinNumber, reversedOutput, cbFunc, 0 });
-	outputConfList.add(output);
 	return(true);
 }
 
@@ -124,16 +133,15 @@ bool EvtIO::outputSetup(uint8_t pinNumber, bool reversedOutput) {
 	Returns true if the provided pin has already been configured. Otherwise false
 */
 bool EvtIO::outputSet(uint8_t pinNumber, bool pinValue) {
-	for (uint8_t t = 0; t < outputConfList.size(); t++) {   // Go through each pin in the output config-list
-		OutputConf *outputConfig = outputConfList.get(t);
-		if (outputConfig->pinNumber == pinNumber) {
-			if (outputConfig->reversedOutput) pinValue = !pinValue;
+	for (OutputConf &outputConfig : outputConfList) {   // Go through each pin in the output config-list
+		if (outputConfig.pinNumber == pinNumber) {
+			if (outputConfig.reversedOutput) pinValue = !pinValue;
 			bool currentOutput = digitalRead(pinNumber);
 			if (currentOutput != pinValue) {   // Only if we have a new value for our pin, we do something
 				logger.send(DEBUG, "IOP", "Seting physical pin %d %s", pinNumber, pinValue ? "high" : "low");
 				digitalWrite(pinNumber, pinValue);
-				if (outputConfig->cbFunc != nullptr) {   // If we have a callback configured
-					outputConfig->cbFunc(pinNumber, pinValue, ++outputConfig->triggerCount);   // Do the callback
+				if (outputConfig.cbFunc != nullptr) {   // If we have a callback configured
+					outputConfig.cbFunc(pinNumber, pinValue, ++outputConfig.triggerCount);   // Do the callback
 				}
 			}
 			return(true);
@@ -150,8 +158,9 @@ bool EvtIO::outputSet(uint8_t pinNumber, bool pinValue) {
 	Returns true if the provided pin has already been configured. Otherwise false
 */
 bool EvtIO::outputToggle(uint8_t pinNumber) {
-	for (uint8_t t = 0; t < outputConfList.size(); t++) {   // Go through each pin in the output config-list
-		if (outputConfList.get(t)->reversedOutput) {
+	for (OutputConf &outputConfig : outputConfList) {   // Go through each pin in the output config-list
+		if (outputConfig.pinNumber != pinNumber) continue;
+		if (outputConfig.reversedOutput) {
 			return (outputSet(pinNumber, digitalRead(pinNumber)));
 		} else {
 			return (outputSet(pinNumber, !digitalRead(pinNumber)));
@@ -3,22 +3,24 @@
 
 #include <Arduino.h>
 #include "EvtLogger.h"
-#include <LinkedList.h>
+#include "EvtAlloc.h"
+#include "EvtCallback.h"
+#include "EvtSlotMap.h"
 
 #define IO_STACK_SIZE 5000
+#define IO_MAX_OUTPUTS 16
 
 
-typedef void(*InputCbFunc) (uint8_t pinNumber, bool pinState, unsigned long triggerCount); // Define callback function
-typedef void(*OutputCbFunc) (uint8_t pinNumber, bool pinState, unsigned long triggerCount); // Define callback function
+typedef EvtCallback<void(uint8_t pinNumber, bool pinState, unsigned long triggerCount)> InputCbFunc; // Define callback function
+typedef EvtCallback<void(uint8_t pinNumber, bool pinState, unsigned long triggerCount)> OutputCbFunc; // Define callback function
 
 
-/* Information stored about each interrupt pin */
+/* Information stored about each interrupt pin. The callback is kept apart in inputCallbacks, because the ISR doesn't touch it */
 struct Interrupt {
 	uint8_t pinNumber;
 	bool pinValue;
 	uint64_t interruptCount=0;
 	uint64_t lastInterruptCount=0;
-	InputCbFunc inputCbFunction;
 	unsigned long triggerCount=0;
 };
 
@@ -36,6 +38,7 @@ class EvtIO {
 private:
 	static portMUX_TYPE mux;
 	static volatile Interrupt interruptPin[10];
+	static InputCbFunc inputCallbacks[10];
 	static uint8_t numOfTriggers;
 
 	static void IRAM_ATTR handleHwInterrupt0();
@@ -50,7 +53,7 @@ private:
 	static void IRAM_ATTR handleHwInterrupt9();
 	static void taskHandleInterrupts(void *pvParameters);
 
-	LinkedList<OutputConf*> outputConfList;
+	EvtSlotMap<OutputConf, IO_MAX_OUTPUTS> outputConfList;
 public:
 	EvtIO();
 	bool trigger(uint8_t pinNumber, uint8_t mode, InputCbFunc cbFunction);
@@ -3,7 +3,7 @@
 
 
 // All logging goes through this queue
-QueueHandle_t EvtLogger::logQueue = xQueueCreate(LOG_QUEUE_LENGTH, sizeof(LogMessage));
+QueueHandle_t EvtLogger::logQueue = EvtAlloc::createQueue(LOG_QUEUE_LENGTH, sizeof(LogMessage));
 
 
 
@@ -13,7 +13,7 @@ EvtLogger::EvtLogger() {
 	Serial.begin(115200);
 	delay(100);
 
-	xTaskCreate(
+	EvtAlloc::createTask(
 		TaskShowLog,			// Task function.
 		"showLog",				// Name of task.
 		LOG_STACK_SIZE,			// Stack size in words
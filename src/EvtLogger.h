@@ -2,6 +2,7 @@
 #define _EVTLOGGER_h
 
 #include <Arduino.h>
+#include "EvtAlloc.h"
 
 #define LOGLEVEL 7
 
@@ -0,0 +1,177 @@
+#include "EvtModbus.h"
+
+
+
+/*	Starts polling devices on a UART. With a driver enable pin the UART runs in RS485 half duplex mode, and switches the
+	transceiver between sending and receiving by itself. Parameters:
+	serial: the UART. Like Serial2
+	baud: the speed of the bus
+	rxPin, txPin: the pins of the UART
+	dePin: the pin that enables the RS485 driver. -1 if the transceiver switches by itself
+	Returns false if the UART can't be set up
+*/
+bool EvtModbus::begin(HardwareSerial &serial, uint32_t baud, int8_t rxPin, int8_t txPin, int8_t dePin) {
+	serial.begin(baud, SERIAL_8N1, rxPin, txPin);
+	if (dePin >= 0) {
+		if (!serial.setPins(-1, -1, -1, dePin) || !serial.setMode(UART_MODE_RS485_HALF_DUPLEX)) {
+			logger.send(ERR, "MOD", "Can't set the UART in RS485 mode with DE on pin %d", dePin);
+			return(false);
+		}
+	}
+	return(begin((Stream&)serial, baud));
+}
+
+
+
+/*	Starts polling devices on any stream, like a software serial or a bridge. Parameters:
+	stream: where the frames are sent and received
+	baud: the speed of the bus. It gives the silent time between frames
+	Returns false if the task can't be started
+*/
+bool EvtModbus::begin(Stream &stream, uint32_t baud) {
+	_stream = &stream;
+	setBaud(baud);
+	writeQueue = EvtAlloc::createQueue(MODBUS_WRITE_QUEUE_LENGTH, sizeof(ModbusWrite));
+	logger.send(DEBUG, "MOD", "Starting modbus task at %lu baud", (unsigned long)baud);
+
+	EvtAlloc::createTask(
+		TaskPoll,				// Task function.
+		"ModbusPoll",			// Name of task.
+		MODBUS_STACK_SIZE,		// Stack size in words
+		(void*)this,			// We need to give the static method a reference to the instance of this class
+		1,						// Priority of the task.
+		&taskHandle);			// Used to wake the task when there is something new to do
+	return(writeQueue != NULL && taskHandle != NULL);
+}
+
+
+
+/*	Adds a block of registers that is read every interval. Parameters:
+	deviceAddress: the device. 1 to 247
+	function: MODBUS_READ_HOLDING_REGISTERS or MODBUS_READ_INPUT_REGISTERS
+	firstRegister, count: the registers. Max MODBUS_MAX_READ
+	interval: ms between reads
+	callBackFunc: gets the registers after each read, or the error
+	Returns false if it can't be added
+*/
+bool EvtModbus::addBlock(uint8_t deviceAddress, uint8_t function, uint16_t firstRegister, uint8_t count, unsigned long interval, ModbusCbFunc callBackFunc) {
+	if (count == 0 || count > MODBUS_MAX_READ || (function != MODBUS_READ_HOLDING_REGISTERS && function != MODBUS_READ_INPUT_REGISTERS)) {
+		logger.send(ERR, "MOD", "Can't read %d registers with function %d", count, function);
+		return(false);
+	}
+	if (findDevice(deviceAddress) == nullptr) {
+		logger.send(ERR, "MOD", "No more than %d modbus devices", MODBUS_MAX_DEVICES);
+		return(false);
+	}
+	if (!ModbusMaster::addBlock(deviceAddress, function, firstRegister, count, interval, callBackFunc)) {
+		logger.send(ERR, "MOD", "No room for more blocks. Raise MODBUS_MAX_BLOCKS");
+		return(false);
+	}
+	logger.send(DEBUG, "MOD", "Reading %d registers from %d on device %d every %lu ms", count, firstRegister, deviceAddress, interval);
+	if (taskHandle != NULL) xTaskNotifyGive(taskHandle);   // It's read at once
+	return(true);
+}
+
+
+
+/*	Writes a register. It's queued and written before the next read. Parameters:
+	deviceAddress: the device. 1 to 247
+	registerAddress, value: what to write
+	callBackFunc: called with the result when it's written. values is the written value. May be nullptr
+	Returns false if the queue is full
+*/
+bool EvtModbus::writeRegister(uint8_t deviceAddress, uint16_t registerAddress, uint16_t value, ModbusCbFunc callBackFunc) {
+	if (writeQueue == NULL || findDevice(deviceAddress) == nullptr) return(false);
+	ModbusWrite write = { deviceAddress, registerAddress, value, callBackFunc };
+	if (xQueueSend(writeQueue, &write, 0) != pdTRUE) {
+		logger.send(WARN, "MOD", "Write queue is full. Register %d on device %d is not written", registerAddress, deviceAddress);
+		return(false);
+	}
+	xTaskNotifyGive(taskHandle);
+	return(true);
+}
+
+
+
+/*	The task that runs the bus. Queued writes go first. Then the block with the nearest deadline is read, together with the
+	blocks that can go along. When nothing is due it sleeps until the next deadline or a write.
+	This has to be a static method because eps32 tasks can't call an instance member of a class!
+*/
+void EvtModbus::TaskPoll(void *pvParameters) {
+	EvtModbus *modbus = (EvtModbus*)pvParameters;
+	while (true) {
+		ModbusWrite write;
+		while (xQueueReceive(modbus->writeQueue, &write, 0) == pdTRUE) modbus->writeNext(write);
+		unsigned long sleepTime = modbus->pollNext();
+		if (sleepTime > 0) ulTaskNotifyTake(pdTRUE, sleepTime / portTICK_PERIOD_MS + 1);
+	}
+}
+
+
+
+/* Sends a frame and waits until the last bit is sent. In RS485 mode the UART releases the driver after that */
+void EvtModbus::sendFrame(const uint8_t* frame, uint16_t length) {
+	_stream->write(frame, length);
+	_stream->flush();
+}
+
+
+
+/* Returns the next received byte, or -1 if there is none */
+int EvtModbus::receiveByte() {
+	return(_stream->available() ? _stream->read() : -1);
+}
+
+
+
+/* Gives the cpu to other tasks for a tick while an answer comes in */
+void EvtModbus::waitForByte() {
+	vTaskDelay(1);
+}
+
+
+
+unsigned long EvtModbus::nowMs() {
+	return(millis());
+}
+
+
+
+unsigned long EvtModbus::nowUs() {
+	return(micros());
+}
+
+
+
+void EvtModbus::waitUs(unsigned long us) {
+	delayMicroseconds(us);
+}
+
+
+
+/* The counters are read by getStats() from other tasks */
+void EvtModbus::lock() {
+	portENTER_CRITICAL(&mux);
+}
+
+
+
+void EvtModbus::unlock() {
+	portEXIT_CRITICAL(&mux);
+}
+
+
+
+/*	Logs a request that went wrong. Parameters:
+	request: the request that was sent
+	response, length: what was received
+	result: what was wrong
+	latency: ms from the request until the answer ended
+*/
+void EvtModbus::failed(const uint8_t* request, const uint8_t* response, uint16_t length, ModbusResult result, unsigned long latency) {
+	if (result == MODBUS_EXCEPTION) {
+		logger.send(WARN, "MOD", "Device %d refused function %d with exception %d", request[0], request[1], response[2]);
+	} else {
+		logger.send(WARN, "MOD", "Request to device %d failed with %d after %lu ms and %d bytes", request[0], result, latency, length);
+	}
+}
@@ -0,0 +1,44 @@
+#ifndef _EVTMODBUS_h
+#define _EVTMODBUS_h
+
+#include <Arduino.h>
+#include "EvtLogger.h"
+#include "EvtAlloc.h"
+#include "EvtModbusMaster.h"
+
+#define MODBUS_STACK_SIZE 4000
+#define MODBUS_WRITE_QUEUE_LENGTH 8
+
+
+
+/*	Polls modbus RTU devices on a serial bus. Blocks of registers are read at their own interval and given to a callback.
+	Blocks of the same device that are close to each other and due at about the same time are read in one request. The bus
+	is run by one task that always serves the block with the nearest deadline. Writes go before reads.
+	The requests are made by ModbusMaster. This class gives it the UART, the clock and the task
+*/
+class EvtModbus : public ModbusMaster {
+private:
+	Stream *_stream = nullptr;
+	portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+	QueueHandle_t writeQueue = NULL;
+	TaskHandle_t taskHandle = NULL;
+
+	static void TaskPoll(void *pvParameters);
+protected:
+	void sendFrame(const uint8_t* frame, uint16_t length);
+	int receiveByte();
+	void waitForByte();
+	unsigned long nowMs();
+	unsigned long nowUs();
+	void waitUs(unsigned long us);
+	void lock();
+	void unlock();
+	void failed(const uint8_t* request, const uint8_t* response, uint16_t length, ModbusResult result, unsigned long latency);
+public:
+	bool begin(HardwareSerial &serial, uint32_t baud, int8_t rxPin, int8_t txPin, int8_t dePin);
+	bool begin(Stream &stream, uint32_t baud);
+	bool addBlock(uint8_t deviceAddress, uint8_t function, uint16_t firstRegister, uint8_t count, unsigned long interval, ModbusCbFunc callBackFunc);
+	bool writeRegister(uint8_t deviceAddress, uint16_t registerAddress, uint16_t value, ModbusCbFunc callBackFunc = nullptr);
+};
+
+#endif
@@ -0,0 +1,304 @@
+#include "EvtModbusMaster.h"
+
+
+
+/*	The crc of modbus RTU frames. It's sent low byte first. Parameters:
+	data, length: the frame without the crc
+*/
+uint16_t ModbusFrame::crc16(const uint8_t* data, uint16_t length) {
+	uint16_t crc = 0xFFFF;
+	while (length--) {
+		crc ^= *data++;
+		for (uint8_t i = 0; i < 8; i++) crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+	}
+	return(crc);
+}
+
+
+
+/*	Makes a request to read registers. Parameters:
+	frame: room for 8 bytes
+	deviceAddress: the device. 1 to 247
+	function: MODBUS_READ_HOLDING_REGISTERS or MODBUS_READ_INPUT_REGISTERS
+	firstRegister, count: the registers to read
+	Returns the length of the frame
+*/
+uint16_t ModbusFrame::makeRead(uint8_t* frame, uint8_t deviceAddress, uint8_t function, uint16_t firstRegister, uint8_t count) {
+	frame[0] = deviceAddress;
+	frame[1] = function;
+	frame[2] = firstRegister >> 8;
+	frame[3] = firstRegister & 0xFF;
+	frame[4] = 0;
+	frame[5] = count;
+	uint16_t crc = crc16(frame, 6);
+	frame[6] = crc & 0xFF;
+	frame[7] = crc >> 8;
+	return(8);
+}
+
+
+
+/*	Makes a request to write one register. Parameters:
+	frame: room for 8 bytes
+	deviceAddress: the device. 1 to 247
+	registerAddress, value: what to write
+	Returns the length of the frame
+*/
+uint16_t ModbusFrame::makeWrite(uint8_t* frame, uint8_t deviceAddress, uint16_t registerAddress, uint16_t value) {
+	frame[0] = deviceAddress;
+	frame[1] = MODBUS_WRITE_SINGLE_REGISTER;
+	frame[2] = registerAddress >> 8;
+	frame[3] = registerAddress & 0xFF;
+	frame[4] = value >> 8;
+	frame[5] = value & 0xFF;
+	uint16_t crc = crc16(frame, 6);
+	frame[6] = crc & 0xFF;
+	frame[7] = crc >> 8;
+	return(8);
+}
+
+
+
+/* Returns the length of a good answer to a request. An exception answer is shorter */
+uint16_t ModbusFrame::responseLength(const uint8_t* request) {
+	if (request[1] == MODBUS_WRITE_SINGLE_REGISTER) return(8);   // The request is echoed
+	return(5 + 2 * request[5]);   // Address, function, byte count, the registers and the crc
+}
+
+
+
+/*	Checks an answer. Parameters:
+	request: the request that was sent
+	response, length: what was received
+	Returns MODBUS_OK if it's a good answer to the request
+*/
+ModbusResult ModbusFrame::check(const uint8_t* request, const uint8_t* response, uint16_t length) {
+	if (length < 5) return(MODBUS_TIMEOUT);
+	if (crc16(response, length - 2) != (response[length - 2] | (response[length - 1] << 8))) return(MODBUS_BAD_CRC);
+	if (response[0] != request[0] || (response[1] & 0x7F) != request[1]) return(MODBUS_BAD_FRAME);
+	if (response[1] & 0x80) return(MODBUS_EXCEPTION);
+	if (length != responseLength(request)) return(MODBUS_BAD_FRAME);
+	if (request[1] == MODBUS_WRITE_SINGLE_REGISTER) return(memcmp(request, response, 8) == 0 ? MODBUS_OK : MODBUS_BAD_FRAME);
+	return(response[2] == 2 * request[5] ? MODBUS_OK : MODBUS_BAD_FRAME);
+}
+
+
+
+/*	Gets the registers of a good answer to a read. Parameters:
+	response: the answer
+	values: filled with the registers
+	count: the number of registers
+*/
+void ModbusFrame::getRegisters(const uint8_t* response, uint16_t* values, uint8_t count) {
+	for (uint8_t i = 0; i < count; i++) values[i] = (response[3 + 2 * i] << 8) | response[4 + 2 * i];
+}
+
+
+
+/*	Sets the silent time between frames and the time a character takes. Parameters:
+	baud: the speed of the bus
+*/
+void ModbusMaster::setBaud(uint32_t baud) {
+	frameGap = baud <= 19200 ? 38500000UL / baud : 1750;   // 3.5 characters of 11 bits. Fixed above 19200 baud
+	charTime = 11000000UL / baud;
+}
+
+
+
+/*	Adds a block of registers that is read every interval. Parameters:
+	deviceAddress: the device. 1 to 247
+	function: MODBUS_READ_HOLDING_REGISTERS or MODBUS_READ_INPUT_REGISTERS
+	firstRegister, count: the registers. Max MODBUS_MAX_READ
+	interval: ms between reads
+	callBackFunc: gets the registers after each read, or the error
+	Returns false if the block is wrong, or there is no room for it or its device
+*/
+bool ModbusMaster::addBlock(uint8_t deviceAddress, uint8_t function, uint16_t firstRegister, uint8_t count, unsigned long interval, ModbusCbFunc callBackFunc) {
+	if (count == 0 || count > MODBUS_MAX_READ || (function != MODBUS_READ_HOLDING_REGISTERS && function != MODBUS_READ_INPUT_REGISTERS)) return(false);
+	if (findDevice(deviceAddress) == nullptr) return(false);
+
+	ModbusBlock block;
+	block.deviceAddress = deviceAddress;
+	block.function = function;
+	block.firstRegister = firstRegister;
+	block.count = count;
+	block.interval = interval;
+	block.callBackFunc = callBackFunc;
+	lock();   // Blocks may be added from several tasks at once
+	bool added = blockList.add(block) != nullptr;
+	unlock();
+	return(added);
+}
+
+
+
+/*	Returns the counters of a device. They are all zero for a device that is not polled. Parameters:
+	deviceAddress: the device
+*/
+ModbusStats ModbusMaster::getStats(uint8_t deviceAddress) {
+	ModbusStats stats;
+	lock();
+	for (uint8_t i = 0; i < deviceCount; i++) {
+		if (devices[i].address == deviceAddress) stats = devices[i].stats;
+	}
+	unlock();
+	return(stats);
+}
+
+
+
+/*	Returns the entry of a device. It's made if it isn't there. Parameters:
+	deviceAddress: the device
+	Returns nullptr if there is no room for more devices
+*/
+ModbusDevice* ModbusMaster::findDevice(uint8_t deviceAddress) {
+	ModbusDevice *device = nullptr;
+	lock();   // Devices are made by the tasks that add blocks
+	for (uint8_t i = 0; i < deviceCount; i++) {
+		if (devices[i].address == deviceAddress) device = &devices[i];
+	}
+	if (device == nullptr && deviceCount < MODBUS_MAX_DEVICES) {
+		device = &devices[deviceCount];
+		device->address = deviceAddress;
+		deviceCount++;   // Counted last, so the task never sees a half made device
+	}
+	unlock();
+	return(device);
+}
+
+
+
+/*	Reads the block with the nearest deadline, if it's due. Other blocks of the same device and function are read in the
+	same request if they are close by and due within MODBUS_MERGE_AHEAD % of their interval. Many devices refuse to read
+	registers that are not mapped. When a merged request gets an exception, its blocks are marked to be read alone, and
+	they are read again right away without calling back the error.
+	Returns 0 if a request was made, otherwise ms until the next block is due
+*/
+unsigned long ModbusMaster::pollNext() {
+	ModbusBlock *first = nullptr;
+	unsigned long firstDue = 1000UL * 3600;
+	unsigned long now = nowMs();
+	for (ModbusBlock &block : blockList) {
+		unsigned long sincePolled = now - block.lastPolled;
+		unsigned long untilDue = !block.polled || sincePolled >= block.interval ? 0 : block.interval - sincePolled;
+		if (first == nullptr || untilDue < firstDue) {
+			first = &block;
+			firstDue = untilDue;
+		}
+	}
+	if (first == nullptr || firstDue > 0) return(firstDue);
+
+	uint16_t start = first->firstRegister;
+	uint16_t end = first->firstRegister + first->count;   // One past the last register
+	first->merged = true;
+	bool added = !first->alone;
+	while (added) {   // A block that is added may bring the next one in reach
+		added = false;
+		for (ModbusBlock &block : blockList) {
+			if (block.merged || block.alone || block.deviceAddress != first->deviceAddress || block.function != first->function) continue;
+			unsigned long sincePolled = now - block.lastPolled;
+			if (block.polled && sincePolled < block.interval - block.interval * MODBUS_MERGE_AHEAD / 100) continue;
+			if (block.firstRegister > end + MODBUS_MERGE_GAP || block.firstRegister + block.count + MODBUS_MERGE_GAP < start) continue;
+			uint16_t newStart = block.firstRegister < start ? block.firstRegister : start;
+			uint16_t newEnd = block.firstRegister + block.count > end ? block.firstRegister + block.count : end;
+			if (newEnd - newStart > MODBUS_MAX_READ) continue;
+			start = newStart;
+			end = newEnd;
+			block.merged = true;
+			added = true;
+		}
+	}
+
+	uint8_t request[8];
+	uint8_t response[MODBUS_FRAME_SIZE];
+	uint16_t values[MODBUS_MAX_READ];
+	uint16_t requestLength = ModbusFrame::makeRead(request, first->deviceAddress, first->function, start, end - start);
+	ModbusResult result = transaction(request, requestLength, response);
+	if (result == MODBUS_OK) ModbusFrame::getRegisters(response, values, end - start);
+
+	if (result == MODBUS_EXCEPTION && (start != first->firstRegister || end != first->firstRegister + first->count)) {
+		for (ModbusBlock &block : blockList) {   // The merge was refused. lastPolled is kept, so the due blocks are read alone right away
+			if (!block.merged) continue;
+			block.merged = false;
+			block.alone = true;
+		}
+		return(0);
+	}
+
+	now = nowMs();
+	for (ModbusBlock &block : blockList) {
+		if (!block.merged) continue;
+		block.merged = false;
+		block.lastPolled = now;
+		block.polled = true;
+		block.callBackFunc(block.deviceAddress, block.firstRegister, values + (block.firstRegister - start), block.count, result);
+	}
+	return(0);
+}
+
+
+
+/*	Writes a queued register. Parameters:
+	write: the register and value
+*/
+void ModbusMaster::writeNext(ModbusWrite &write) {
+	uint8_t request[8];
+	uint8_t response[MODBUS_FRAME_SIZE];
+	uint16_t requestLength = ModbusFrame::makeWrite(request, write.deviceAddress, write.registerAddress, write.value);
+	ModbusResult result = transaction(request, requestLength, response);
+	if (write.callBackFunc != nullptr) write.callBackFunc(write.deviceAddress, write.registerAddress, &write.value, 1, result);
+}
+
+
+
+/*	Sends a request and receives the answer. The bus is kept silent for 3.5 characters between frames. The device gets
+	MODBUS_RESPONSE_TIMEOUT plus the time the whole answer takes at the baud rate, so long reads on slow buses don't time out.
+	Parameters:
+	request, requestLength: the frame to send
+	response: room for MODBUS_FRAME_SIZE bytes. Filled with the answer
+	Returns the result, which is also counted in the stats of the device
+*/
+ModbusResult ModbusMaster::transaction(const uint8_t* request, uint16_t requestLength, uint8_t* response) {
+	unsigned long silence = nowUs() - lastFrameEnd;
+	if (silence < frameGap) waitUs(frameGap - silence);
+	while (receiveByte() >= 0);   // Late bytes of an earlier answer
+
+	unsigned long started = nowMs();
+	sendFrame(request, requestLength);
+	unsigned long sent = nowMs();
+
+	uint16_t expectedLength = ModbusFrame::responseLength(request);
+	unsigned long timeout = MODBUS_RESPONSE_TIMEOUT + (expectedLength * charTime + 999) / 1000;
+	uint16_t length = 0;
+	while (length < expectedLength && nowMs() - sent < timeout) {
+		int received = receiveByte();
+		if (received < 0) {
+			waitForByte();
+			continue;
+		}
+		response[length++] = received;
+		if (length == 2 && (response[1] & 0x80)) expectedLength = 5;   // An exception answer
+	}
+	lastFrameEnd = nowUs();
+	unsigned long latency = nowMs() - started;
+
+	ModbusResult result = ModbusFrame::check(request, response, length);
+	ModbusDevice *device = findDevice(request[0]);
+	lock();
+	device->stats.requests++;
+	switch (result) {
+	case MODBUS_OK:
+		device->stats.lastLatency = latency;
+		device->stats.latencyTotal += latency;
+		if (latency > device->stats.longestLatency) device->stats.longestLatency = latency;
+		break;
+	case MODBUS_TIMEOUT: device->stats.timeouts++; break;
+	case MODBUS_BAD_CRC: device->stats.crcErrors++; break;
+	case MODBUS_BAD_FRAME: device->stats.badFrames++; break;
+	case MODBUS_EXCEPTION: device->stats.exceptions++; break;
+	}
+	unlock();
+
+	if (result != MODBUS_OK) failed(request, response, length, result, latency);
+	return(result);
+}
@@ -0,0 +1,130 @@
+#ifndef _EVTMODBUSMASTER_h
+#define _EVTMODBUSMASTER_h
+
+#include <stdint.h>
+#include <string.h>
+#include "EvtCallback.h"
+#include "EvtSlotMap.h"
+
+#define MODBUS_MAX_DEVICES 16
+#define MODBUS_MAX_BLOCKS 32
+#define MODBUS_MAX_READ 125   // Max registers in one read request. The limit of the protocol
+#define MODBUS_MERGE_GAP 8   // Unused registers between two blocks that may be read along, so both are read in one request. Blocks whose merged read is refused are read alone after that
+#define MODBUS_MERGE_AHEAD 50   // A block may be read this many % of its interval early, to go along with another block
+#define MODBUS_RESPONSE_TIMEOUT 200   // ms a device may take to start answering. The time the answer takes on the wire is added
+#define MODBUS_FRAME_SIZE 256
+
+// Function codes
+#define MODBUS_READ_HOLDING_REGISTERS 0x03
+#define MODBUS_READ_INPUT_REGISTERS 0x04
+#define MODBUS_WRITE_SINGLE_REGISTER 0x06
+
+
+
+// The outcome of a request
+enum ModbusResult {
+	MODBUS_OK,
+	MODBUS_TIMEOUT,   // No answer, or it was cut short
+	MODBUS_BAD_CRC,
+	MODBUS_BAD_FRAME,   // An answer from another device or to another function, or with a wrong length
+	MODBUS_EXCEPTION   // The device refused the request. The exception code is in the log
+};
+
+
+// Definition of the callback function that gets the registers of a block. values is only valid if result is MODBUS_OK
+typedef EvtCallback<void(uint8_t deviceAddress, uint16_t firstRegister, const uint16_t* values, uint8_t count, ModbusResult result)> ModbusCbFunc;
+
+
+// Counters for one device
+struct ModbusStats {
+	unsigned long requests = 0;
+	unsigned long timeouts = 0;
+	unsigned long crcErrors = 0;
+	unsigned long badFrames = 0;
+	unsigned long exceptions = 0;
+	unsigned long lastLatency = 0;   // ms from sending a request until the whole answer is received
+	unsigned long longestLatency = 0;
+	unsigned long latencyTotal = 0;   // For all good answers. Divide by requests minus errors for the average
+};
+
+
+// A range of registers that is read again and again
+struct ModbusBlock {
+	uint8_t deviceAddress;
+	uint8_t function;
+	uint16_t firstRegister;
+	uint8_t count;
+	unsigned long interval;   // ms
+	unsigned long lastPolled = 0;
+	bool polled = false;   // False until the first read
+	bool merged = false;   // True while it's part of the request being made
+	bool alone = false;   // Set when a merged request with this block was refused. It's read on its own from then on
+	ModbusCbFunc callBackFunc;
+};
+
+
+// A register to write. They are queued, and written before the next read
+struct ModbusWrite {
+	uint8_t deviceAddress;
+	uint16_t registerAddress;
+	uint16_t value;
+	ModbusCbFunc callBackFunc;
+};
+
+
+struct ModbusDevice {
+	uint8_t address;
+	ModbusStats stats;
+};
+
+
+
+/*	Makes and checks modbus RTU frames. There is no hardware in here, so it can be tested on any computer */
+class ModbusFrame {
+public:
+	static uint16_t crc16(const uint8_t* data, uint16_t length);
+	static uint16_t makeRead(uint8_t* frame, uint8_t deviceAddress, uint8_t function, uint16_t firstRegister, uint8_t count);
+	static uint16_t makeWrite(uint8_t* frame, uint8_t deviceAddress, uint16_t registerAddress, uint16_t value);
+	static uint16_t responseLength(const uint8_t* request);
+	static ModbusResult check(const uint8_t* request, const uint8_t* response, uint16_t length);
+	static void getRegisters(const uint8_t* response, uint16_t* values, uint8_t count);
+};
+
+
+
+/*	The requests and answers of a modbus RTU master, without the bus and the task. It picks the block with the nearest
+	deadline, merges the blocks that can go along, sends the request, waits for the answer and counts the outcome.
+	The bus, the clock and the lock come from a subclass: EvtModbus runs it on a UART in a FreeRTOS task. The test in
+	extras/test/ModbusPty runs it on a pseudo terminal on Linux, against a simulated device
+*/
+class ModbusMaster {
+private:
+	unsigned long frameGap = 1750;   // us of silence between frames. 3.5 characters
+	unsigned long charTime = 573;   // us to send one character of 11 bits
+	unsigned long lastFrameEnd = 0;   // nowUs() at the end of the last frame on the bus
+	EvtSlotMap<ModbusBlock, MODBUS_MAX_BLOCKS> blockList;
+	ModbusDevice devices[MODBUS_MAX_DEVICES];
+	volatile uint8_t deviceCount = 0;
+protected:
+	virtual void sendFrame(const uint8_t* frame, uint16_t length) = 0;   // Returns when the last bit has left
+	virtual int receiveByte() = 0;   // -1 if there is no byte
+	virtual void waitForByte() = 0;   // Lets others run while the answer comes in
+	virtual unsigned long nowMs() = 0;
+	virtual unsigned long nowUs() = 0;
+	virtual void waitUs(unsigned long us) = 0;
+	virtual void lock() {}   // Around the counters, which are read by other tasks, and around adding blocks and devices
+	virtual void unlock() {}
+	virtual void failed(const uint8_t* request, const uint8_t* response, uint16_t length, ModbusResult result, unsigned long latency) {}
+
+	void setBaud(uint32_t baud);
+	ModbusDevice* findDevice(uint8_t deviceAddress);
+	unsigned long pollNext();
+	void writeNext(ModbusWrite &write);
+	ModbusResult transaction(const uint8_t* request, uint16_t requestLength, uint8_t* response);
+public:
+	virtual ~ModbusMaster() {}
+	bool addBlock(uint8_t deviceAddress, uint8_t function, uint16_t firstRegister, uint8_t count, unsigned long interval, ModbusCbFunc callBackFunc);
+	ModbusStats getStats(uint8_t deviceAddress);
+};
+
+#endif
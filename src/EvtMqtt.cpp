@@ -3,12 +3,39 @@
 #include "PubSubClient.h"
 
 
-LinkedList<Subscription> EvtMqtt::mqttSubscriptionList;
+EvtSlotMap<Subscription, MQTT_MAX_SUBSCRIPTIONS> EvtMqtt::mqttSubscriptionList;
+MqttTopicTree<Subscription> EvtMqtt::topicTree;
 QueueHandle_t EvtMqtt::mqttPublishQueue;
+portMUX_TYPE EvtMqtt::topicMux = portMUX_INITIALIZER_UNLOCKED;
+char EvtMqtt::topicStore[MQTT_TOPIC_STORE_SIZE];
+uint16_t EvtMqtt::topicStoreUsed = 0;
+uint16_t EvtMqtt::topicOffsets[MQTT_MAX_TOPICS];
+uint32_t EvtMqtt::topicHashes[MQTT_MAX_TOPICS];
+uint8_t EvtMqtt::topicFlags[MQTT_MAX_TOPICS];
+volatile uint16_t EvtMqtt::topicCount = 0;
+portMUX_TYPE EvtMqtt::latestMux = portMUX_INITIALIZER_UNLOCKED;
+LatestItem EvtMqtt::latestTable[MQTT_MAX_TOPICS];
+uint16_t EvtMqtt::latestDirtyList[MQTT_MAX_TOPICS];
+uint16_t EvtMqtt::latestDirtyHead = 0;
+uint16_t EvtMqtt::latestDirtyCount = 0;
+QueueHandle_t EvtMqtt::mqttSubscribeQueue;
+QueueHandle_t EvtMqtt::dispatchQueue;
+DispatchOverflow EvtMqtt::dispatchOverflow = DISPATCH_DROP_OLDEST;
+uint8_t EvtMqtt::dispatchPriority = 1;
+int EvtMqtt::wakeSocket = -1;
+int EvtMqtt::wakeSendSocket = -1;
+sockaddr_in EvtMqtt::wakeAddress;
+volatile bool EvtMqtt::wakePending = false;
+uint8_t EvtMqtt::packetBuffer[MQTT_PACKET_SIZE];
+uint16_t EvtMqtt::lastPacketId = 0;
+uint16_t EvtMqtt::lastSubscribeId = 0;
+InflightItem EvtMqtt::inflightTable[MQTT_INFLIGHT_WINDOW];
+uint8_t EvtMqtt::inflightCount = 0;
+MqttStats EvtMqtt::stats;
 
 
 
-/*	Creates 2 tasks. One for keeping connected to the mqtt server and one for publishing things from the mqttPublishQueue. Parameters:
+/*	Creates the task that owns the mqtt connection. It connects, publishes and receives. Parameters:
 	mqttServer: hostname or IP of mqtt server
 	mqttPort: portnumber. Normally it is 1883
 	mqttClientId: A unique string that identifies this client to the mqtt-server.
@@ -16,7 +43,11 @@ QueueHandle_t EvtMqtt::mqttPublishQueue;
 	mqttPassword: Password
 */
 void EvtMqtt::begin(char* mqttServer, uint16_t mqttPort, char* mqttClientId, char* mqttUser, char* mqttPassword) {
-	mqttPublishQueue = xQueueCreate(MQTT_QUEUE_LENGTH, sizeof(PublishItem));
+	mqttPublishQueue = EvtAlloc::createQueue(MQTT_QUEUE_LENGTH, sizeof(PublishItem));
+	mqttSubscribeQueue = EvtAlloc::createQueue(MQTT_SUBSCRIBE_QUEUE_LENGTH, sizeof(Subscription));
+	dispatchQueue = EvtAlloc::createQueue(MQTT_DISPATCH_QUEUE_LENGTH, sizeof(DispatchItem));
+	createWakeupSockets();
+	EvtWiFi::onChange(wifiChanged);   // We are woken up when wifi connects or disconnects
 
 	_mqttServer = mqttServer;
 	_mqttPort = mqttPort;
@@ -24,221 +55,1018 @@ void EvtMqtt::begin(char* mqttServer, uint16_t mqttPort, char* mqttClientId, cha
 	_mqttUser = mqttUser;
 	_mqttPassword = mqttPassword;
 
-	mqttClient = new PubSubClient(_mqttServer, _mqttPort, messageReceived, net);
+	transport.setClient(&net);
+	mqttClient = EvtAlloc::create<PubSubClient>(_mqttServer, _mqttPort, messageReceived, transport);
+	mqttClient->setBufferSize(MQTT_PACKET_SIZE);
+	mqttClient->setKeepAlive(MQTT_KEEPALIVE);
 
-	logger.send(DEBUG, "MQT", "Starting MQTT connection task");
-	xTaskCreate(
-		TaskKeepConnected,				// Task function.
-		"MQTTKeepConnected",			// Name of task.
-		MQTT_STACK_SIZE_KEEPCONNECTED,	// Stack size in words 
-		(void*)this,					// We need to give the static method getTemperature a reference to the instance of this class
+	logger.send(DEBUG, "MQT", "Starting MQTT task");
+	EvtAlloc::createTask(
+		TaskMqtt,						// Task function.
+		"MQTT",							// Name of task.
+		MQTT_STACK_SIZE,				// Stack size in words 
+		(void*)this,					// We need to give the static method a reference to the instance of this class
 		1,								// Priority of the task.
 		NULL);
 
-	logger.send(DEBUG, "MQT", "Starting MQTT publishing task");
-	xTaskCreate(
-		TaskPublishQueue,				// Task function.
-		"MQTTpublish",					// Name of task.
-		MQTT_STACK_SIZE_PUBLISH,		// Stack size in words 
-		(void*)this,					// We need to give the static method getTemperature a reference to the instance of this class
-		1,								// Priority of the task.
+	EvtAlloc::createTask(
+		TaskDispatch,					// Task function.
+		"MQTTDispatch",					// Name of task.
+		MQTT_DISPATCH_STACK_SIZE,		// Stack size in words 
+		NULL,							// Parameter of the task
+		dispatchPriority,				// Priority of the task.
 		NULL);
 }
 
 
 
-/* A task that connects to the mqtt server and reconnects if it gets disconnected */
-void EvtMqtt::TaskKeepConnected(void *pvParameters) {
-	EvtMqtt inst = *((EvtMqtt*)pvParameters);   // We are inside static method. We need to be able to reference the instance.
+/*	Sets how the subscription callbacks are run. They run in their own task, so slow callbacks don't hold up the mqtt
+	connection. Each received message is copied to a buffer from the EvtBufferPool while it waits for its callback. A message
+	that doesn't fit in a small buffer needs one of the BUFFER_POOL_LARGE_COUNT (2) large ones, so a burst of big messages
+	is dropped by the overflow policy. Raw subscriptions made with zeroCopy skip the copy and the queue. Call it before
+	begin(). Parameters:
+	priority: priority of the callback task. The mqtt task has priority 1
+	overflow: what to do with received messages when the callbacks can't keep up
+*/
+void EvtMqtt::setDispatch(uint8_t priority, DispatchOverflow overflow) {
+	dispatchPriority = priority;
+	dispatchOverflow = overflow;
+}
+
+
 
+/*	Runs the subscription callbacks. It takes the received messages from the dispatch queue one at the time, so callbacks
+	can switch relays, write to flash or publish without delaying the mqtt connection. The time of each callback is measured.
+*/
+void EvtMqtt::TaskDispatch(void *pvParameters) {
+	DispatchItem item;
 	while (true) {
-		while (WiFi.status() != WL_CONNECTED) {   // If we have no wifi, there is no need to try connecting mqtt
-			vTaskDelay(100 / portTICK_PERIOD_MS);
+		if (xQueueReceive(dispatchQueue, &item, portMAX_DELAY) == pdTRUE) {
+			unsigned long startedAt = micros();
+			item.subscription->dispatchFunc(item.subscription, item.buffer, (byte*)item.buffer + item.topicLength + 1, item.length);
+			unsigned long callbackTime = micros() - startedAt;
+
+			SubscriptionStats &subscriptionStats = item.subscription->stats;
+			subscriptionStats.calls++;
+			subscriptionStats.totalTime += callbackTime;
+			if (callbackTime > subscriptionStats.longestTime) subscriptionStats.longestTime = callbackTime;
+			EvtBufferPool::give(item.buffer);
+		}
+	}
+}
+
+
+
+/*	The only task that touches the mqtt client and its socket. It connects to the mqtt server and reconnects if it gets
+	disconnected. While connected it sleeps in select() until the socket has data, someone wants to publish or subscribe,
+	or the keepalive is due. So incoming messages are handled at once and nothing runs when nothing happens.
+*/
+void EvtMqtt::TaskMqtt(void *pvParameters) {
+	EvtMqtt *inst = (EvtMqtt*)pvParameters;   // We are inside static method. We need to be able to reference the instance.
+
+	unsigned long disconnectedAt = millis();
+	while (true) {
+		while (!EvtWiFi::isConnected()) {   // If we have no wifi, there is no need to try connecting mqtt
+			inst->waitOffline(MQTT_RECONNECT_MAX_DELAY, true);
+		}
+		if (stats.connects > 0) {   // After losing a connection we wait a random time, so a lot of devices don't reconnect at the same time
+			inst->waitOffline(esp_random() % MQTT_RECONNECT_MIN_DELAY);
 		}
-		logger.send(INFO, "MQT", "Connecting to MQTT server %s", inst._mqttServer);
-		while (!inst.mqttClient->connect(inst._mqttClientId, inst._mqttUser, inst._mqttPassword)) {   // Keep reconnecting mqtt until we succeed
-			vTaskDelay( 1000UL*MQTT_CHECK_FOR_CONNECTION_EVERY / portTICK_PERIOD_MS);
-			logger.send(WARN, "MQT", "No MQTT connection. Reconnecting");
+
+		uint8_t attempt = 0;
+		logger.send(INFO, "MQT", "Connecting to MQTT server %s", inst->_mqttServer);
+		stats.connectAttempts++;
+		bool cleanSession = inflightCount == 0;   // QoS messages in flight are sent again. The server must keep its half of them, or QoS 2 is not exactly once
+		while (!inst->mqttClient->connect(inst->_mqttClientId, inst->_mqttUser, inst->_mqttPassword, nullptr, 0, false, nullptr, cleanSession)) {   // Keep reconnecting mqtt until we succeed
+			unsigned long reconnectDelay = inst->reconnectDelay(attempt);
+			if (attempt < 255) attempt++;
+			logger.send(WARN, "MQT", "No MQTT connection. Reconnecting in %lu ms", reconnectDelay);
+			inst->waitOffline(reconnectDelay);
+			stats.connectAttempts++;
+		}
+		stats.connects++;
+		stats.lastReconnectTime = millis() - disconnectedAt;
+		if (stats.lastReconnectTime > stats.longestReconnectTime) stats.longestReconnectTime = stats.lastReconnectTime;
+		logger.send(INFO, "MQT", "Connected after %lu ms and %d attempts", stats.lastReconnectTime, attempt + 1);
+		if (!cleanSession && !inst->transport.isSessionPresent()) {
+			logger.send(WARN, "MQT", "The mqtt server has lost our session. %d QoS messages are sent again and may arrive twice", inflightCount);
 		}
-		logger.send(INFO, "MQT", "Connected");
-		inst.subscribeAll();   // We need to resubscibe all topics after a reconnection
+		inst->net.setNoDelay(true);   // Small mqtt packets should not wait for more data
+		inst->subscribeAll();   // We need to resubscibe all topics after a reconnection
+		inst->retransmitInflight(true);   // QoS messages that were not acknowledged before we got disconnected
+
+		unsigned long lastPublished = millis() - MQTT_PUBLISH_EVERY;
+		while (inst->mqttClient->connected()) {
+			inst->handleSubscribeQueue(true);
+
+			unsigned long sincePublished = millis() - lastPublished;
+			bool windowOpen = inflightCount < MQTT_INFLIGHT_WINDOW;   // Nothing is sent while too many QoS messages wait for acknowledge
+			bool waitingItems = latestDirtyCount > 0 || uxQueueMessagesWaiting(mqttPublishQueue) > 0;
+			if (windowOpen && waitingItems && sincePublished >= MQTT_PUBLISH_EVERY) {   // To not flood the mqtt server there is some time between publishes
+				inst->publishWaitingItem();
+				lastPublished = millis();
+				sincePublished = 0;
+				windowOpen = inflightCount < MQTT_INFLIGHT_WINDOW;
+				waitingItems = latestDirtyCount > 0 || uxQueueMessagesWaiting(mqttPublishQueue) > 0;
+			} else if (windowOpen && !waitingItems && sincePublished >= MQTT_SPOOL_REPLAY_EVERY && inst->spool.isEnabled() && !inst->spool.isEmpty()) {
+				if (inst->replaySpooledItem()) {   // Old messages are only sent when there are no new ones
+					lastPublished = millis();
+					sincePublished = 0;
+					windowOpen = inflightCount < MQTT_INFLIGHT_WINDOW;
+				}
+			}
+			bool spooledItems = inst->spool.isEnabled() && !inst->spool.isEmpty();
 
-		while (inst.mqttClient->connected()) {   // While connected we just keep mqtt loop running
-			vTaskDelay(10 / portTICK_PERIOD_MS);
-			inst.mqttClient->loop();   // Keep MQTT loop running every 10ms.
+			unsigned long timeout = 500UL * MQTT_KEEPALIVE;   // At least twice per keepalive period, so pings are sent in time
+			unsigned long retryIn = inst->retransmitInflight(false);   // Sends the QoS messages that have waited too long for acknowledge
+			if (retryIn < timeout) timeout = retryIn;
+			if (windowOpen && spooledItems && timeout > MQTT_SPOOL_REPLAY_EVERY) {
+				timeout = sincePublished < MQTT_SPOOL_REPLAY_EVERY ? MQTT_SPOOL_REPLAY_EVERY - sincePublished : MQTT_SPOOL_REPLAY_EVERY;
+			}
+			if (windowOpen && waitingItems) timeout = sincePublished < MQTT_PUBLISH_EVERY ? MQTT_PUBLISH_EVERY - sincePublished : 0;
+			if (inst->transport.available() > 0) timeout = 0;   // Data is already buffered or decrypted. Don't wait for the socket
+			inst->waitForEvents(timeout, true);
+
+			do {
+				inst->mqttClient->loop();   // Reads one incoming packet, queues its callbacks and handles keepalive pings
+			} while (inst->mqttClient->connected() && inst->transport.available() > 0);
+			inst->handleAcks();
+			if (!EvtWiFi::isConnected()) inst->mqttClient->disconnect();   // Don't wait for the keepalive to find out the connection is dead
 		}
 		logger.send(INFO, "MQT", "We got disonnected");
-		
+		disconnectedAt = millis();
 	}
 }
 
 
 
-/* This task keep looking at the publishing queue and sends the content via MQTT. */
-void EvtMqtt::TaskPublishQueue(void *pvParameters) {
-	EvtMqtt inst = *((EvtMqtt*)pvParameters);   // We are inside static method. We need to be able to reference the instance.
+/*	Returns the time to wait before the next connection attempt. It doubles for each failed attempt up to MQTT_RECONNECT_MAX_DELAY.
+	The time is picked randomly between half and all of it, so devices that lost the connection together spread out. Parameters:
+	attempt: the number of failed attempts so far
+*/
+unsigned long EvtMqtt::reconnectDelay(uint8_t attempt) {
+	unsigned long maxDelay = MQTT_RECONNECT_MIN_DELAY;
+	for (uint8_t i = 0; i < attempt && maxDelay < MQTT_RECONNECT_MAX_DELAY; i++) maxDelay *= 2;
+	if (maxDelay > MQTT_RECONNECT_MAX_DELAY) maxDelay = MQTT_RECONNECT_MAX_DELAY;
+	return(maxDelay / 2 + esp_random() % (maxDelay / 2 + 1));
+}
 
-	while (true) {
-		if (inst.mqttClient->connected()) {
-			PublishItem publishItem; // To hold an item from the publishing queue
-			xQueueReceive(mqttPublishQueue, &publishItem, portMAX_DELAY); // A blocking read from queue. If its empty, we will just sit waiting here
-			logger.send(DEBUG, "MQT", "Publishing value \"%s\" to topic \"%s\"", publishItem.value, publishItem.topic);
-			inst.mqttClient->publish(publishItem.topic, publishItem.value);
-		}
-		vTaskDelay(MQTT_PUBLISH_EVERY / portTICK_PERIOD_MS); // To not flood the mqtt server we wait some time until next publish
+
+
+/* Returns counters about the mqtt connection */
+MqttStats EvtMqtt::getStats() {
+	stats.inflight = inflightCount;
+	stats.tls = transport.getTlsStats();
+	return(stats);
+}
+
+
+
+/*	Returns counters about the callbacks of a subscription. If there are more subscriptions to the topic, their counters
+	are added together. Parameters:
+	topic: the topic as it was given to subscribe()
+*/
+SubscriptionStats EvtMqtt::getSubscriptionStats(const char* topic) {
+	SubscriptionStats total;
+	for (Subscription &subscription : mqttSubscriptionList) {
+		if (strcmp(subscription.topic, topic) != 0) continue;
+		total.calls += subscription.stats.calls;
+		total.dropped += subscription.stats.dropped;
+		total.totalTime += subscription.stats.totalTime;
+		if (subscription.stats.longestTime > total.longestTime) total.longestTime = subscription.stats.longestTime;
 	}
+	return(total);
 }
 
 
 
-/* Runs through the list of mqtt topics to subscribe to and subscribes them to the MQTT server */
-void EvtMqtt::subscribeAll() {
-	for (int i = 0; i < mqttSubscriptionList.size(); i++) {
-		Subscription subscription = mqttSubscriptionList.get(i);
-		mqttClient->subscribe(subscription.topic);
-		logger.send(INFO, "MQT", "Subscribed to topic \"%s\"", subscription.topic);
+/*	Waits while we are not connected. New subscriptions are registered at once, and sent when we get connected. If the spool
+	is enabled, messages to publish are moved to flash, so the queue doesn't fill up. Parameters:
+	ms: the time to wait
+	untilWiFi: if true the wait ends as soon as wifi is connected
+*/
+void EvtMqtt::waitOffline(unsigned long ms, bool untilWiFi) {
+	unsigned long started = millis();
+	unsigned long waited;
+	while ((waited = millis() - started) < ms && !(untilWiFi && EvtWiFi::isConnected())) {
+		waitForEvents(ms - waited, false);
+		handleSubscribeQueue(false);
+		if (spool.isEnabled()) spoolWaitingItems();
 	}
 }
 
 
 
-/*	Private method for storing a subscription to a mqtt topic. It's stored in a linked list called mqttSubscriptionList. Parameters: 
-	topic: mqtt topic
-	cbFunction: a pointer to the callback function that should be called when a message is received in the topic
-	type: if the callback function should be sent the value as CB_INT, CB_BOOL or CB_FLOAT
+/*	Sleeps until the mqtt socket has data, another task wakes us with wakeup(), or the timeout runs out. Parameters:
+	timeout: the max time to sleep in ms
+	withMqttSocket: if true we also wake up when the mqtt socket has data. Only when we are connected
 */
-void EvtMqtt::subscribe(char* topic, void* cbFunction, SubscribeCbType type) {
-	Subscription *subscription = new Subscription();
-	strncpy(subscription->topic, topic, sizeof(subscription->topic));
-	subscription->subscribeCbFunc = (void*)cbFunction;
-	subscription->subscribeCbType = type;
-	logger.send(DEBUG, "MQT", "Register subscription to topic \"%s\"", topic);
-	mqttSubscriptionList.add(*subscription);
-	mqttClient->subscribe(topic);
+void EvtMqtt::waitForEvents(unsigned long timeout, bool withMqttSocket) {
+	int mqttSocket = withMqttSocket ? net.fd() : -1;
+	fd_set readSet;
+	FD_ZERO(&readSet);
+	if (mqttSocket >= 0) FD_SET(mqttSocket, &readSet);
+	if (wakeSocket >= 0) {
+		FD_SET(wakeSocket, &readSet);
+	} else if (timeout > 10) {
+		timeout = 10;   // Without a wakeup socket we have to look for work every 10ms
+	}
+
+	timeval tv;
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+	int maxSocket = mqttSocket > wakeSocket ? mqttSocket : wakeSocket;
+	if (select(maxSocket + 1, &readSet, NULL, NULL, &tv) > 0 && wakeSocket >= 0 && FD_ISSET(wakeSocket, &readSet)) {
+		char dummy[8];
+		wakePending = false;   // Cleared before reading, so a wakeup sent while we read is not lost
+		while (recv(wakeSocket, dummy, sizeof(dummy), MSG_DONTWAIT) > 0);   // Empty the wakeup socket
+	}
 }
 
 
 
-/* Public method to provide a callback function for a certain mqtt topic */
-void EvtMqtt::subscribe(char* topic, SubscribeCbFuncBool cbFunction) {
-	subscribe(topic, (void*)cbFunction, CB_BOOL);
+/*	Makes a pair of UDP sockets on the loopback interface. Other tasks send a byte on wakeSendSocket to wake the mqtt task
+	from its select() when they have something for it */
+void EvtMqtt::createWakeupSockets() {
+	wakeSocket = socket(AF_INET, SOCK_DGRAM, 0);
+	wakeSendSocket = socket(AF_INET, SOCK_DGRAM, 0);
+
+	memset(&wakeAddress, 0, sizeof(wakeAddress));
+	wakeAddress.sin_family = AF_INET;
+	wakeAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	wakeAddress.sin_port = 0;   // Any free port
+	socklen_t addressLength = sizeof(wakeAddress);
+	if (wakeSocket < 0 || wakeSendSocket < 0 || bind(wakeSocket, (sockaddr*)&wakeAddress, sizeof(wakeAddress)) != 0 ||
+		getsockname(wakeSocket, (sockaddr*)&wakeAddress, &addressLength) != 0) {   // Find out what port we got
+		logger.send(ERR, "MQT", "Could not create wakeup socket");
+	}
 }
 
 
 
-/* Public method to provide a callback function for a certain mqtt topic */
-void EvtMqtt::subscribe(char* topic, SubscribeCbFuncInt cbFunction) {
-	subscribe(topic, (void*)cbFunction, CB_INT);
+/* Called by EvtWiFi when wifi connects or disconnects. The mqtt task reacts at once */
+void EvtMqtt::wifiChanged(bool connected) {
+	wakeup();
 }
 
 
 
-/* Public method to provide a callback function for a certain mqtt topic */
-void EvtMqtt::subscribe(char* topic, SubscribeCbFuncFloat cbFunction) {
-	subscribe(topic, (void*)cbFunction, CB_FLOAT);
+/* Wakes up the mqtt task if it's sleeping in select(). Only one wakeup is sent until the task has seen it */
+void EvtMqtt::wakeup() {
+	if (!wakePending) {
+		wakePending = true;
+		char dummy = 0;
+		sendto(wakeSendSocket, &dummy, 1, 0, (sockaddr*)&wakeAddress, sizeof(wakeAddress));
+	}
 }
 
 
 
-/* Callback function for the pubsub mqtt class. This gets called when a message (payload) is received in a subscribed topic */
-void EvtMqtt::messageReceived(char* topic, byte* payload, unsigned int length) {
-	char strPayload[MQTT_VALUE_LENGTH];
-	if (length < MQTT_VALUE_LENGTH) {
-		strncpy(strPayload, (const char*)payload, length);   // Get a local copy of the value if it has a legal length
-		strPayload[length] = 0;   // Null terminate the string, because we receive it as a byte array and a length
-		logger.send(DEBUG, "MQT", "Received \"%s\" in topic \"%s\"", strPayload, topic);
-		for (int i = 0; i < mqttSubscriptionList.size(); i++) {   // Traverse the list of topic subscriptions
-			Subscription subscription = mqttSubscriptionList.get(i);
-			if (strcmp(subscription.topic, topic) == 0) {   // If it's in the list
-				handleCallBacks(subscription, strPayload);   // We do a callback.
-			}
+/* Takes one item that is waiting to be published and publishes it. "Latest value" topics go first. */
+void EvtMqtt::publishWaitingItem() {
+	PublishItem publishItem; // To hold an item from the publishing queue
+	if (takeLatestItem(publishItem) || xQueueReceive(mqttPublishQueue, &publishItem, 0) == pdTRUE) {
+		logger.send(DEBUG, "MQT", "Publishing %d bytes to topic \"%s\"", publishItem.length, topicName(publishItem.topic));
+		if (!sendPublish(publishItem) && spool.isEnabled()) {
+			if (spool.append(topicName(publishItem.topic), publishItem.value, publishItem.length)) stats.spooledMessages++;   // Try again after reconnecting
 		}
+		EvtBufferPool::give(publishItem.value);   // The value buffer can now be used for other messages
+	}
+}
+
+
+
+/* Moves all messages in the publish queue to the spool. "Latest value" topics are not spooled, they stay in the latest table */
+void EvtMqtt::spoolWaitingItems() {
+	PublishItem publishItem;
+	while (xQueueReceive(mqttPublishQueue, &publishItem, 0) == pdTRUE) {
+		if (spool.append(topicName(publishItem.topic), publishItem.value, publishItem.length)) stats.spooledMessages++;   // The name is kept, ids can change after a reboot
+		EvtBufferPool::give(publishItem.value);
+	}
+}
+
+
+
+/*	Publishes the oldest message in the spool. It's only removed from the spool when it's sent, so messages are sent at least once.
+	Returns true if a message was published
+*/
+bool EvtMqtt::replaySpooledItem() {
+	char topic[MQTT_TOPIC_MAX_LENGTH];
+	char* payload;
+	uint16_t length;
+	if (!spool.peek(topic, sizeof(topic), &payload, &length)) return(false);
+	PublishItem publishItem;
+	publishItem.topic = MqttTopic(lookupTopic(topic));   // Old topics are not registered again. They would fill the topic table
+	publishItem.value = payload;
+	publishItem.length = length;
+	bool published;
+	if (publishItem.topic.id == MQTT_NO_TOPIC) {   // A topic that isn't used since the restart has no QoS setting. It's sent with QoS 0
+		published = mqttClient->publish(topic, (const uint8_t*)payload, length);
 	} else {
-		logger.send(WARN, "MQT", "Received a message of \"%d\" characters but only \"%d\" is allowed", length, MQTT_VALUE_LENGTH);
+		published = sendPublish(publishItem);
+	}
+	EvtBufferPool::give(publishItem.value);
+	if (published) {
+		spool.next();
+		stats.replayedMessages++;
 	}
+	return(published);
 }
 
 
 
-/*	Does the users callback. It determines what kind of callback function should be called (bool, int, float). Parameters:
-	subscription: a struct with topic and callback pointer
-	strPayload: the value from pubsub client should be sent to the callback function */
-void EvtMqtt::handleCallBacks(Subscription subscription, char* strPayload) {
-	if (subscription.subscribeCbType == CB_INT) {
-		SubscribeCbFuncInt cbf = (SubscribeCbFuncInt)subscription.subscribeCbFunc; //
-		cbf(subscription.topic, atoi(strPayload));   // Convert the mqtt string value to int and do callback
+/*	Publishes a message with the QoS of its topic. QoS 0 messages are handed to PubSubClient. QoS 1 and 2 messages are sent
+	without waiting for the acknowledge, so up to MQTT_INFLIGHT_WINDOW of them are on their way at the same time. Parameters:
+	publishItem: the message. For QoS 1 and 2 the value buffer is moved to the inflight table and publishItem.value is set to nullptr
+	Returns true if the message was sent, or is kept in the inflight table until it's acknowledged
+*/
+bool EvtMqtt::sendPublish(PublishItem &publishItem) {
+	uint8_t qos = topicQos(publishItem.topic);
+	if (qos == 0) return(mqttClient->publish(topicName(publishItem.topic), (const uint8_t*)publishItem.value, publishItem.length));
+
+	InflightItem *inflight = nullptr;
+	for (uint8_t i = 0; i < MQTT_INFLIGHT_WINDOW && inflight == nullptr; i++) {
+		if (inflightTable[i].state == INFLIGHT_FREE) inflight = &inflightTable[i];
 	}
-	if (subscription.subscribeCbType == CB_FLOAT) {
-		SubscribeCbFuncFloat cbf = (SubscribeCbFuncFloat)subscription.subscribeCbFunc;
-		cbf(subscription.topic, atof(strPayload));   // Convert the mqtt string value to float and do callback
+	if (inflight == nullptr) return(false);   // The window is full
+
+	inflight->packetId = nextPacketId();
+	inflight->qos = qos;
+	inflight->item = publishItem;
+	inflight->state = qos == 1 ? INFLIGHT_WAIT_PUBACK : INFLIGHT_WAIT_PUBREC;
+	inflight->firstSentAt = millis();
+	inflight->sentAt = inflight->firstSentAt;
+	publishItem.value = nullptr;
+	inflightCount++;
+	if (inflightCount > stats.maxInflight) stats.maxInflight = inflightCount;
+	stats.qosPublishes++;
+	writePublishPacket(inflight, false);   // If it fails it's sent again after reconnecting
+	return(true);
+}
+
+
+
+/*	Writes a QoS 1 or 2 PUBLISH packet for a message in the inflight table. Parameters:
+	inflight: the message
+	dup: true if it's sent again
+	Returns true if the packet was written
+*/
+bool EvtMqtt::writePublishPacket(InflightItem* inflight, bool dup) {
+	PublishItem &item = inflight->item;
+	const uint16_t headerSpace = 5;
+	const char* topic = topicName(item.topic);
+	uint16_t topicLength = strlen(topic);
+	if (headerSpace + 2 + topicLength + 2 + item.length > MQTT_PACKET_SIZE) {
+		logger.send(ERR, "MQT", "Message to topic \"%s\" is too big for MQTT_PACKET_SIZE", topic);
+		return(false);
 	}
-	if (subscription.subscribeCbType == CB_BOOL) {
-		const String onNames[] = MQTT_BOOL_ON;
-		const String offNames[] = MQTT_BOOL_OFF;
-		bool value = false;
-		bool valueOk = false;
 
-		for (int i = 0; i < NUMITEMS(offNames); i++) {   // Go through the list of MQTT_BOOL_OFF names ("off", "false", "0" etc)
-			if (offNames[i].equalsIgnoreCase(strPayload)) {
-				valueOk = true;
-				value = false;   // The mqtt payload message is false
-			}
+	uint16_t length = headerSpace;
+	packetBuffer[length++] = topicLength >> 8;
+	packetBuffer[length++] = topicLength & 0xFF;
+	memcpy(packetBuffer + length, topic, topicLength);
+	length += topicLength;
+	packetBuffer[length++] = inflight->packetId >> 8;
+	packetBuffer[length++] = inflight->packetId & 0xFF;
+	memcpy(packetBuffer + length, item.value, item.length);
+	length += item.length;
+
+	uint16_t start = packetHeader(MQTT_PUBLISH | (dup ? 0x08 : 0) | (inflight->qos << 1), headerSpace, length);
+	return(transport.write(packetBuffer + start, length - start) == (size_t)(length - start));
+}
+
+
+
+/*	Writes a PUBREL packet. It's the second step of a QoS 2 publish. Parameters:
+	packetId: the packet id of the message
+	Returns true if the packet was written
+*/
+bool EvtMqtt::writePubrelPacket(uint16_t packetId) {
+	uint8_t packet[4] = { MQTT_PUBREL | 0x02, 2, (uint8_t)(packetId >> 8), (uint8_t)(packetId & 0xFF) };
+	return(transport.write(packet, sizeof(packet)) == sizeof(packet));
+}
+
+
+
+/* Handles the acknowledges PubSubClient has read since last time. Messages that are done are removed from the inflight table */
+void EvtMqtt::handleAcks() {
+	MqttAck ack;
+	while (transport.takeAck(ack)) {
+		InflightItem *inflight = nullptr;
+		for (uint8_t i = 0; i < MQTT_INFLIGHT_WINDOW && inflight == nullptr; i++) {
+			if (inflightTable[i].state != INFLIGHT_FREE && inflightTable[i].packetId == ack.packetId) inflight = &inflightTable[i];
 		}
+		if (inflight == nullptr) {
+			logger.send(DEBUG, "MQT", "Acknowledge for unknown packet id %d", ack.packetId);
+			continue;
+		}
+
+		if (ack.type == MQTT_PUBREC && inflight->state != INFLIGHT_WAIT_PUBACK) {   // QoS 2: The server has the message. We don't need it anymore
+			EvtBufferPool::give(inflight->item.value);
+			inflight->item.value = nullptr;
+			inflight->state = INFLIGHT_WAIT_PUBCOMP;
+			inflight->sentAt = millis();
+			writePubrelPacket(inflight->packetId);
+		} else if ((ack.type == MQTT_PUBACK && inflight->state == INFLIGHT_WAIT_PUBACK) ||
+			(ack.type == MQTT_PUBCOMP && inflight->state == INFLIGHT_WAIT_PUBCOMP)) {   // The handshake is done
+			unsigned long ackTime = millis() - inflight->firstSentAt;
+			stats.acks++;
+			stats.ackTimeTotal += ackTime;
+			if (ackTime > stats.longestAckTime) stats.longestAckTime = ackTime;
+			EvtBufferPool::give(inflight->item.value);
+			inflight->item.value = nullptr;
+			inflight->state = INFLIGHT_FREE;
+			inflightCount--;
+		}
+	}
+}
+
+
+
+/*	Sends the QoS messages again that have not been acknowledged in time. PUBLISH is sent with the DUP flag, or PUBREL if a QoS 2
+	message is already received by the server. Parameters:
+	all: if true all of them are sent again. Used after reconnecting
+	Returns the time in ms until the next message must be sent again
+*/
+unsigned long EvtMqtt::retransmitInflight(bool all) {
+	unsigned long nextRetry = MQTT_RETRY_TIMEOUT;
+	for (uint8_t i = 0; i < MQTT_INFLIGHT_WINDOW; i++) {
+		InflightItem *inflight = &inflightTable[i];
+		if (inflight->state == INFLIGHT_FREE) continue;
 
-		for (int i = 0; i < NUMITEMS(onNames); i++) {   // Go through the list of MQTT_BOOL_ON names ("on", "true", "1" etc)
-			if (onNames[i].equalsIgnoreCase(strPayload)) {
-				valueOk = true;
-				value = true;   // The mqtt payload message is false
+		unsigned long waited = millis() - inflight->sentAt;
+		if (all || waited >= MQTT_RETRY_TIMEOUT) {
+			logger.send(DEBUG, "MQT", "Sending packet id %d again", inflight->packetId);
+			if (inflight->state == INFLIGHT_WAIT_PUBCOMP) {
+				writePubrelPacket(inflight->packetId);
+			} else {
+				writePublishPacket(inflight, true);
 			}
+			inflight->sentAt = millis();
+			stats.retransmissions++;
+			waited = 0;
+		}
+		if (MQTT_RETRY_TIMEOUT - waited < nextRetry) nextRetry = MQTT_RETRY_TIMEOUT - waited;
+	}
+	return(nextRetry);
+}
+
+
+
+/*	Returns the QoS a topic is published with. It's 0 unless it's set with setQos(). Parameters:
+	topic: a registered topic
+*/
+uint8_t EvtMqtt::topicQos(MqttTopic topic) {
+	return(topicFlags[topic.id] & MQTT_TOPIC_QOS_MASK);
+}
+
+
+
+/*	Takes new subscriptions from other tasks. They are added to the topic tree and the subscription list here, so only the
+	mqtt task changes them. Parameters:
+	connected: if true the subscription is also sent to the mqtt server now. Otherwise it's sent when we are connected
+*/
+void EvtMqtt::handleSubscribeQueue(bool connected) {
+	int firstNew = -1;   // The lowest slot that got a new subscription. A dropped one leaves a free slot that may be used again
+	Subscription subscription;
+	while (xQueueReceive(mqttSubscribeQueue, &subscription, 0) == pdTRUE) {
+		Subscription *stored = mqttSubscriptionList.add(subscription);
+		if (stored == nullptr) {
+			logger.send(ERR, "MQT", "No room for subscription to \"%s\". Raise MQTT_MAX_SUBSCRIPTIONS", subscription.topic);
+			continue;
 		}
+		if (!topicTree.add(stored)) {   // The tree points at the stored one. It never moves
+			logger.send(ERR, "MQT", "No memory for the topic tree. Subscription to \"%s\" is dropped", subscription.topic);
+			mqttSubscriptionList.remove(stored);
+			continue;
+		}
+		int index = mqttSubscriptionList.indexOf(stored);
+		if (firstNew < 0 || index < firstNew) firstNew = index;
+	}
+	if (connected && firstNew >= 0) subscribeFrom(firstNew);   // All the new ones are sent together. Old ones after a reused slot are sent again, which the server allows
+}
+
+
+
+/* Runs through the list of mqtt topics to subscribe to and subscribes them to the MQTT server */
+void EvtMqtt::subscribeAll() {
+	subscribeFrom(0);
+}
+
+
+
+/*	Subscribes to the topics in mqttSubscriptionList. PubSubClient sends one SUBSCRIBE packet per topic, so we build the
+	packets ourselves with as many topics as MQTT_PACKET_SIZE allows. Parameters:
+	firstIndex: the first subscription in the list to subscribe to. All after it are also subscribed
+*/
+void EvtMqtt::subscribeFrom(int firstIndex) {
+	int index = firstIndex;
+	while (index < mqttSubscriptionList.slots()) {
+		const uint16_t headerSpace = 5;   // Room for fixed header and the max 4 byte remaining length
+		uint16_t length = headerSpace;
+		uint16_t packetId = nextSubscribeId();
+		packetBuffer[length++] = packetId >> 8;
+		packetBuffer[length++] = packetId & 0xFF;
+
+		int topicsInPacket = 0;
+		for (; index < mqttSubscriptionList.slots(); index++) {
+			Subscription *subscription = mqttSubscriptionList.at(index);
+			if (subscription == nullptr) continue;   // A free slot
+			uint16_t topicLength = strlen(subscription->topic);
+			if (length + 2 + topicLength + 1 > MQTT_PACKET_SIZE && topicsInPacket > 0) break;   // The packet is full
+			packetBuffer[length++] = topicLength >> 8;
+			packetBuffer[length++] = topicLength & 0xFF;
+			memcpy(packetBuffer + length, subscription->topic, topicLength);
+			length += topicLength;
+			packetBuffer[length++] = 0;   // QoS 0
+			topicsInPacket++;
+			logger.send(INFO, "MQT", "Subscribed to topic \"%s\"", subscription->topic);
+		}
+
+		uint16_t start = packetHeader(0x82, headerSpace, length);   // SUBSCRIBE packet
+		transport.write(packetBuffer + start, length - start);
+		stats.subscribePackets++;
+		logger.send(DEBUG, "MQT", "Sent %d topics in one SUBSCRIBE packet of %d bytes", topicsInPacket, length - start);
+	}
+}
+
+
+
+/*	Writes the fixed header of a packet in packetBuffer. The remaining length is written just before the variable header, so
+	the packet starts where the header ends. Parameters:
+	type: the first byte of the packet. Packet type and flags
+	headerSpace: where the variable header starts in packetBuffer. There must be room for 5 bytes before it
+	length: where the packet ends in packetBuffer
+	Returns where the packet starts in packetBuffer
+*/
+uint16_t EvtMqtt::packetHeader(uint8_t type, uint16_t headerSpace, uint16_t length) {
+	uint16_t remainingLength = length - headerSpace;
+	uint8_t lengthBytes[4];
+	uint8_t lengthByteCount = 0;
+	do {
+		lengthBytes[lengthByteCount] = remainingLength & 0x7F;
+		remainingLength >>= 7;
+		if (remainingLength > 0) lengthBytes[lengthByteCount] |= 0x80;
+		lengthByteCount++;
+	} while (remainingLength > 0);
+	uint16_t start = headerSpace - 1 - lengthByteCount;
+	packetBuffer[start] = type;
+	memcpy(packetBuffer + start + 1, lengthBytes, lengthByteCount);
+	return(start);
+}
+
+
+
+/*	Returns a packet id for a QoS message. It's never 0, never the id of a QoS message that waits for acknowledge, and always
+	below MQTT_SUBSCRIBE_FIRST_ID, so it's never the id of a SUBSCRIBE
+*/
+uint16_t EvtMqtt::nextPacketId() {
+	bool inUse;
+	do {
+		if (++lastPacketId >= MQTT_SUBSCRIBE_FIRST_ID) lastPacketId = 1;   // Packet id 0 is not allowed
+		inUse = false;
+		for (uint8_t i = 0; i < MQTT_INFLIGHT_WINDOW && !inUse; i++) {
+			inUse = inflightTable[i].state != INFLIGHT_FREE && inflightTable[i].packetId == lastPacketId;
+		}
+	} while (inUse);
+	return(lastPacketId);
+}
+
+
+
+/* Returns a packet id for a SUBSCRIBE packet. They are from MQTT_SUBSCRIBE_FIRST_ID and up, where no QoS message has its id */
+uint16_t EvtMqtt::nextSubscribeId() {
+	if (++lastSubscribeId < MQTT_SUBSCRIBE_FIRST_ID) lastSubscribeId = MQTT_SUBSCRIBE_FIRST_ID;   // Also when it wraps to 0
+	return(lastSubscribeId);
+}
 
-		if (valueOk) {
-			SubscribeCbFuncBool cbf = (SubscribeCbFuncBool)subscription.subscribeCbFunc;
-			cbf(subscription.topic, value);   // If we got a good value we do the callback
+
+
+/*	Private method for storing a subscription to a mqtt topic. It's copied to the mqtt task that stores it in a slot map
+	called mqttSubscriptionList for resubscribing and in the topicTree for finding it when messages arrive. Parameters: 
+	topic: mqtt topic. It may contain the wildcards "+" (one level) and "#" (all remaining levels)
+	callback: the callback that should be called when a message is received in the topic
+	dispatchFunc: the function that decodes the payload and calls the callback
+	zeroCopy: true if the callback is called in the mqtt task without copying the message
+*/
+void EvtMqtt::subscribe(char* topic, const EvtCallbackData& callback, SubscribeDispatchFunc dispatchFunc, bool zeroCopy) {
+	Subscription subscription;
+	strncpy(subscription.topic, topic, sizeof(subscription.topic));
+	subscription.topic[sizeof(subscription.topic) - 1] = 0;
+	subscription.callback = callback;
+	subscription.dispatchFunc = dispatchFunc;
+	subscription.zeroCopy = zeroCopy;
+	logger.send(DEBUG, "MQT", "Register subscription to topic \"%s\"", topic);
+	xQueueSend(mqttSubscribeQueue, &subscription, portMAX_DELAY);
+	wakeup();
+}
+
+
+
+/*	Public method to provide a callback function that gets the payload as it is received, without decoding. The payload is
+	only valid during the callback. Parameters:
+	topic: mqtt topic. It may contain the wildcards "+" and "#"
+	cbFunction: the callback
+	zeroCopy: false to run the callback in the dispatch task like the others. The topic and payload are copied to a buffer
+		from the EvtBufferPool, so they must fit in the largest buffer, and there are only BUFFER_POOL_LARGE_COUNT of those.
+		true to call it in the mqtt task with the payload where PubSubClient received it. Nothing is copied or dropped, and
+		the size is only limited by MQTT_PACKET_SIZE. The callback must be quick, because the connection waits for it
+*/
+void EvtMqtt::subscribe(char* topic, SubscribeCbFuncRaw cbFunction, bool zeroCopy) {
+	subscribe(topic, cbFunction.erase(), dispatchRaw, zeroCopy);
+}
+
+
+
+/* Callback function for the pubsub mqtt class. This gets called when a message (payload) is received in a subscribed topic */
+void EvtMqtt::messageReceived(char* topic, byte* payload, unsigned int length) {
+	logger.send(DEBUG, "MQT", "Received %d bytes in topic \"%s\"", length, topic);
+	topicTree.match(topic, [&](Subscription* subscription) {   // Find all subscriptions matching the topic and queue their callbacks
+		if (subscription->zeroCopy) {
+			callZeroCopy(subscription, topic, payload, length);
 		} else {
-			logger.send(WARN, "MQT", "Expected a bolean value in topic \"%s\", but got \"%s\"", subscription.topic, strPayload);
+			queueDispatch(subscription, topic, payload, length);
+		}
+	});
+}
+
+
+
+/*	Calls a zero copy subscription right away in the mqtt task. The payload is still in the PubSubClient buffer. It's timed
+	like the callbacks of the dispatch task. Parameters:
+	subscription: the subscription that matched the topic
+	topic, payload, length: the received message
+*/
+void EvtMqtt::callZeroCopy(Subscription* subscription, char* topic, byte* payload, unsigned int length) {
+	unsigned long startedAt = micros();
+	subscription->dispatchFunc(subscription, topic, payload, length);
+	unsigned long callbackTime = micros() - startedAt;
+
+	SubscriptionStats &subscriptionStats = subscription->stats;
+	subscriptionStats.calls++;
+	subscriptionStats.totalTime += callbackTime;
+	if (callbackTime > subscriptionStats.longestTime) subscriptionStats.longestTime = callbackTime;
+}
+
+
+
+/*	Copies a received message to a buffer from the EvtBufferPool and queues it for the callback task. The payload from
+	PubSubClient is overwritten by the next packet, so it must be copied. If the callbacks can't keep up, dispatchOverflow
+	decides which message is thrown away. Parameters:
+	subscription: the subscription that matched the topic
+	topic, payload, length: the received message
+*/
+void EvtMqtt::queueDispatch(Subscription* subscription, char* topic, byte* payload, unsigned int length) {
+	uint16_t topicLength = strlen(topic);
+	size_t size = topicLength + 1 + length + 1;   // Both the topic and the payload are zero terminated
+	if (size > BUFFER_POOL_LARGE_SIZE) {   // No buffer can ever hold it. Don't drop waiting messages or wait for it
+		subscription->stats.dropped++;
+		stats.dispatchTooLarge++;
+		logger.send(ERR, "MQT", "Message of %u bytes in topic \"%s\" is larger than the largest pool buffer. It's dropped", length, topic);
+		return;
+	}
+
+	if (dispatchOverflow == DISPATCH_DROP_OLDEST && uxQueueSpacesAvailable(dispatchQueue) == 0) dropOldestDispatch();
+	char* buffer = EvtBufferPool::take(size);
+	if (buffer == nullptr && dispatchOverflow == DISPATCH_DROP_OLDEST) {
+		while (buffer == nullptr && dropOldestDispatch()) buffer = EvtBufferPool::take(size);   // The buffers of waiting messages are used
+	} else if (buffer == nullptr && dispatchOverflow == DISPATCH_WAIT) {
+		unsigned long waitStart = millis();
+		while (buffer == nullptr && millis() - waitStart < MQTT_DISPATCH_WAIT) {
+			vTaskDelay(1);
+			buffer = EvtBufferPool::take(size);
 		}
 	}
+
+	DispatchItem item;
+	item.subscription = subscription;
+	item.buffer = buffer;
+	item.topicLength = topicLength;
+	item.length = length;
+	if (buffer != nullptr) {
+		memcpy(buffer, topic, topicLength + 1);
+		memcpy(buffer + topicLength + 1, payload, length);
+		buffer[topicLength + 1 + length] = 0;
+	}
+	TickType_t wait = dispatchOverflow == DISPATCH_WAIT ? pdMS_TO_TICKS(MQTT_DISPATCH_WAIT) : 0;
+	if (buffer == nullptr || xQueueSend(dispatchQueue, &item, wait) != pdTRUE) {
+		EvtBufferPool::give(buffer);
+		subscription->stats.dropped++;
+		stats.dispatchDropped++;
+		logger.send(WARN, "MQT", "Callbacks can't keep up. Message of %u bytes in topic \"%s\" is dropped", length, topic);
+		return;
+	}
+	stats.dispatched++;
+	uint8_t waiting = uxQueueMessagesWaiting(dispatchQueue);
+	if (waiting > stats.maxDispatchQueue) stats.maxDispatchQueue = waiting;
 }
 
 
 
-/*	Adds a mqtt topic/value to the mqttPublishQueue. Parameters:
-	topic: mqtt topic
-	value: a bool value
-	onName: a string representation of the value if it's true
-	offName: a string represenstation of the value if it's false 
+/* Throws away the oldest message waiting for its callback. Returns false if there was none */
+bool EvtMqtt::dropOldestDispatch() {
+	DispatchItem item;
+	if (xQueueReceive(dispatchQueue, &item, 0) != pdTRUE) return(false);
+	logger.send(WARN, "MQT", "Callbacks can't keep up. Oldest message in topic \"%s\" is dropped", item.buffer);
+	EvtBufferPool::give(item.buffer);
+	item.subscription->stats.dropped++;
+	stats.dispatchDropped++;
+	return(true);
+}
+
+
+
+/* Does the users callback for a raw subscription. The payload is given as it is */
+void EvtMqtt::dispatchRaw(Subscription* subscription, char* topic, byte* payload, unsigned int length) {
+	SubscribeCbFuncRaw::invoke(subscription->callback, topic, payload, length);
+}
+
+
+
+/*	Registers a topic to publish to, and returns a handle for it. Publishing with the handle only passes 2 bytes around
+	instead of the topic name. Registering the same topic again gives the same handle. Parameters:
+	format: the topic. It can have printf style fields, like "home/%s/temperature/%d"
+	...: the values of the fields, like a device id and a sensor number
+	Returns the handle. Its id is MQTT_NO_TOPIC if there is no more room for topics
+*/
+MqttTopic EvtMqtt::registerTopic(const char* format, ...) {
+	char topic[MQTT_TOPIC_MAX_LENGTH];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(topic, sizeof(topic), format, args);
+	va_end(args);
+	return(MqttTopic(internTopic(topic)));
+}
+
+
+
+/*	Returns the name of a registered topic. Parameters:
+	topic: the handle from registerTopic()
+*/
+const char* EvtMqtt::topicName(MqttTopic topic) {
+	if (topic.id >= topicCount) return("");
+	return(topicStore + topicOffsets[topic.id]);
+}
+
+
+
+/*	Finds a topic in the topic store, or adds it if it's not there. Names are never removed, so a handle stays valid and
+	the name can be read without locking. The known topics are searched without the lock too. Only adding a topic takes
+	it, and then only the topics that other tasks have added meanwhile are searched again. Parameters:
+	topic: the topic name
+	Returns the topic id, or MQTT_NO_TOPIC if there is no room
 */
-void EvtMqtt::publish(char* topic, bool value, const char* onName, const char* offName) {
+uint16_t EvtMqtt::internTopic(const char* topic) {
+	uint16_t length;
+	uint32_t hash = hashTopic(topic, length);
+	uint16_t known = topicCount;
+	uint16_t id = findTopic(topic, hash, 0, known);
+	if (id != MQTT_NO_TOPIC) return(id);   // The usual case, when a topic string is published again
+
+	portENTER_CRITICAL(&topicMux);
+	id = findTopic(topic, hash, known, topicCount);
+	if (id == MQTT_NO_TOPIC && topicCount < MQTT_MAX_TOPICS && topicStoreUsed + length + 1 <= MQTT_TOPIC_STORE_SIZE) {
+		memcpy(topicStore + topicStoreUsed, topic, length + 1);
+		topicOffsets[topicCount] = topicStoreUsed;
+		topicHashes[topicCount] = hash;
+		topicFlags[topicCount] = 0;
+		topicStoreUsed += length + 1;
+		__sync_synchronize();   // The topic is complete in memory before it's counted, so tasks that search without the lock see all of it
+		id = topicCount++;
+	}
+	portEXIT_CRITICAL(&topicMux);
+
+	if (id == MQTT_NO_TOPIC) logger.send(ERR, "MQT", "No room for topic \"%s\". Increase MQTT_MAX_TOPICS or MQTT_TOPIC_STORE_SIZE", topic);
+	return(id);
+}
+
+
+
+/*	Returns the id of a registered topic, or MQTT_NO_TOPIC if it isn't registered. It never adds the topic. Parameters:
+	topic: the topic name
+*/
+uint16_t EvtMqtt::lookupTopic(const char* topic) {
+	uint16_t length;
+	uint32_t hash = hashTopic(topic, length);
+	return(findTopic(topic, hash, 0, topicCount));
+}
+
+
+
+/*	Searches some of the registered topics. It needs no lock, because a topic is complete before topicCount counts it. Parameters:
+	topic: the topic name
+	hash: its hash from hashTopic()
+	first, end: the ids to search. end is not included
+	Returns the topic id, or MQTT_NO_TOPIC if it's not among them
+*/
+uint16_t EvtMqtt::findTopic(const char* topic, uint32_t hash, uint16_t first, uint16_t end) {
+	for (uint16_t i = first; i < end; i++) {
+		if (topicHashes[i] == hash && strcmp(topicStore + topicOffsets[i], topic) == 0) return(i);
+	}
+	return(MQTT_NO_TOPIC);
+}
+
+
+
+/*	Returns the FNV-1a hash of a topic name. Most topics are told apart by the hash, so few strings are compared. Parameters:
+	topic: the topic name
+	length: set to the length of the name
+*/
+uint32_t EvtMqtt::hashTopic(const char* topic, uint16_t &length) {
+	uint32_t hash = 2166136261UL;
+	length = 0;
+	for (const char* c = topic; *c != 0; c++, length++) hash = (hash ^ (uint8_t)*c) * 16777619UL;
+	return(hash);
+}
+
+
+
+/*	Turns a topic name into a handle. The topic is registered the first time. Parameters:
+	topic: the topic name
+*/
+MqttTopic::MqttTopic(const char* topic) : id(EvtMqtt::internTopic(topic)) {
+}
+
+
+
+/*	Puts a topic in "latest value" mode. Publishing to it will not queue up every value. If a value is still waiting to be
+	published, it is overwritten by the newer one. Good for state topics where only the freshest value matters. Parameters:
+	topic: a registered topic or a topic string
+	Returns true if the topic is in latest value mode
+*/
+bool EvtMqtt::latestValueOnly(MqttTopic topic) {
+	if (topic.id == MQTT_NO_TOPIC) return(false);
+	portENTER_CRITICAL(&topicMux);
+	topicFlags[topic.id] |= MQTT_TOPIC_LATEST;
+	portEXIT_CRITICAL(&topicMux);
+	logger.send(DEBUG, "MQT", "Topic \"%s\" will only publish its latest value", topicName(topic));
+	return(true);
+}
+
+
+
+/*	Turns on the flash spool. Messages published while we are offline are kept on LittleFS and sent in order after
+	reconnecting, instead of being lost when the queue is full. Must be called before begin(). Parameters:
+	segmentCount: max number of segment files. When they are all full the oldest messages are thrown away
+	segmentSize: size of a segment file in bytes
+	Returns true if the spool is ready
+*/
+bool EvtMqtt::enableSpool(uint8_t segmentCount, uint32_t segmentSize) {
+	return(spool.begin(segmentCount, segmentSize));
+}
+
+
+
+/*	Sets the QoS a topic is published with. QoS 1 and 2 messages are sent again until the mqtt server acknowledges them. While
+	some are unacknowledged, we reconnect without a clean session, so the server remembers the QoS 2 messages it has already
+	received. If the server has lost the session anyway, or we restart, QoS 2 messages may arrive twice. Parameters:
+	topic: a registered topic or a topic string
+	qos: 0, 1 or 2
+	Returns true if the QoS is set
+*/
+bool EvtMqtt::setQos(MqttTopic topic, uint8_t qos) {
+	if (qos > 2 || topic.id == MQTT_NO_TOPIC) return(false);
+	portENTER_CRITICAL(&topicMux);
+	topicFlags[topic.id] = (topicFlags[topic.id] & ~MQTT_TOPIC_QOS_MASK) | qos;
+	portEXIT_CRITICAL(&topicMux);
+	logger.send(DEBUG, "MQT", "Topic \"%s\" is published with QoS %d", topicName(topic), qos);
+	return(true);
+}
+
+
+
+/*	Connects to the mqtt server with TLS. The TLS session is kept, also in deep sleep, so reconnecting can skip the expensive
+	key exchange. Must be called before begin(). The certificates are in PEM format and must stay in memory. Parameters:
+	caCert: the CA certificate that has signed the certificate of the mqtt server. nullptr turns TLS off
+	clientCert: certificate of this device if the mqtt server wants one
+	clientKey: the private key of clientCert
+*/
+void EvtMqtt::setTls(const char* caCert, const char* clientCert, const char* clientKey) {
+	transport.setTls(caCert, clientCert, clientKey);
+}
+
+
+
+/*	Gets the oldest "latest value" topic that is waiting to be published. Parameters:
+	publishItem: filled with the topic and its newest value
+	Returns true if an item was waiting. Otherwise false
+*/
+bool EvtMqtt::takeLatestItem(PublishItem &publishItem) {
+	bool gotItem = false;
+	portENTER_CRITICAL(&latestMux);
+	if (latestDirtyCount > 0) {
+		uint16_t id = latestDirtyList[latestDirtyHead];
+		LatestItem *latest = &latestTable[id];
+		latestDirtyHead = (latestDirtyHead + 1) % MQTT_MAX_TOPICS;
+		latestDirtyCount--;
+		publishItem.topic = MqttTopic(id);
+		publishItem.value = latest->value;
+		publishItem.length = latest->length;
+		latest->value = nullptr;   // The publishing task owns the buffer now
+		latest->dirty = false;
+		gotItem = true;
+	}
+	portEXIT_CRITICAL(&latestMux);
+	return(gotItem);
+}
+
+
+
+/*	Sends an item to the publishing task. Topics in "latest value" mode overwrite their waiting value in place.
+	All other topics are added to the mqttPublishQueue. Parameters:
+	publishItem: topic and value to publish
+*/
+void EvtMqtt::queuePublishItem(PublishItem &publishItem) {
+	if (topicFlags[publishItem.topic.id] & MQTT_TOPIC_LATEST) {
+		bool newlyDirty = false;
+		char *oldValue = nullptr;
+		portENTER_CRITICAL(&latestMux);
+		LatestItem *latest = &latestTable[publishItem.topic.id];
+		if (latest->dirty) oldValue = latest->value;   // The waiting value is replaced by the newer one
+		latest->value = publishItem.value;
+		latest->length = publishItem.length;
+		if (!latest->dirty) {   // Only new values get a place in the dirty list. Overwritten ones keep their place
+			latestDirtyList[(latestDirtyHead + latestDirtyCount) % MQTT_MAX_TOPICS] = publishItem.topic.id;
+			latestDirtyCount++;
+			latest->dirty = true;
+			newlyDirty = true;
+		}
+		portEXIT_CRITICAL(&latestMux);
+
+		EvtBufferPool::give(oldValue);
+		if (newlyDirty) wakeup();
+		return;
+	}
+	if (xQueueSend(mqttPublishQueue, &publishItem, 0) == pdTRUE) {   // Send the item to the queue. If queue is full, just discard it.
+		wakeup();
+	} else {
+		EvtBufferPool::give(publishItem.value);
+	}
+}
+
+
+
+/*	Copies a value into a buffer from the EvtBufferPool and sends it to the publishing task. Parameters:
+	topic: a registered topic
+	value: the bytes to publish
+	length: the number of bytes
+*/
+void EvtMqtt::queuePublish(MqttTopic topic, const char* value, unsigned int length) {
+	if (topic.id == MQTT_NO_TOPIC) return;   // It was not registered. That's already logged
 	PublishItem publishItem;
-	sprintf(publishItem.value, "%s", value ? onName : offName);
-	strncpy(publishItem.topic, topic, sizeof(publishItem.topic));
-	xQueueSend(mqttPublishQueue, &publishItem, 0); // Send the log message to the queue. If queue is full, just discard it.
+	publishItem.value = EvtBufferPool::take(length);
+	if (publishItem.value == nullptr) {
+		logger.send(WARN, "MQT", "No free buffer for %d bytes to topic \"%s\". Discarding it", length, topicName(topic));
+		return;
+	}
+	memcpy(publishItem.value, value, length);
+	publishItem.length = length;
+	publishItem.topic = topic;
+	queuePublishItem(publishItem);
 }
 
 
 
 /*	Adds a mqtt topic/value to the mqttPublishQueue. Parameters:
-	topic: mqtt topic
-	value: an integer value
+	topic: a registered topic or a topic string
+	value: a bool value
+	onName: a string representation of the value if it's true
+	offName: a string represenstation of the value if it's false 
 */
-void EvtMqtt::publish(char* topic, int value) {
-	PublishItem publishItem;
-	itoa(value, publishItem.value , 10);
-	strncpy(publishItem.topic, topic, sizeof(publishItem.topic));
-	xQueueSend(mqttPublishQueue, &publishItem, 0); // Send the log message to the queue. If queue is full, just discard it.
+void EvtMqtt::publish(MqttTopic topic, bool value, const char* onName, const char* offName) {
+	publish(topic, value ? onName : offName);
 }
 
 
 
 /*	Adds a mqtt topic/value to the mqttPublishQueue. Parameters:
-	topic: mqtt topic
+	topic: a registered topic or a topic string
 	value: a float value
 	decimals: the number of digits after the decimal point
 */
-void EvtMqtt::publish(char* topic, float value, uint8_t decimals) {
-	PublishItem publishItem;
-	dtostrf(value, 4, decimals, publishItem.value);
-	strncpy(publishItem.topic, topic, sizeof(publishItem.topic));
-	xQueueSend(mqttPublishQueue, &publishItem, 0); // Send the log message to the queue. If queue is full, just discard it.
+void EvtMqtt::publish(MqttTopic topic, float value, uint8_t decimals) {
+	char strValue[MQTT_CODEC_BUFFER_SIZE];
+	dtostrf(value, 4, decimals, strValue);
+	queuePublish(topic, strValue, strlen(strValue));
+}
+
+
+
+/*	Adds a mqtt topic/string to the mqttPublishQueue. Parameters:
+	topic: a registered topic or a topic string
+	value: a zero terminated string, like a JSON document
+*/
+void EvtMqtt::publish(MqttTopic topic, const char* value) {
+	queuePublish(topic, value, strlen(value));
+}
+
+
+
+/*	Adds a mqtt topic/payload to the mqttPublishQueue. The payload only takes up memory in the size it needs while it waits. Parameters:
+	topic: a registered topic or a topic string
+	payload: the bytes to publish
+	length: number of bytes. No more than BUFFER_POOL_LARGE_SIZE
+*/
+void EvtMqtt::publish(MqttTopic topic, const byte* payload, unsigned int length) {
+	queuePublish(topic, (const char*)payload, length);
 }
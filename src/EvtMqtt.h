@@ -2,47 +2,167 @@
 #define _EVTMQTT_h
 
 #include <WiFi.h>
+#include <lwip/sockets.h>
 #include "PubSubClient.h"
-#include <LinkedList.h>
+#include "EvtBufferPool.h"
+#include "EvtMqttCodec.h"
+#include "EvtMqttSpool.h"
+#include "EvtMqttTopicTree.h"
+#include "EvtMqttTransport.h"
+#include "EvtWiFi.h"
+#include "EvtLogger.h"
+#include "EvtAlloc.h"
+#include "EvtCallback.h"
+#include "EvtSlotMap.h"
 
-#define MQTT_STACK_SIZE_KEEPCONNECTED 5000
-#define MQTT_STACK_SIZE_PUBLISH 5000
-#define MQTT_CHECK_FOR_CONNECTION_EVERY 5   // Seconds
+#define MQTT_STACK_SIZE 6000
+#define MQTT_RECONNECT_MIN_DELAY 1000   // ms before the first reconnect attempt. It's doubled for each failed attempt
+#define MQTT_RECONNECT_MAX_DELAY 60000   // ms. The longest time between reconnect attempts
 #define MQTT_QUEUE_LENGTH 10
-#define MQTT_VALUE_LENGTH 10
-#define MQTT_TOPIC_LENGTH 50
+#define MQTT_SUBSCRIBE_QUEUE_LENGTH 10   // New subscriptions waiting for the mqtt task
+#define MQTT_KEEPALIVE 15   // Seconds
+#define MQTT_PACKET_SIZE 1200   // Max size of a mqtt packet. Limits the size of raw payloads
+#define MQTT_TOPIC_LENGTH 50   // Max length of a subscribed topic
+#define MQTT_MAX_SUBSCRIPTIONS 32
+#define MQTT_MAX_TOPICS 64   // Max number of different topics that can be published
+#define MQTT_TOPIC_STORE_SIZE 2048   // Bytes for the names of all published topics
+#define MQTT_TOPIC_MAX_LENGTH 128   // Max length of a published topic
 #define MQTT_PUBLISH_EVERY 100   //ms
-#define MQTT_BOOL_ON {"on", "true", "1", "high"}
-#define MQTT_BOOL_OFF {"off", "false", "0", "low"}
-#define NUMITEMS(arg) ((unsigned int) (sizeof (arg) / sizeof (arg [0]))) // Used to find the number of values in the on/off list
+#define MQTT_SPOOL_REPLAY_EVERY 20   // ms between messages replayed from the spool. Live messages go first
+#define MQTT_INFLIGHT_WINDOW 8   // Max number of QoS 1 and 2 messages sent but not yet acknowledged by the mqtt server
+#define MQTT_RETRY_TIMEOUT 10000   // ms before an unacknowledged QoS message is sent again
+#define MQTT_SUBSCRIBE_FIRST_ID 0xF000   // SUBSCRIBE packets get ids from here. QoS messages get those below, so they never share one
+#define MQTT_DISPATCH_STACK_SIZE 4000   // Stack of the task that runs the subscription callbacks
+#define MQTT_DISPATCH_QUEUE_LENGTH 16   // Received messages waiting for their callback
+#define MQTT_DISPATCH_WAIT 50   // ms the mqtt task waits for room in the dispatch queue with DISPATCH_WAIT
 
+// A received packet holds the topic, the payload and at least 4 bytes of header. The topic and payload are copied to one pool
+// buffer with a zero after each, so the largest buffer must be as large as a packet
+static_assert(BUFFER_POOL_LARGE_SIZE >= MQTT_PACKET_SIZE, "A received message may not fit in a pool buffer. Raise BUFFER_POOL_LARGE_SIZE");
 
-// Define the callback functions.
-typedef void(*SubscribeCbFuncBool) (char* topic, bool value);
-typedef void(*SubscribeCbFuncInt) (char* topic, int value); 
-typedef void(*SubscribeCbFuncFloat) (char* topic, float value);
 
+// Define the callback functions. Callbacks can have any value type that has a MqttCodec (see EvtMqttCodec.h)
+typedef EvtCallback<void(char* topic, bool value)> SubscribeCbFuncBool;
+typedef EvtCallback<void(char* topic, int value)> SubscribeCbFuncInt;
+typedef EvtCallback<void(char* topic, float value)> SubscribeCbFuncFloat;
+typedef EvtCallback<void(char* topic, byte* payload, unsigned int length)> SubscribeCbFuncRaw;   // payload is only valid during the callback
 
-// The type of callback function in the subscriptionlist
-enum SubscribeCbType {
-	CB_BOOL,
-	CB_INT, 
-	CB_FLOAT
+
+struct Subscription;
+
+
+// What happens to a received message when the dispatch queue is full or there is no buffer to copy it to
+enum DispatchOverflow {
+	DISPATCH_DROP_NEWEST,   // The received message is thrown away
+	DISPATCH_DROP_OLDEST,   // The oldest message waiting for its callback is thrown away to make room
+	DISPATCH_WAIT   // The mqtt task waits up to MQTT_DISPATCH_WAIT ms for room. Then the message is thrown away
+};
+
+
+// Counters about the callbacks of a subscription. Times are in microseconds
+struct SubscriptionStats {
+	unsigned long calls = 0;
+	unsigned long dropped = 0;   // Messages thrown away because the callbacks could not keep up
+	unsigned long totalTime = 0;   // Time spent in the callback for all calls. Divide by calls for the average
+	unsigned long longestTime = 0;
 };
 
+// Decodes the payload and calls the users callback. There is one for each value type, made by the compiler
+typedef void(*SubscribeDispatchFunc) (Subscription* subscription, char* topic, byte* payload, unsigned int length);
+
 
 // A single entry of the mqtt subscription list. We need this list in case mqtt gets disconnected. Then we need to resubscribe to topic again
 struct Subscription {
 	char topic[MQTT_TOPIC_LENGTH];
-	void* subscribeCbFunc;
-	SubscribeCbType subscribeCbType;
+	EvtCallbackData callback;   // The users callback. Its signature depends on the value type, and only dispatchFunc knows it
+	SubscribeDispatchFunc dispatchFunc;
+	bool zeroCopy = false;   // Called in the mqtt task with the payload in the PubSubClient buffer, instead of being queued
+	Subscription* nextInNode = nullptr;   // Next subscription that ends in the same topic tree node
+	SubscriptionStats stats;
+};
+
+
+// A received message waiting in the dispatch queue. The buffer is from EvtBufferPool and holds the topic and then the payload
+struct DispatchItem {
+	Subscription* subscription;
+	char* buffer;
+	uint16_t topicLength;
+	uint16_t length;
 };
 
 
-// An entry to send the the mqtt publish queue.
+#define MQTT_NO_TOPIC 0xFFFF   // Topic id of a topic that could not be registered
+
+// Settings of a published topic
+#define MQTT_TOPIC_QOS_MASK 0x03
+#define MQTT_TOPIC_LATEST 0x04
+
+
+/*	A handle for a published topic. The name is stored once in EvtMqtt, and the handle is all that is passed around when
+	publishing. Get one from EvtMqtt::registerTopic(). A topic string is also turned into a handle, but then the topic is
+	looked up every time it's published
+*/
+struct MqttTopic {
+	uint16_t id;
+	MqttTopic() : id(MQTT_NO_TOPIC) {}
+	explicit MqttTopic(uint16_t topicId) : id(topicId) {}
+	MqttTopic(const char* topic);
+};
+
+
+// An entry to send the the mqtt publish queue. The value is a buffer from EvtBufferPool that the receiver gives back.
 struct PublishItem {
-	char topic[MQTT_TOPIC_LENGTH];
-	char value[MQTT_VALUE_LENGTH];
+	MqttTopic topic;
+	uint16_t length;
+	char* value;
+};
+
+
+// The value of a topic in "latest value" mode. Only the newest value waiting to be published is kept.
+struct LatestItem {
+	bool dirty = false;   // True if the value is waiting to be published
+	uint16_t length;
+	char* value;
+};
+
+
+// Where a QoS message is in its handshake with the mqtt server
+enum InflightState { INFLIGHT_FREE, INFLIGHT_WAIT_PUBACK, INFLIGHT_WAIT_PUBREC, INFLIGHT_WAIT_PUBCOMP };
+
+
+// A QoS 1 or 2 message that has been sent but not acknowledged. The value buffer is kept until we know it has arrived
+struct InflightItem {
+	InflightState state = INFLIGHT_FREE;
+	uint16_t packetId;
+	uint8_t qos;
+	unsigned long firstSentAt;
+	unsigned long sentAt;
+	PublishItem item;
+};
+
+
+
+// Counters about the mqtt connection
+struct MqttStats {
+	unsigned long connectAttempts = 0;
+	unsigned long connects = 0;
+	unsigned long lastReconnectTime = 0;   // ms from losing the connection (or boot) until connected again
+	unsigned long longestReconnectTime = 0;
+	unsigned long subscribePackets = 0;
+	unsigned long spooledMessages = 0;   // Messages written to the flash spool while offline
+	unsigned long replayedMessages = 0;   // Messages from the spool that were published after reconnecting
+	unsigned long qosPublishes = 0;   // QoS 1 and 2 messages sent. Retransmissions not included
+	unsigned long retransmissions = 0;
+	unsigned long acks = 0;   // QoS messages that completed their handshake
+	unsigned long ackTimeTotal = 0;   // ms from first sent to acknowledged, for all acks. Divide by acks for the average
+	unsigned long longestAckTime = 0;
+	uint8_t inflight = 0;   // QoS messages waiting for the mqtt server right now
+	uint8_t maxInflight = 0;
+	unsigned long dispatched = 0;   // Received messages handed to the callback task
+	unsigned long dispatchDropped = 0;   // Received messages thrown away because the dispatch queue was full
+	unsigned long dispatchTooLarge = 0;   // Received messages thrown away because they can't fit in any pool buffer
+	uint8_t maxDispatchQueue = 0;   // The most messages that have waited for their callbacks at once
+	TlsStats tls;
 };
 
 
@@ -51,29 +171,169 @@ class EvtMqtt
 {
  private:
 	 WiFiClient net;
+	 EvtMqttTransport transport;   // PubSubClient talks through this, so we see the acknowledges of QoS messages
 	 PubSubClient *mqttClient;
-	 static LinkedList<Subscription> mqttSubscriptionList;
+	 EvtMqttSpool spool;
+	 static EvtSlotMap<Subscription, MQTT_MAX_SUBSCRIPTIONS> mqttSubscriptionList;
+	 static MqttTopicTree<Subscription> topicTree;
 	 static QueueHandle_t mqttPublishQueue;
-	 static void TaskKeepConnected(void *pvParameters);
-	 static void TaskPublishQueue(void *pvParameters);
+	 static portMUX_TYPE topicMux;
+	 static char topicStore[MQTT_TOPIC_STORE_SIZE];
+	 static uint16_t topicStoreUsed;
+	 static uint16_t topicOffsets[MQTT_MAX_TOPICS];
+	 static uint32_t topicHashes[MQTT_MAX_TOPICS];
+	 static uint8_t topicFlags[MQTT_MAX_TOPICS];
+	 static volatile uint16_t topicCount;   // Raised after a topic is complete, so the topics can be searched without the lock
+	 static portMUX_TYPE latestMux;
+	 static LatestItem latestTable[MQTT_MAX_TOPICS];
+	 static uint16_t latestDirtyList[MQTT_MAX_TOPICS];
+	 static uint16_t latestDirtyHead;
+	 static uint16_t latestDirtyCount;
+	 static QueueHandle_t mqttSubscribeQueue;
+	 static QueueHandle_t dispatchQueue;
+	 static DispatchOverflow dispatchOverflow;
+	 static uint8_t dispatchPriority;
+	 static int wakeSocket;
+	 static int wakeSendSocket;
+	 static sockaddr_in wakeAddress;
+	 static volatile bool wakePending;
+	 static void TaskMqtt(void *pvParameters);
+	 static void TaskDispatch(void *pvParameters);
+	 static void createWakeupSockets();
+	 static void wakeup();
+	 static void wifiChanged(bool connected);
+	 void waitOffline(unsigned long ms, bool untilWiFi = false);
+	 void waitForEvents(unsigned long timeout, bool withMqttSocket);
+	 void publishWaitingItem();
+	 void spoolWaitingItems();
+	 bool replaySpooledItem();
+	 bool sendPublish(PublishItem &publishItem);
+	 bool writePublishPacket(InflightItem* inflight, bool dup);
+	 bool writePubrelPacket(uint16_t packetId);
+	 void handleAcks();
+	 unsigned long retransmitInflight(bool all);
+	 static uint8_t topicQos(MqttTopic topic);
+	 static uint16_t internTopic(const char* topic);
+	 static uint16_t lookupTopic(const char* topic);
+	 static uint16_t findTopic(const char* topic, uint32_t hash, uint16_t first, uint16_t end);
+	 static uint32_t hashTopic(const char* topic, uint16_t &length);
+	 static uint16_t nextPacketId();
+	 static uint16_t nextSubscribeId();
+	 static uint16_t packetHeader(uint8_t type, uint16_t headerSpace, uint16_t length);
+	 void handleSubscribeQueue(bool connected);
 	 static void messageReceived(char* topic, byte* payload, unsigned int length);
-	 static void handleCallBacks(Subscription subscription, char* strPayload);
-	 void subscribe(char* topic, void* cbFunction, SubscribeCbType type);
+	 static void queueDispatch(Subscription* subscription, char* topic, byte* payload, unsigned int length);
+	 static void callZeroCopy(Subscription* subscription, char* topic, byte* payload, unsigned int length);
+	 static bool dropOldestDispatch();
+	 static void dispatchRaw(Subscription* subscription, char* topic, byte* payload, unsigned int length);
+	 template<typename T> static void dispatchValue(Subscription* subscription, char* topic, byte* payload, unsigned int length);
+	 void subscribe(char* topic, const EvtCallbackData& callback, SubscribeDispatchFunc dispatchFunc, bool zeroCopy = false);
 	 void subscribeAll();
+	 void subscribeFrom(int firstIndex);
+	 unsigned long reconnectDelay(uint8_t attempt);
+	 static uint8_t packetBuffer[MQTT_PACKET_SIZE];
+	 static uint16_t lastPacketId;
+	 static uint16_t lastSubscribeId;
+	 static InflightItem inflightTable[MQTT_INFLIGHT_WINDOW];
+	 static uint8_t inflightCount;
+	 static MqttStats stats;
+	 static bool takeLatestItem(PublishItem &publishItem);
+	 void queuePublishItem(PublishItem &publishItem);
+	 void queuePublish(MqttTopic topic, const char* value, unsigned int length);
 
 	 char* _mqttServer;
 	 uint16_t _mqttPort;
 	 char* _mqttClientId;
 	 char* _mqttUser; 
 	 char* _mqttPassword;
+
+	 friend struct MqttTopic;
  public:
 	 void begin(char* mqttServer, uint16_t mqttPort, char* mqttClientId, char* mqttUser, char* mqttPassword);
-	 void subscribe(char* topic, SubscribeCbFuncBool cbFunction);
-	 void subscribe(char* topic, SubscribeCbFuncInt cbFunction);
-	 void subscribe(char* topic, SubscribeCbFuncFloat cbFunction);
-	 void publish(char* topic, bool value, const char* onName, const char* offName);
-	 void publish(char* topic, int value);
-	 void publish(char* topic, float value, uint8_t decimals);
+	 template<typename T> void subscribe(char* topic, void(*cbFunction) (char* topic, T value));
+	 template<typename T> void subscribe(char* topic, void(*cbFunction) (void* context, char* topic, T value), void* context);
+	 template<typename T, typename F> void subscribe(char* topic, F cbFunction);
+	 void subscribe(char* topic, SubscribeCbFuncRaw cbFunction, bool zeroCopy = false);
+	 static MqttTopic registerTopic(const char* format, ...);
+	 static const char* topicName(MqttTopic topic);
+	 bool latestValueOnly(MqttTopic topic);
+	 bool enableSpool(uint8_t segmentCount, uint32_t segmentSize);
+	 bool setQos(MqttTopic topic, uint8_t qos);
+	 void setTls(const char* caCert, const char* clientCert = nullptr, const char* clientKey = nullptr);
+	 void setDispatch(uint8_t priority, DispatchOverflow overflow = DISPATCH_DROP_OLDEST);
+	 MqttStats getStats();
+	 SubscriptionStats getSubscriptionStats(const char* topic);
+	 void publish(MqttTopic topic, bool value, const char* onName, const char* offName);
+	 template<typename T> auto publish(MqttTopic topic, T value) -> decltype(MqttCodec<T>::encode(value, nullptr), void());
+	 void publish(MqttTopic topic, float value, uint8_t decimals);
+	 void publish(MqttTopic topic, const char* value);
+	 void publish(MqttTopic topic, const byte* payload, unsigned int length);
 };
 
+
+
+/*	Public method to provide a callback function for a certain mqtt topic. The value type of the callback decides how the
+	payload is decoded (int, float, bool, enums, MqttFixed etc). Parameters:
+	topic: mqtt topic. It may contain the wildcards "+" and "#"
+	cbFunction: the function to call with the decoded value
+*/
+template<typename T> void EvtMqtt::subscribe(char* topic, void(*cbFunction) (char* topic, T value)) {
+	subscribe<T>(topic, EvtCallback<void(char*, T)>(cbFunction));
+}
+
+
+
+/*	The same for C style callbacks. context is given to the callback as the first argument. Parameters:
+	topic: mqtt topic. It may contain the wildcards "+" and "#"
+	cbFunction: the function to call with the decoded value
+	context: anything the callback needs. Like the device the topic belongs to
+*/
+template<typename T> void EvtMqtt::subscribe(char* topic, void(*cbFunction) (void* context, char* topic, T value), void* context) {
+	subscribe<T>(topic, EvtCallback<void(char*, T)>(cbFunction, context));
+}
+
+
+
+/*	The same for lambdas. The value type can't be seen from a lambda, so it's given: subscribe<float>(topic, [](...) {...})
+	Parameters:
+	topic: mqtt topic. It may contain the wildcards "+" and "#"
+	cbFunction: the lambda. It's stored in the subscription, see EvtCallback
+*/
+template<typename T, typename F> void EvtMqtt::subscribe(char* topic, F cbFunction) {
+	subscribe(topic, EvtCallback<void(char*, T)>(cbFunction).erase(), dispatchValue<T>);
+}
+
+
+
+/*	Decodes the payload with the codec of the value type and does the users callback. Parameters:
+	subscription: a struct with topic and callback pointer
+	topic: the topic the message was received in. It can differ from the subscription topic if it has wildcards
+	payload, length: the message from pubsub client
+*/
+template<typename T> void EvtMqtt::dispatchValue(Subscription* subscription, char* topic, byte* payload, unsigned int length) {
+	T value;
+	if (MqttCodec<T>::decode(payload, length, value)) {
+		EvtCallback<void(char*, T)>::invoke(subscription->callback, topic, value);
+	} else {
+		logger.send(WARN, "MQT", "Unexpected value \"%.*s\" in topic \"%s\"", length < 20 ? length : 20, payload, topic);
+	}
+}
+
+
+
+/*	Adds a mqtt topic/value to the mqttPublishQueue. The value is converted to text by the codec of its type. A value whose
+	text is too long for MQTT_CODEC_BUFFER_SIZE is dropped. Parameters:
+	topic: a registered topic or a topic string
+	value: the value (int, float, bool, enums, MqttFixed etc)
+*/
+template<typename T> auto EvtMqtt::publish(MqttTopic topic, T value) -> decltype(MqttCodec<T>::encode(value, nullptr), void()) {
+	char strValue[MQTT_CODEC_BUFFER_SIZE];
+	unsigned int length = MqttCodec<T>::encode(value, strValue);
+	if (length == 0) {
+		logger.send(WARN, "MQT", "Value for topic \"%s\" is too long to publish", topicName(topic));
+		return;
+	}
+	queuePublish(topic, strValue, length);
+}
+
 #endif
\ No newline at end of file
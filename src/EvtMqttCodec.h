@@ -0,0 +1,258 @@
+#ifndef _EVTMQTTCODEC_h
+#define _EVTMQTTCODEC_h
+
+#include <Arduino.h>
+#include <type_traits>
+#include <limits>
+
+#define MQTT_CODEC_BUFFER_SIZE 48   // Max length of a text value made by a codec
+#define MQTT_FLOAT_DECIMALS 2   // Decimals used when a float is published without giving the number of decimals
+
+
+
+/*	Converting between mqtt payloads and c++ types. The right codec is chosen by the compiler from the type of the callback
+	or the value, so nothing is decided at runtime. Each codec has:
+	decode(payload, length, value): reads the payload directly without any copying. Returns false if it isn't a legal value
+	encode(value, buffer): writes the value as text into buffer (at least MQTT_CODEC_BUFFER_SIZE). Returns the length, or 0
+	if the text doesn't fit
+*/
+template<typename T, typename Enable = void> struct MqttCodec;
+
+
+
+// A fixed point value. raw holds the value multiplied by 10^DECIMALS. "21.50" is raw 2150 with 2 decimals
+template<uint8_t DECIMALS> struct MqttFixed {
+	int32_t raw;
+};
+
+
+
+/*	The accepted bool payloads. They are placed in a perfect hash table, so a payload is found with one hash and one compare.
+	If you change a word the compiler checks that the hash still puts it in its slot. Words must be lower case */
+struct MqttBoolKeyword {
+	const char* word;
+	uint8_t length;
+	bool value;
+};
+
+constexpr MqttBoolKeyword mqttBoolKeywords[8] = {
+	{ "low", 3, false },
+	{ "0", 1, false },
+	{ "false", 5, false },
+	{ "true", 4, true },
+	{ "high", 4, true },
+	{ "on", 2, true },
+	{ "off", 3, false },
+	{ "1", 1, true }
+};
+
+constexpr uint8_t mqttBoolHash(const char* word, unsigned int length) {
+	return (length == 0) ? 0 : ((((uint8_t)word[0] | 0x20) + ((uint8_t)word[length - 1] | 0x20)) * 7 + length) & 7;
+}
+
+constexpr bool mqttBoolTableOk(uint8_t slot) {
+	return (slot == 8) ? true : mqttBoolHash(mqttBoolKeywords[slot].word, mqttBoolKeywords[slot].length) == slot && mqttBoolTableOk(slot + 1);
+}
+
+static_assert(mqttBoolTableOk(0), "A word in mqttBoolKeywords is not in the slot its hash points to");
+
+
+
+/*	Reads an optional sign and digits. Used by all the integer based codecs. Parameters:
+	negative: set if there is a minus sign
+	magnitude: the value without the sign
+	Returns false if it isn't a number, or it's too large for 64 bits
+*/
+inline bool mqttDecodeDigits(const byte* payload, unsigned int length, bool &negative, uint64_t &magnitude) {
+	unsigned int i = 0;
+	negative = false;
+	if (length > 0 && (payload[0] == '-' || payload[0] == '+')) {
+		negative = payload[0] == '-';
+		i++;
+	}
+	if (i == length) return(false);   // No digits
+
+	magnitude = 0;
+	for (; i < length; i++) {
+		if (payload[i] < '0' || payload[i] > '9') return(false);
+		uint8_t digit = payload[i] - '0';
+		if (magnitude > (UINT64_MAX - digit) / 10) return(false);   // It would overflow
+		magnitude = magnitude * 10 + digit;
+	}
+	return(true);
+}
+
+
+
+/* Reads a signed integer. Returns false if it isn't a number, or it doesn't fit in an int64_t */
+inline bool mqttDecodeInteger(const byte* payload, unsigned int length, int64_t &value) {
+	bool negative;
+	uint64_t magnitude;
+	if (!mqttDecodeDigits(payload, length, negative, magnitude)) return(false);
+	if (magnitude > (uint64_t)INT64_MAX + (negative ? 1 : 0)) return(false);
+	value = negative ? -(int64_t)(magnitude - 1) - 1 : (int64_t)magnitude;   // INT64_MIN has no positive counterpart
+	return(true);
+}
+
+
+
+/* Writes an unsigned integer as text without using printf. Returns the length */
+inline unsigned int mqttEncodeUnsigned(uint64_t value, char* buffer) {
+	char digits[20];
+	uint8_t digitCount = 0;
+	do {
+		digits[digitCount++] = '0' + value % 10;
+		value /= 10;
+	} while (value > 0);
+
+	unsigned int length = 0;
+	while (digitCount > 0) buffer[length++] = digits[--digitCount];
+	buffer[length] = 0;
+	return(length);
+}
+
+
+
+/* Writes an integer as text without using printf. Returns the length */
+inline unsigned int mqttEncodeInteger(int64_t value, char* buffer) {
+	if (value >= 0) return(mqttEncodeUnsigned(value, buffer));
+	buffer[0] = '-';
+	return(1 + mqttEncodeUnsigned(-(uint64_t)value, buffer + 1));
+}
+
+
+
+/* Integers of all sizes, signed and unsigned. bool has its own codec */
+template<typename T> struct MqttCodec<T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value>::type> {
+	static bool decode(const byte* payload, unsigned int length, T &value) {
+		return(decode(payload, length, value, std::is_signed<T>()));
+	}
+	static unsigned int encode(T value, char* buffer) {
+		return(std::is_signed<T>::value ? mqttEncodeInteger(value, buffer) : mqttEncodeUnsigned(value, buffer));
+	}
+private:
+	static bool decode(const byte* payload, unsigned int length, T &value, std::true_type isSigned) {
+		int64_t number;
+		if (!mqttDecodeInteger(payload, length, number)) return(false);
+		if (number < (int64_t)std::numeric_limits<T>::min() || number > (int64_t)std::numeric_limits<T>::max()) return(false);
+		value = (T)number;
+		return(true);
+	}
+	static bool decode(const byte* payload, unsigned int length, T &value, std::false_type isSigned) {
+		bool negative;
+		uint64_t magnitude;
+		if (!mqttDecodeDigits(payload, length, negative, magnitude)) return(false);
+		if ((negative && magnitude != 0) || magnitude > (uint64_t)std::numeric_limits<T>::max()) return(false);   // "-0" is allowed
+		value = (T)magnitude;
+		return(true);
+	}
+};
+
+
+
+/* Enums are sent as their number */
+template<typename T> struct MqttCodec<T, typename std::enable_if<std::is_enum<T>::value>::type> {
+	typedef typename std::underlying_type<T>::type Number;
+	static bool decode(const byte* payload, unsigned int length, T &value) {
+		Number number;
+		if (!MqttCodec<Number>::decode(payload, length, number)) return(false);
+		value = (T)number;
+		return(true);
+	}
+	static unsigned int encode(T value, char* buffer) {
+		return(MqttCodec<Number>::encode((Number)value, buffer));
+	}
+};
+
+
+
+/* float and double */
+template<typename T> struct MqttCodec<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+	static bool decode(const byte* payload, unsigned int length, T &value) {
+		char strPayload[MQTT_CODEC_BUFFER_SIZE];   // strtod needs a zero terminated string. It's copied on the stack
+		if (length == 0 || length >= sizeof(strPayload)) return(false);
+		memcpy(strPayload, payload, length);
+		strPayload[length] = 0;
+		char* end;
+		value = strtod(strPayload, &end);
+		return(end == strPayload + length);   // All of the payload must be a number
+	}
+	static unsigned int encode(T value, char* buffer) {
+		int length = snprintf(buffer, MQTT_CODEC_BUFFER_SIZE, "%.*f", MQTT_FLOAT_DECIMALS, (double)value);
+		return(length > 0 && length < MQTT_CODEC_BUFFER_SIZE ? length : 0);   // 1e300 has 301 digits before the point
+	}
+};
+
+
+
+/* bool uses the perfect hash table of words. Case doesn't matter */
+template<> struct MqttCodec<bool> {
+	static bool decode(const byte* payload, unsigned int length, bool &value) {
+		const MqttBoolKeyword &keyword = mqttBoolKeywords[mqttBoolHash((const char*)payload, length)];
+		if (keyword.length != length) return(false);
+		for (unsigned int i = 0; i < length; i++) {
+			byte c = payload[i];
+			if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+			if (c != keyword.word[i]) return(false);
+		}
+		value = keyword.value;
+		return(true);
+	}
+	static unsigned int encode(bool value, char* buffer) {
+		strcpy(buffer, value ? "true" : "false");
+		return(value ? 4 : 5);
+	}
+};
+
+
+
+/* Fixed point values. They are read and written as decimal text without using floats. Extra decimals are cut off */
+template<uint8_t DECIMALS> struct MqttCodec<MqttFixed<DECIMALS> > {
+	static bool decode(const byte* payload, unsigned int length, MqttFixed<DECIMALS> &value) {
+		unsigned int integerLength = 0;
+		while (integerLength < length && payload[integerLength] != '.') integerLength++;
+
+		int64_t number;
+		if (!mqttDecodeInteger(payload, integerLength, number)) return(false);
+		bool negative = payload[0] == '-';
+
+		uint8_t decimals = 0;
+		for (unsigned int i = integerLength + 1; i < length; i++) {
+			if (payload[i] < '0' || payload[i] > '9') return(false);
+			if (decimals < DECIMALS) {
+				if (number < INT32_MIN || number > INT32_MAX) return(false);   // Too large already. Checked before it can overflow
+				number = number * 10 + (negative ? -(payload[i] - '0') : (payload[i] - '0'));
+				decimals++;
+			}
+		}
+		for (; decimals < DECIMALS; decimals++) {
+			if (number < INT32_MIN || number > INT32_MAX) return(false);
+			number *= 10;
+		}
+		if (number < INT32_MIN || number > INT32_MAX) return(false);
+		value.raw = number;
+		return(true);
+	}
+	static unsigned int encode(MqttFixed<DECIMALS> value, char* buffer) {
+		int64_t scale = 1;
+		for (uint8_t i = 0; i < DECIMALS; i++) scale *= 10;
+		int64_t raw = value.raw;
+		unsigned int length = 0;
+		if (raw < 0) {
+			buffer[length++] = '-';
+			raw = -raw;
+		}
+		length += mqttEncodeInteger(raw / scale, buffer + length);
+		if (DECIMALS > 0) {
+			buffer[length++] = '.';
+			int64_t fraction = raw % scale;
+			for (int64_t digit = scale / 10; digit > 0; digit /= 10) {   // Leading zeros of the fraction are kept
+				buffer[length++] = '0' + (fraction / digit) % 10;
+			}
+			buffer[length] = 0;
+		}
+		return(length);
+	}
+};
+
+#endif
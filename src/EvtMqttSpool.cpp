@@ -0,0 +1,231 @@
+#include "EvtMqttSpool.h"
+
+
+
+/*	Mounts LittleFS and finds the segments left from before a reboot. Parameters:
+	segmentCount: max number of segment files, at least 2. When it's reached the oldest segment is thrown away
+	segmentSize: size of a segment file in bytes. segmentCount * segmentSize must fit in the LittleFS partition
+	Returns true if the spool is ready
+*/
+bool EvtMqttSpool::begin(uint8_t segmentCount, uint32_t segmentSize) {
+	if (segmentCount < 2 || segmentSize < sizeof(SpoolRecordHeader) + 1) {   // One segment is written while another is read
+		logger.send(ERR, "MQT", "Mqtt spool needs at least 2 segments that can hold a record");
+		return(false);
+	}
+	if (!LittleFS.begin(true)) {   // Format the partition if it can't be mounted
+		logger.send(ERR, "MQT", "Could not mount LittleFS for the mqtt spool");
+		return(false);
+	}
+	LittleFS.mkdir(MQTT_SPOOL_DIR);
+	_segmentCount = segmentCount;
+	_segmentSize = segmentSize;
+
+	// The segment names are their sequence numbers. Find the oldest and the newest
+	bool found = false;
+	uint32_t minSeq = 0;
+	uint32_t maxSeq = 0;
+	File dir = LittleFS.open(MQTT_SPOOL_DIR);
+	File file = dir.openNextFile();
+	while (file) {
+		const char* name = strrchr(file.name(), '/');   // Some versions give the full path, others only the name
+		uint32_t seq = strtoul(name ? name + 1 : file.name(), NULL, 10);
+		if (!found || seq < minSeq) minSeq = seq;
+		if (!found || seq > maxSeq) maxSeq = seq;
+		found = true;
+		file.close();
+		file = dir.openNextFile();
+	}
+	dir.close();
+
+	readSeq = found ? minSeq : 0;
+	readOffset = 0;
+	writeSeq = found ? maxSeq + 1 : 0;   // Always write in a new segment. The last one may end with a half written record
+	writeSize = 0;
+	logger.send(INFO, "MQT", "Mqtt spool ready with %d old segments", found ? maxSeq - minSeq + 1 : 0);
+	_enabled = true;
+	return(true);
+}
+
+
+
+/* Returns true if begin() has succeeded */
+bool EvtMqttSpool::isEnabled() {
+	return(_enabled);
+}
+
+
+
+/* Returns true if there is nothing to read */
+bool EvtMqttSpool::isEmpty() {
+	return(readSeq == writeSeq && (!writeOpen || writeSize == 0));
+}
+
+
+
+/* Returns the number of segments that was deleted before they were read, because the spool was full */
+unsigned long EvtMqttSpool::getDroppedSegments() {
+	return(droppedSegments);
+}
+
+
+
+/*	Adds a message to the end of the spool. Parameters:
+	topic: mqtt topic
+	payload, length: the message
+	Returns true if it was written
+*/
+bool EvtMqttSpool::append(const char* topic, const char* payload, uint16_t length) {
+	SpoolRecordHeader header;
+	header.magic = MQTT_SPOOL_MAGIC;
+	header.topicLength = strnlen(topic, 255);
+	header.payloadLength = length;
+	uint32_t recordSize = sizeof(header) + header.topicLength + length;
+	if (length > BUFFER_POOL_LARGE_SIZE || recordSize > _segmentSize) {   // It could never be read back
+		logger.send(WARN, "MQT", "Message for %s is too large for the mqtt spool", topic);
+		return(false);
+	}
+
+	if (writeOpen && writeSize + recordSize > _segmentSize) closeWriteSegment();   // The segment is full. Start a new one
+	if (!writeOpen) {
+		while (writeSeq - readSeq + 1 > _segmentCount) {   // No room for one more segment. Throw away the oldest
+			logger.send(WARN, "MQT", "Mqtt spool is full. Dropping the oldest segment");
+			finishReadSegment();
+			droppedSegments++;
+		}
+		char path[32];
+		segmentPath(writeSeq, path);
+		writeFile = LittleFS.open(path, "w");
+		if (!writeFile) {
+			logger.send(ERR, "MQT", "Could not create mqtt spool segment %s", path);
+			return(false);
+		}
+		writeOpen = true;
+		writeSize = 0;
+	}
+
+	header.crc = crc32(0, (const uint8_t*)&header.topicLength, sizeof(header.topicLength) + sizeof(header.payloadLength));
+	header.crc = crc32(header.crc, (const uint8_t*)topic, header.topicLength);
+	header.crc = crc32(header.crc, (const uint8_t*)payload, length);
+
+	writeFile.write((const uint8_t*)&header, sizeof(header));
+	writeFile.write((const uint8_t*)topic, header.topicLength);
+	writeFile.write((const uint8_t*)payload, length);
+	writeFile.flush();   // Make sure it's on the flash, in case we lose power
+	writeSize += recordSize;
+	return(true);
+}
+
+
+
+/*	Reads the oldest message without removing it. Call next() when it's sent. Parameters:
+	topic: filled with the topic
+	topicSize: the size of topic
+	payload: set to a buffer from EvtBufferPool with the message. The caller must give it back
+	length: set to the length of the message
+	Returns true if a message was read
+*/
+bool EvtMqttSpool::peek(char* topic, uint8_t topicSize, char** payload, uint16_t* length) {
+	while (!isEmpty()) {
+		if (!readOpen) {
+			if (readSeq == writeSeq) closeWriteSegment();   // We never read from the segment that is being written
+			char path[32];
+			segmentPath(readSeq, path);
+			readFile = LittleFS.open(path, "r");
+			if (!readFile) {   // Missing segment. Go on with the next one
+				readSeq++;
+				continue;
+			}
+			readOpen = true;
+			readOffset = 0;
+		}
+
+		// At the end of the segment or at a broken record the rest of the segment can't be trusted. A payload that no pool
+		// buffer can hold is broken too. take() would fail on it every time and stop the replay for good
+		SpoolRecordHeader header;
+		readFile.seek(readOffset);
+		if (readFile.read((uint8_t*)&header, sizeof(header)) != sizeof(header) || header.magic != MQTT_SPOOL_MAGIC ||
+			header.topicLength >= topicSize || header.payloadLength > BUFFER_POOL_LARGE_SIZE) {
+			finishReadSegment();
+			continue;
+		}
+
+		char *buffer = EvtBufferPool::take(header.payloadLength);
+		if (buffer == nullptr) return(false);   // The length is valid, so a buffer will be free later. Try again then
+		uint32_t crc = crc32(0, (const uint8_t*)&header.topicLength, sizeof(header.topicLength) + sizeof(header.payloadLength));
+		bool readOk = readFile.read((uint8_t*)topic, header.topicLength) == header.topicLength &&
+			readFile.read((uint8_t*)buffer, header.payloadLength) == header.payloadLength;
+		crc = crc32(crc, (const uint8_t*)topic, header.topicLength);
+		crc = crc32(crc, (const uint8_t*)buffer, header.payloadLength);
+		if (!readOk || crc != header.crc) {
+			logger.send(WARN, "MQT", "Broken record in mqtt spool segment %lu", readSeq);
+			EvtBufferPool::give(buffer);
+			finishReadSegment();
+			continue;
+		}
+
+		topic[header.topicLength] = 0;
+		*payload = buffer;
+		*length = header.payloadLength;
+		pendingRecordSize = sizeof(header) + header.topicLength + header.payloadLength;
+		return(true);
+	}
+	return(false);
+}
+
+
+
+/* Removes the message that was given by peek() */
+void EvtMqttSpool::next() {
+	readOffset += pendingRecordSize;
+	pendingRecordSize = 0;
+}
+
+
+
+/* Closes the segment we write to. The next message will go into a new segment */
+void EvtMqttSpool::closeWriteSegment() {
+	if (writeOpen) {
+		writeFile.close();
+		writeOpen = false;
+		writeSeq++;
+	}
+}
+
+
+
+/* Deletes the oldest segment because it's read or thrown away. Reading goes on with the next segment */
+void EvtMqttSpool::finishReadSegment() {
+	if (readOpen) {
+		readFile.close();
+		readOpen = false;
+	}
+	char path[32];
+	segmentPath(readSeq, path);
+	LittleFS.remove(path);
+	readSeq++;
+	readOffset = 0;
+	pendingRecordSize = 0;
+}
+
+
+
+/* Makes the file name of a segment */
+void EvtMqttSpool::segmentPath(uint32_t seq, char* path) {
+	sprintf(path, "%s/%08lu", MQTT_SPOOL_DIR, (unsigned long)seq);
+}
+
+
+
+/* Calculates a standard crc32. It uses a small table with 16 entries, so it doesn't take up much memory */
+uint32_t EvtMqttSpool::crc32(uint32_t crc, const uint8_t* data, size_t length) {
+	static const uint32_t table[16] = {
+		0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+		0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+	};
+	crc = ~crc;
+	for (size_t i = 0; i < length; i++) {
+		crc = table[(crc ^ data[i]) & 0x0F] ^ (crc >> 4);
+		crc = table[(crc ^ (data[i] >> 4)) & 0x0F] ^ (crc >> 4);
+	}
+	return(~crc);
+}
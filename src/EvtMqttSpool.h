@@ -0,0 +1,61 @@
+#ifndef _EVTMQTTSPOOL_h
+#define _EVTMQTTSPOOL_h
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include "EvtLogger.h"
+#include "EvtBufferPool.h"
+
+#define MQTT_SPOOL_DIR "/mqspool"
+#define MQTT_SPOOL_MAGIC 0xA5   // First byte of every record. Used to spot the end of a segment cut short by a power loss
+
+
+// Written in front of every record in a segment. The crc covers the lengths, the topic and the payload
+struct SpoolRecordHeader {
+	uint8_t magic;
+	uint8_t topicLength;
+	uint16_t payloadLength;
+	uint32_t crc;
+};
+
+
+
+/*	A store for mqtt messages that could not be sent because we are offline. It's an append only log on LittleFS that is split
+	in segment files. New segments get a higher sequence number in their name, so writing moves around the flash. When the
+	max number of segments is reached the oldest is deleted. Messages are read back in the order they were written.
+	A segment is deleted when all its messages are read. After a reboot it may be read again, so messages are sent at least once.
+*/
+class EvtMqttSpool {
+private:
+	bool _enabled = false;
+	uint8_t _segmentCount;
+	uint32_t _segmentSize;
+
+	uint32_t readSeq;   // The oldest segment. It is the one we read from
+	uint32_t readOffset;
+	bool readOpen = false;
+	File readFile;
+	uint32_t pendingRecordSize = 0;   // Size of the record given by peek(). next() skips it
+
+	unsigned long droppedSegments = 0;
+
+	uint32_t writeSeq;   // The newest segment. It is the one we append to
+	uint32_t writeSize;
+	bool writeOpen = false;
+	File writeFile;
+
+	void segmentPath(uint32_t seq, char* path);
+	void closeWriteSegment();
+	void finishReadSegment();
+	static uint32_t crc32(uint32_t crc, const uint8_t* data, size_t length);
+public:
+	bool begin(uint8_t segmentCount, uint32_t segmentSize);
+	bool isEnabled();
+	bool isEmpty();
+	bool append(const char* topic, const char* payload, uint16_t length);
+	bool peek(char* topic, uint8_t topicSize, char** payload, uint16_t* length);
+	void next();
+	unsigned long getDroppedSegments();
+};
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef _EVTMQTTTOPICTREE_h
+#define _EVTMQTTTOPICTREE_h
+
+#include <string.h>
+#include "EvtAlloc.h"
+
+
+
+// One level of a subscribed topic ("home", "+", "#"). The nodes form a tree, so incoming topics are matched level by level
+template<typename T> struct MqttTopicNode {
+	char* level = nullptr;
+	uint16_t levelLength = 0;   // A level may be as long as the whole topic, up to 65535 bytes
+	MqttTopicNode* firstChild = nullptr;
+	MqttTopicNode* nextSibling = nullptr;
+	T* items = nullptr;   // The subscriptions that end exactly at this level
+};
+
+
+
+/*	Finds the subscriptions that match a received topic. Each level of a subscribed topic gets a node, and the subscription
+	is hung on the node of its last level. A received topic is matched level by level: exact levels and "+" continue to the
+	next level, "#" matches everything from there on. So the work depends on the depth of the topic, not the number of
+	subscriptions. There is no task in here. EvtMqtt uses it with Subscription, and examples/TopicBenchmark measures it.
+	T must have a zero terminated "topic" and a "T* nextInNode" that the tree uses to chain the items of a node
+*/
+template<typename T> class MqttTopicTree {
+private:
+	MqttTopicNode<T> root;
+
+	/*	Matches the rest of a topic below a node. Parameters:
+		node: the node matched so far
+		level: the start of the next topic level to match
+		topic: the full received topic
+		found: called with each matching item
+	*/
+	template<typename F> void match(MqttTopicNode<T>* node, const char* level, const char* topic, F &found) {
+		const char *levelEnd = strchr(level, '/');
+		uint16_t levelLength = levelEnd ? levelEnd - level : strlen(level);
+		bool systemTopic = node == &root && topic[0] == '$';   // Wildcards at the first level must not match $SYS topics
+
+		for (MqttTopicNode<T> *child = node->firstChild; child != nullptr; child = child->nextSibling) {
+			bool wildcard = child->levelLength == 1 && (child->level[0] == '+' || child->level[0] == '#');
+			if (wildcard && systemTopic) continue;
+
+			if (wildcard && child->level[0] == '#') {   // Matches this level and all below it
+				foundAll(child, found);
+			} else if (wildcard || (child->levelLength == levelLength && strncmp(child->level, level, levelLength) == 0)) {
+				if (levelEnd != nullptr) {
+					match(child, levelEnd + 1, topic, found);   // Go on with the next level
+				} else {
+					foundAll(child, found);   // The last level of the topic is reached
+					for (MqttTopicNode<T> *grandChild = child->firstChild; grandChild != nullptr; grandChild = grandChild->nextSibling) {
+						if (grandChild->levelLength == 1 && grandChild->level[0] == '#') foundAll(grandChild, found);   // "a/#" also matches "a"
+					}
+				}
+			}
+		}
+	}
+
+	/* Gives all the items that end in a node to found */
+	template<typename F> void foundAll(MqttTopicNode<T>* node, F &found) {
+		for (T *item = node->items; item != nullptr; item = item->nextInNode) found(item);
+	}
+
+public:
+	/*	Adds an item. It must not move while it's in the tree. Parameters:
+		item: the item. Its topic may contain the wildcards "+" (one level) and "#" (all remaining levels)
+		Returns false if there is no memory for a node. The nodes made so far stay, without the item
+	*/
+	bool add(T* item) {
+		MqttTopicNode<T> *node = &root;
+		const char *level = item->topic;
+		while (true) {
+			const char *levelEnd = strchr(level, '/');
+			uint16_t levelLength = levelEnd ? levelEnd - level : strlen(level);
+
+			MqttTopicNode<T> *child = node->firstChild;   // Find the level among the children
+			while (child != nullptr && (child->levelLength != levelLength || strncmp(child->level, level, levelLength) != 0)) {
+				child = child->nextSibling;
+			}
+			if (child == nullptr) {   // It's a new level. Make a node for it
+				child = EvtAlloc::create<MqttTopicNode<T>>();
+				if (child == nullptr) return(false);
+				child->level = (char*)EvtAlloc::allocate(levelLength + 1, 1);
+				if (child->level == nullptr) {
+					EvtAlloc::destroy(child);   // It was the last one made, so its memory is given back
+					return(false);
+				}
+				memcpy(child->level, level, levelLength);
+				child->level[levelLength] = 0;
+				child->levelLength = levelLength;
+				child->nextSibling = node->firstChild;
+				node->firstChild = child;
+			}
+			node = child;
+
+			if (levelEnd == nullptr) break;   // It was the last level of the topic
+			level = levelEnd + 1;
+		}
+		item->nextInNode = node->items;
+		node->items = item;
+		return(true);
+	}
+
+	/*	Calls found with every item whose topic matches a received topic. Parameters:
+		topic: the received topic. It has no wildcards
+		found: a function or lambda that takes a T*
+	*/
+	template<typename F> void match(const char* topic, F found) {
+		match(&root, topic, topic, found);
+	}
+};
+
+#endif
@@ -0,0 +1,454 @@
+#include "EvtMqttTransport.h"
+#include <mbedtls/error.h>
+#include <mbedtls/net_sockets.h>
+
+// The last TLS session. RTC memory keeps it during deep sleep
+RTC_DATA_ATTR uint8_t EvtMqttTransport::sessionData[MQTT_TLS_SESSION_SIZE];
+RTC_DATA_ATTR size_t EvtMqttTransport::sessionLength = 0;
+RTC_DATA_ATTR uint32_t EvtMqttTransport::sessionServer = 0;
+
+
+
+// mbedtls 3 made the fields of the ssl context and the session private, and later got functions for what a client may read
+#if MBEDTLS_VERSION_NUMBER >= 0x03020000
+#define TLS_HANDSHAKE_OVER(ssl) mbedtls_ssl_is_handshake_over(ssl)
+#elif MBEDTLS_VERSION_NUMBER >= 0x03000000
+#define TLS_HANDSHAKE_OVER(ssl) ((ssl)->MBEDTLS_PRIVATE(state) == MBEDTLS_SSL_HANDSHAKE_OVER)
+#else
+#define TLS_HANDSHAKE_OVER(ssl) ((ssl)->state == MBEDTLS_SSL_HANDSHAKE_OVER)
+#endif
+
+#if MBEDTLS_VERSION_NUMBER >= 0x03040000
+#define TLS_SESSION_ID(session) mbedtls_ssl_session_get_id(session)
+#define TLS_SESSION_ID_LENGTH(session) mbedtls_ssl_session_get_id_len(session)
+#elif MBEDTLS_VERSION_NUMBER >= 0x03000000
+#define TLS_SESSION_ID(session) ((session)->MBEDTLS_PRIVATE(id))
+#define TLS_SESSION_ID_LENGTH(session) ((session)->MBEDTLS_PRIVATE(id_len))
+#else
+#define TLS_SESSION_ID(session) ((session)->id)
+#define TLS_SESSION_ID_LENGTH(session) ((session)->id_len)
+#endif
+
+
+
+/*	Sets the client that does the real work, like a WiFiClient. Parameters:
+	client: the client
+*/
+void EvtMqttTransport::setClient(Client* client) {
+	_client = client;
+}
+
+
+
+/*	Turns on TLS. Must be called before connecting. The certificates are in PEM format and must stay in memory. Parameters:
+	caCert: the CA certificate that has signed the mqtt servers certificate
+	clientCert: certificate of this device if the server wants one. Otherwise nullptr
+	clientKey: private key of clientCert. Otherwise nullptr
+*/
+void EvtMqttTransport::setTls(const char* caCert, const char* clientCert, const char* clientKey) {
+	_tls = caCert != nullptr;
+	_caCert = caCert;
+	_clientCert = clientCert;
+	_clientKey = clientKey;
+}
+
+
+
+/* Returns counters about the TLS handshakes */
+TlsStats EvtMqttTransport::getTlsStats() {
+	return(tlsStats);
+}
+
+
+
+/*	Takes the oldest acknowledge read from the mqtt server. Parameters:
+	ack: filled with the type and packet id
+	Returns true if there was one
+*/
+bool EvtMqttTransport::takeAck(MqttAck &ack) {
+	if (ackCount == 0) return(false);
+	ack = ackQueue[ackHead];
+	ackHead = (ackHead + 1) & (MQTT_ACK_QUEUE_LENGTH - 1);
+	ackCount--;
+	return(true);
+}
+
+
+
+/* Returns true if the mqtt server said in its last CONNACK that it had kept our session */
+bool EvtMqttTransport::isSessionPresent() {
+	return(sessionPresent);
+}
+
+
+
+/*	Follows the incoming bytes packet by packet. Only the packet id of acknowledges is kept. Parameters:
+	c: the byte read
+*/
+void EvtMqttTransport::follow(uint8_t c) {
+	switch (readState) {
+	case READ_HEADER:
+		packetType = c & 0xF0;
+		remainingLength = 0;
+		lengthShift = 0;
+		readState = READ_LENGTH;
+		break;
+	case READ_LENGTH:
+		remainingLength |= (uint32_t)(c & 0x7F) << lengthShift;
+		lengthShift += 7;
+		if ((c & 0x80) == 0) {
+			bodyRead = 0;
+			packetId = 0;
+			readState = READ_BODY;
+			if (remainingLength == 0) packetDone();
+		}
+		break;
+	case READ_BODY:
+		if (bodyRead < 2) packetId = (packetId << 8) | c;
+		if (++bodyRead == remainingLength) packetDone();
+		break;
+	}
+}
+
+
+
+/* Called when the last byte of a packet is read. Acknowledges are put in the ack queue */
+void EvtMqttTransport::packetDone() {
+	if (packetType == MQTT_CONNACK && remainingLength >= 2) sessionPresent = (packetId >> 8) & 0x01;   // The first byte holds the flags
+	if ((packetType == MQTT_PUBACK || packetType == MQTT_PUBREC || packetType == MQTT_PUBCOMP) && remainingLength >= 2) {
+		if (ackCount < MQTT_ACK_QUEUE_LENGTH) {   // If it's full the publish is retransmitted later, and acknowledged again
+			MqttAck &ack = ackQueue[(ackHead + ackCount) & (MQTT_ACK_QUEUE_LENGTH - 1)];
+			ack.type = packetType;
+			ack.packetId = packetId;
+			ackCount++;
+		}
+	}
+	readState = READ_HEADER;
+}
+
+
+
+/*	Parses the certificates and sets up mbedtls. It's only done once, and then kept for all connections.
+	Returns true if it went well
+*/
+bool EvtMqttTransport::setupTls() {
+	mbedtls_ssl_init(&ssl);
+	mbedtls_ssl_config_init(&sslConfig);
+	mbedtls_entropy_init(&entropy);
+	mbedtls_ctr_drbg_init(&ctrDrbg);
+	mbedtls_x509_crt_init(&caCrt);
+	mbedtls_x509_crt_init(&clientCrt);
+	mbedtls_pk_init(&clientKey);
+
+	bool withClientCert = _clientCert != nullptr && _clientKey != nullptr;
+	const char* failed = nullptr;
+	if (mbedtls_ctr_drbg_seed(&ctrDrbg, mbedtls_entropy_func, &entropy, (const unsigned char*)"EvtMqtt", 7) != 0) {
+		failed = "random generator";
+	} else if (mbedtls_x509_crt_parse(&caCrt, (const unsigned char*)_caCert, strlen(_caCert) + 1) != 0) {
+		failed = "CA certificate";
+	} else if (withClientCert && mbedtls_x509_crt_parse(&clientCrt, (const unsigned char*)_clientCert, strlen(_clientCert) + 1) != 0) {
+		failed = "client certificate";
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+	} else if (withClientCert && mbedtls_pk_parse_key(&clientKey, (const unsigned char*)_clientKey, strlen(_clientKey) + 1, NULL, 0, mbedtls_ctr_drbg_random, &ctrDrbg) != 0) {
+#else
+	} else if (withClientCert && mbedtls_pk_parse_key(&clientKey, (const unsigned char*)_clientKey, strlen(_clientKey) + 1, NULL, 0) != 0) {
+#endif
+		failed = "client key";
+	} else if (mbedtls_ssl_config_defaults(&sslConfig, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT) != 0) {
+		failed = "TLS config";
+	}
+	if (failed != nullptr) {
+		logger.send(ERR, "MQT", "TLS setup failed in %s", failed);
+		return(false);
+	}
+
+	mbedtls_ssl_conf_authmode(&sslConfig, MBEDTLS_SSL_VERIFY_REQUIRED);
+	mbedtls_ssl_conf_ca_chain(&sslConfig, &caCrt, NULL);
+	mbedtls_ssl_conf_rng(&sslConfig, mbedtls_ctr_drbg_random, &ctrDrbg);
+	mbedtls_ssl_conf_session_tickets(&sslConfig, MBEDTLS_SSL_SESSION_TICKETS_DISABLED);   // With a ticket the client makes up a new session id, and we couldn't see if the session was resumed
+	if (withClientCert) mbedtls_ssl_conf_own_cert(&sslConfig, &clientCrt, &clientKey);
+	if (mbedtls_ssl_setup(&ssl, &sslConfig) != 0) {
+		logger.send(ERR, "MQT", "TLS setup failed");
+		return(false);
+	}
+	mbedtls_ssl_set_bio(&ssl, this, bioSend, bioReceive, NULL);
+	tlsReady = true;
+	return(true);
+}
+
+
+
+/*	Does the TLS handshake on a new connection. If we have a session from the same server it's offered for resumption.
+	The time and the heap used are measured. Parameters:
+	host: the name of the server. It must match the name in its certificate
+	port: the port of the server
+	Returns true if we have a secure connection
+*/
+bool EvtMqttTransport::tlsHandshake(const char* host, uint16_t port) {
+	if (!tlsReady && !setupTls()) return(false);
+
+	uint32_t server = 2166136261UL;   // FNV-1a hash of host and port, so a session is only offered to the server it came from
+	for (const char* c = host; *c != 0; c++) server = (server ^ (uint8_t)*c) * 16777619UL;
+	server = (server ^ port) * 16777619UL;
+
+	mbedtls_ssl_session_reset(&ssl);
+	mbedtls_ssl_set_hostname(&ssl, host);
+	bool offered = loadSession(server);
+
+	unsigned long started = millis();
+	uint32_t heapBefore = ESP.getFreeHeap();
+	uint32_t lowestHeap = heapBefore;
+	int result = 0;
+	while (!TLS_HANDSHAKE_OVER(&ssl)) {   // Step by step, so we can watch the heap
+		result = mbedtls_ssl_handshake_step(&ssl);
+		uint32_t heap = ESP.getFreeHeap();
+		if (heap < lowestHeap) lowestHeap = heap;
+		if (result == MBEDTLS_ERR_SSL_WANT_READ || result == MBEDTLS_ERR_SSL_WANT_WRITE) {
+			if (millis() - started > MQTT_TLS_TIMEOUT) break;
+			vTaskDelay(1);   // Waiting for the server
+		} else if (result != 0) {
+			break;
+		}
+	}
+	if (!TLS_HANDSHAKE_OVER(&ssl)) {
+		char error[80];
+		mbedtls_strerror(result, error, sizeof(error));
+		logger.send(ERR, "MQT", "TLS handshake failed: %s", result == 0 || result == MBEDTLS_ERR_SSL_WANT_READ ? "timeout" : error);
+		if (offered) sessionLength = 0;   // Don't try that session again
+		return(false);
+	}
+
+	// The server answers with the id we offered if it resumes the session. Otherwise it makes a new one
+	bool resumed = false;
+	mbedtls_ssl_session session;
+	mbedtls_ssl_session_init(&session);
+	if (offered && mbedtls_ssl_get_session(&ssl, &session) == 0) {
+		resumed = TLS_SESSION_ID_LENGTH(&session) == offeredIdLength && memcmp(TLS_SESSION_ID(&session), offeredId, offeredIdLength) == 0;
+	}
+	mbedtls_ssl_session_free(&session);
+
+	tlsStats.handshakes++;
+	if (resumed) tlsStats.resumedHandshakes++;
+	tlsStats.lastHandshakeTime = millis() - started;
+	if (tlsStats.lastHandshakeTime > tlsStats.longestHandshakeTime) tlsStats.longestHandshakeTime = tlsStats.lastHandshakeTime;
+	tlsStats.lastHandshakeHeap = heapBefore - lowestHeap;
+	if (tlsStats.lastHandshakeHeap > tlsStats.largestHandshakeHeap) tlsStats.largestHandshakeHeap = tlsStats.lastHandshakeHeap;
+	logger.send(INFO, "MQT", "TLS %s in %lu ms using %u bytes of heap", resumed ? "session resumed" : "handshake done",
+		tlsStats.lastHandshakeTime, tlsStats.lastHandshakeHeap);
+
+	if (!resumed) saveSession(server);
+	tlsConnected = true;
+	peekByte = -1;
+	return(true);
+}
+
+
+
+/*	Saves the session of the current connection in RTC memory. Parameters:
+	server: hash of the server the session belongs to
+*/
+void EvtMqttTransport::saveSession(uint32_t server) {
+	mbedtls_ssl_session session;
+	mbedtls_ssl_session_init(&session);
+	size_t length;
+	sessionLength = 0;
+	if (mbedtls_ssl_get_session(&ssl, &session) == 0) {
+		if (mbedtls_ssl_session_save(&session, sessionData, sizeof(sessionData), &length) == 0) {
+			sessionLength = length;
+			sessionServer = server;
+		} else {
+			logger.send(WARN, "MQT", "TLS session is too big for MQTT_TLS_SESSION_SIZE. It can't be resumed");
+		}
+	}
+	mbedtls_ssl_session_free(&session);
+}
+
+
+
+/*	Offers the saved session to the server. After power on the RTC memory is random, so the session is checked first. Parameters:
+	server: hash of the server we are connecting to
+	Returns true if a session was offered
+*/
+bool EvtMqttTransport::loadSession(uint32_t server) {
+	if (sessionLength == 0 || sessionLength > sizeof(sessionData) || sessionServer != server) return(false);
+	mbedtls_ssl_session session;
+	mbedtls_ssl_session_init(&session);
+	bool loaded = mbedtls_ssl_session_load(&session, sessionData, sessionLength) == 0 && TLS_SESSION_ID_LENGTH(&session) > 0 &&
+		TLS_SESSION_ID_LENGTH(&session) <= sizeof(offeredId) && mbedtls_ssl_set_session(&ssl, &session) == 0;
+	if (loaded) {
+		offeredIdLength = TLS_SESSION_ID_LENGTH(&session);
+		memcpy(offeredId, TLS_SESSION_ID(&session), offeredIdLength);
+	}
+	mbedtls_ssl_session_free(&session);
+	if (!loaded) sessionLength = 0;
+	return(loaded);
+}
+
+
+
+/* Called by mbedtls to send encrypted data on the real client */
+int EvtMqttTransport::bioSend(void* ctx, const unsigned char* buf, size_t length) {
+	Client* client = ((EvtMqttTransport*)ctx)->_client;
+	size_t written = client->write(buf, length);
+	if (written > 0) return(written);
+	return(client->connected() ? MBEDTLS_ERR_SSL_WANT_WRITE : MBEDTLS_ERR_NET_SEND_FAILED);
+}
+
+
+
+/* Called by mbedtls to read encrypted data from the real client. It never waits */
+int EvtMqttTransport::bioReceive(void* ctx, unsigned char* buf, size_t length) {
+	Client* client = ((EvtMqttTransport*)ctx)->_client;
+	if (client->available() <= 0) return(client->connected() ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_CONN_RESET);
+	int received = client->read(buf, length);
+	return(received > 0 ? received : MBEDTLS_ERR_SSL_WANT_READ);
+}
+
+
+
+/*	Reads decrypted data. Parameters:
+	buf, size: where to put it
+	Returns the number of bytes read, or -1 if none is ready
+*/
+int EvtMqttTransport::tlsRead(uint8_t *buf, size_t size) {
+	if (size == 0) return(0);
+	int length = 0;
+	if (peekByte >= 0) {
+		buf[length++] = peekByte;
+		peekByte = -1;
+	}
+	if ((size_t)length < size && (mbedtls_ssl_get_bytes_avail(&ssl) > 0 || _client->available() > 0)) {
+		int result = mbedtls_ssl_read(&ssl, buf + length, size - length);
+		if (result > 0) length += result;
+	}
+	return(length > 0 ? length : -1);
+}
+
+
+
+/*	Connects to a server by its IP. With TLS it's refused, because the name in the certificate of the server can't be checked
+	without its hostname. Anyone in the path could then pretend to be the mqtt server
+*/
+int EvtMqttTransport::connect(IPAddress ip, uint16_t port) {
+	readState = READ_HEADER;   // A new connection starts with a new packet
+	if (_tls) {
+		logger.send(ERR, "MQT", "TLS can't check the certificate of %s without its hostname. Give begin() the name of the mqtt server", ip.toString().c_str());
+		return(0);
+	}
+	if (!_client->connect(ip, port)) return(0);
+	return(1);
+}
+
+
+
+/*	Connects to a server by its name. With TLS the name must match the certificate of the server */
+int EvtMqttTransport::connect(const char *host, uint16_t port) {
+	readState = READ_HEADER;
+	if (!_client->connect(host, port)) return(0);
+	if (_tls && !tlsHandshake(host, port)) {
+		_client->stop();
+		return(0);
+	}
+	return(1);
+}
+
+
+
+size_t EvtMqttTransport::write(uint8_t b) {
+	return(write(&b, 1));
+}
+
+
+
+size_t EvtMqttTransport::write(const uint8_t *buf, size_t size) {
+	if (!_tls) return(_client->write(buf, size));
+	if (!tlsConnected) return(0);
+
+	size_t written = 0;
+	unsigned long started = millis();
+	while (written < size) {
+		int result = mbedtls_ssl_write(&ssl, buf + written, size - written);
+		if (result > 0) {
+			written += result;
+		} else if ((result == MBEDTLS_ERR_SSL_WANT_WRITE || result == MBEDTLS_ERR_SSL_WANT_READ) && millis() - started < MQTT_TLS_TIMEOUT) {
+			vTaskDelay(1);
+		} else {
+			break;
+		}
+	}
+	return(written);
+}
+
+
+
+int EvtMqttTransport::available() {
+	if (!_tls) return(_client->available());
+	if (!tlsConnected) return(0);
+	if (mbedtls_ssl_get_bytes_avail(&ssl) == 0 && _client->available() > 0) {
+		mbedtls_ssl_read(&ssl, NULL, 0);   // Decrypts the next record if all of it has arrived
+	}
+	return(mbedtls_ssl_get_bytes_avail(&ssl) + (peekByte >= 0 ? 1 : 0));
+}
+
+
+
+int EvtMqttTransport::read() {
+	int c;
+	if (_tls) {
+		uint8_t decrypted;
+		c = tlsRead(&decrypted, 1) == 1 ? decrypted : -1;
+	} else {
+		c = _client->read();
+	}
+	if (c >= 0) follow(c);
+	return(c);
+}
+
+
+
+int EvtMqttTransport::read(uint8_t *buf, size_t size) {
+	int length = _tls ? tlsRead(buf, size) : _client->read(buf, size);
+	for (int i = 0; i < length; i++) follow(buf[i]);
+	return(length);
+}
+
+
+
+int EvtMqttTransport::peek() {
+	if (!_tls) return(_client->peek());
+	if (peekByte < 0 && tlsConnected) {
+		uint8_t c;
+		if (tlsRead(&c, 1) == 1) peekByte = c;
+	}
+	return(peekByte);
+}
+
+
+
+void EvtMqttTransport::flush() {
+	_client->flush();
+}
+
+
+
+void EvtMqttTransport::stop() {
+	if (tlsConnected) {
+		mbedtls_ssl_close_notify(&ssl);
+		tlsConnected = false;
+		peekByte = -1;
+	}
+	_client->stop();
+}
+
+
+
+uint8_t EvtMqttTransport::connected() {
+	if (!_tls) return(_client->connected());
+	return(tlsConnected && (_client->connected() || mbedtls_ssl_get_bytes_avail(&ssl) > 0 || peekByte >= 0));
+}
+
+
+
+EvtMqttTransport::operator bool() {
+	return(_client != nullptr && (bool)*_client);
+}
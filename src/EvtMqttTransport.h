@@ -0,0 +1,124 @@
+#ifndef _EVTMQTTTRANSPORT_h
+#define _EVTMQTTTRANSPORT_h
+
+#include <Arduino.h>
+#include <Client.h>
+#include <esp_attr.h>
+#include <mbedtls/version.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/x509_crt.h>
+#include <mbedtls/pk.h>
+#include "EvtLogger.h"
+
+#define MQTT_ACK_QUEUE_LENGTH 16   // Acknowledges read by PubSubClient that wait for EvtMqtt to handle them. Must be a power of 2
+#define MQTT_TLS_TIMEOUT 15000   // ms to wait for a TLS handshake or for room to write
+#define MQTT_TLS_SESSION_SIZE 2048   // Bytes of RTC memory for the last TLS session. It must have room for the server certificate
+
+// Mqtt packet types (the upper 4 bits of the first byte of a packet)
+#define MQTT_CONNACK 0x20
+#define MQTT_PUBLISH 0x30
+#define MQTT_PUBACK 0x40
+#define MQTT_PUBREC 0x50
+#define MQTT_PUBREL 0x60
+#define MQTT_PUBCOMP 0x70
+
+
+// An acknowledge of a QoS 1 or 2 publish received from the mqtt server
+struct MqttAck {
+	uint8_t type;
+	uint16_t packetId;
+};
+
+
+
+// Counters about TLS handshakes. Heap is the most heap used during a handshake
+struct TlsStats {
+	unsigned long handshakes = 0;
+	unsigned long resumedHandshakes = 0;   // Handshakes that reused the last session and skipped the key exchange
+	unsigned long lastHandshakeTime = 0;   // ms
+	unsigned long longestHandshakeTime = 0;
+	uint32_t lastHandshakeHeap = 0;   // Bytes
+	uint32_t largestHandshakeHeap = 0;
+};
+
+
+
+/*	The client PubSubClient talks to. It passes everything on to the real client, but it also follows the packets PubSubClient
+	reads. PubSubClient throws away PUBACK, PUBREC and PUBCOMP packets, so they are picked up here and kept for EvtMqtt. The
+	session present flag of CONNACK is kept too.
+	If TLS is set up, everything is encrypted with mbedtls on top of the real client. The TLS session is kept in RTC memory, so
+	reconnects and wakeups from deep sleep can resume it by its session id and skip the slow key exchange. The certificate of
+	the server is checked against its name, so TLS needs the mqtt server as a hostname. Only used by the mqtt task.
+*/
+class EvtMqttTransport : public Client {
+private:
+	Client* _client = nullptr;
+
+	// State of the packet being read
+	enum ReadState { READ_HEADER, READ_LENGTH, READ_BODY };
+	ReadState readState = READ_HEADER;
+	uint8_t packetType;
+	uint32_t remainingLength;
+	uint8_t lengthShift;
+	uint32_t bodyRead;
+	uint16_t packetId;
+
+	MqttAck ackQueue[MQTT_ACK_QUEUE_LENGTH];
+	uint8_t ackHead = 0;
+	uint8_t ackCount = 0;
+	bool sessionPresent = false;   // The session present flag of the last CONNACK
+
+	bool _tls = false;
+	bool tlsReady = false;   // True when certificates and mbedtls are set up. It's only done once
+	bool tlsConnected = false;
+	const char* _caCert;
+	const char* _clientCert;
+	const char* _clientKey;
+	mbedtls_ssl_context ssl;
+	mbedtls_ssl_config sslConfig;
+	mbedtls_entropy_context entropy;
+	mbedtls_ctr_drbg_context ctrDrbg;
+	mbedtls_x509_crt caCrt;
+	mbedtls_x509_crt clientCrt;
+	mbedtls_pk_context clientKey;
+	int peekByte = -1;   // A decrypted byte read by peek()
+	TlsStats tlsStats;
+	static uint8_t sessionData[MQTT_TLS_SESSION_SIZE];
+	static size_t sessionLength;
+	static uint32_t sessionServer;   // Hash of the server the session belongs to
+	uint8_t offeredId[32];   // Id of the session offered in this handshake. The server answers with it if it resumes the session
+	size_t offeredIdLength = 0;
+
+	void follow(uint8_t c);
+	void packetDone();
+	bool setupTls();
+	bool tlsHandshake(const char* host, uint16_t port);
+	void saveSession(uint32_t server);
+	bool loadSession(uint32_t server);
+	int tlsRead(uint8_t *buf, size_t size);
+	static int bioSend(void* ctx, const unsigned char* buf, size_t length);
+	static int bioReceive(void* ctx, unsigned char* buf, size_t length);
+public:
+	void setClient(Client* client);
+	void setTls(const char* caCert, const char* clientCert, const char* clientKey);
+	bool takeAck(MqttAck &ack);
+	bool isSessionPresent();
+	TlsStats getTlsStats();
+
+	int connect(IPAddress ip, uint16_t port);
+	int connect(const char *host, uint16_t port);
+	size_t write(uint8_t b);
+	size_t write(const uint8_t *buf, size_t size);
+	int available();
+	int read();
+	int read(uint8_t *buf, size_t size);
+	int peek();
+	void flush();
+	void stop();
+	uint8_t connected();
+	operator bool();
+};
+
+#endif
@@ -0,0 +1,200 @@
+#include "EvtOneWire.h"
+
+
+
+/* Makes the reset pulse and the wait for the presence pulse */
+void OneWireCodec::encodeReset(OneWireSymbol* symbol) {
+	symbol->level0 = 0;
+	symbol->duration0 = ONEWIRE_RESET_LOW;
+	symbol->level1 = 1;
+	symbol->duration1 = ONEWIRE_RESET_WAIT;
+}
+
+
+
+/*	Makes one symbol for each bit. Bits are sent least significant first. A 1 is a short low pulse, so it also works as a
+	read slot. Parameters:
+	data: the bits to send
+	bitCount: the number of bits
+	symbols: room for bitCount symbols
+*/
+void OneWireCodec::encodeBits(const uint8_t* data, uint16_t bitCount, OneWireSymbol* symbols) {
+	for (uint16_t i = 0; i < bitCount; i++) {
+		bool bit = (data[i / 8] >> (i % 8)) & 1;
+		symbols[i].level0 = 0;
+		symbols[i].duration0 = bit ? ONEWIRE_SLOT_1_LOW : ONEWIRE_SLOT_0_LOW;
+		symbols[i].level1 = 1;
+		symbols[i].duration1 = bit ? ONEWIRE_SLOT_1_HIGH : ONEWIRE_SLOT_0_HIGH;
+	}
+}
+
+
+
+/*	Looks for a presence pulse in what was received during a reset. The first low pulse is our own reset pulse. Parameters:
+	symbols, count: the received symbols
+	Returns true if a device answered
+*/
+bool OneWireCodec::decodePresence(const OneWireSymbol* symbols, size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		if (symbols[i].level0 == 0 && symbols[i].duration0 >= ONEWIRE_PRESENCE_MIN && symbols[i].duration0 <= ONEWIRE_PRESENCE_MAX) return(true);
+		if (symbols[i].level1 == 0 && symbols[i].duration1 >= ONEWIRE_PRESENCE_MIN && symbols[i].duration1 <= ONEWIRE_PRESENCE_MAX) return(true);
+	}
+	return(false);
+}
+
+
+
+/*	Reads the bits of a number of slots. Each slot is a low pulse. Short ones are 1 and long ones 0. Parameters:
+	symbols, count: the received symbols
+	data: filled with the bits, least significant first
+	bitCount: the number of slots that were sent
+	Returns false if some slots are missing
+*/
+bool OneWireCodec::decodeBits(const OneWireSymbol* symbols, size_t count, uint8_t* data, uint16_t bitCount) {
+	if (count < bitCount) return(false);
+	memset(data, 0, (bitCount + 7) / 8);
+	for (uint16_t i = 0; i < bitCount; i++) {
+		if (symbols[i].level0 != 0) return(false);   // Every slot starts with a low pulse
+		if (symbols[i].duration0 < ONEWIRE_READ_THRESHOLD) data[i / 8] |= 1 << (i % 8);
+	}
+	return(true);
+}
+
+
+
+/*	Writes a byte. Parameters:
+	value: the byte
+	power: if true the bus is driven high afterwards, to power parasite devices. depower() or reset() ends it
+*/
+void EvtOneWire::writeByte(uint8_t value, bool power) {
+	touchBits(&value, nullptr, 8);
+}
+
+
+
+uint8_t EvtOneWire::readByte() {
+	uint8_t ones = 0xFF;
+	uint8_t value = 0xFF;
+	touchBits(&ones, &value, 8);
+	return(value);
+}
+
+
+
+void EvtOneWire::write(const uint8_t* data, uint16_t length) {
+	touchBits(data, nullptr, length * 8);
+}
+
+
+
+void EvtOneWire::read(uint8_t* data, uint16_t length) {
+	memset(data, 0xFF, length);
+	touchBits(data, data, length * 8);
+}
+
+
+
+bool EvtOneWire::readBit() {
+	uint8_t one = 1;
+	uint8_t value = 1;
+	touchBits(&one, &value, 1);
+	return(value & 1);
+}
+
+
+
+/* Addresses one device. The next function command is only for it */
+void EvtOneWire::select(const uint8_t* address) {
+	uint8_t command[9] = { ONEWIRE_MATCH_ROM };
+	memcpy(command + 1, address, 8);
+	write(command, sizeof(command));
+}
+
+
+
+/* Addresses all devices. The next function command is for all of them */
+void EvtOneWire::skip() {
+	writeByte(ONEWIRE_SKIP_ROM);
+}
+
+
+
+/* Starts a new search from the first device */
+void EvtOneWire::resetSearch() {
+	lastDiscrepancy = -1;
+	lastDevice = false;
+	memset(searchAddress, 0, sizeof(searchAddress));
+}
+
+
+
+/*	Finds the next device on the bus. Each call returns one device, until all are found. Parameters:
+	address: filled with the ROM address of the device
+	alarmOnly: if true only devices with an alarm flag answer (ALARM SEARCH)
+	Returns false when there are no more devices
+*/
+bool EvtOneWire::search(uint8_t* address, bool alarmOnly) {
+	if (lastDevice) return(false);
+	if (!reset()) {
+		resetSearch();
+		return(false);
+	}
+	writeByte(alarmOnly ? ONEWIRE_ALARM_SEARCH : ONEWIRE_SEARCH_ROM);
+
+	int8_t discrepancy = -1;
+	for (uint8_t bit = 0; bit < 64; bit++) {
+		uint8_t ones = 0x03;
+		uint8_t in = 0;
+		touchBits(&ones, &in, 2);   // Every device sends the bit of its address and then its complement
+		bool idBit = in & 1;
+		bool complementBit = in & 2;
+		if (idBit && complementBit) {   // Nobody answered
+			resetSearch();
+			return(false);
+		}
+
+		bool direction;
+		if (idBit != complementBit) {   // All remaining devices have the same bit here
+			direction = idBit;
+		} else if (bit < lastDiscrepancy) {   // Devices differ. Go the same way as last time
+			direction = (searchAddress[bit / 8] >> (bit % 8)) & 1;
+		} else {
+			direction = bit == lastDiscrepancy;   // Take the 1 branch at the last split, the 0 branch at new splits
+		}
+		if (idBit == complementBit && !direction) discrepancy = bit;
+
+		if (direction) {
+			searchAddress[bit / 8] |= 1 << (bit % 8);
+		} else {
+			searchAddress[bit / 8] &= ~(1 << (bit % 8));
+		}
+		uint8_t out = direction;
+		touchBits(&out, nullptr, 1);   // Devices with another bit here drop out
+	}
+
+	lastDiscrepancy = discrepancy;
+	if (discrepancy == -1) lastDevice = true;
+	if (crc8(searchAddress, 7) != searchAddress[7]) {
+		resetSearch();
+		return(false);
+	}
+	memcpy(address, searchAddress, 8);
+	return(true);
+}
+
+
+
+/* The Dallas/Maxim crc used in ROM addresses and scratchpads */
+uint8_t EvtOneWire::crc8(const uint8_t* data, uint8_t length) {
+	uint8_t crc = 0;
+	while (length--) {
+		uint8_t byte = *data++;
+		for (uint8_t i = 0; i < 8; i++) {
+			bool mix = (crc ^ byte) & 0x01;
+			crc >>= 1;
+			if (mix) crc ^= 0x8C;
+			byte >>= 1;
+		}
+	}
+	return(crc);
+}
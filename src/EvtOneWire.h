@@ -0,0 +1,78 @@
+#ifndef _EVTONEWIRE_h
+#define _EVTONEWIRE_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Standard speed slot timing in us
+#define ONEWIRE_RESET_LOW 480   // The master pulls the bus low this long to reset
+#define ONEWIRE_RESET_WAIT 480   // Time after the reset for the presence pulse. It must be over before the next slot
+#define ONEWIRE_PRESENCE_MIN 60   // Shortest and longest presence pulse from a device
+#define ONEWIRE_PRESENCE_MAX 240
+#define ONEWIRE_SLOT_1_LOW 6   // Writing a 1 and reading both start with a short low pulse
+#define ONEWIRE_SLOT_1_HIGH 64
+#define ONEWIRE_SLOT_0_LOW 60
+#define ONEWIRE_SLOT_0_HIGH 10
+#define ONEWIRE_READ_THRESHOLD 15   // A read slot that is low for less than this is a 1. A device holds the bus low longer for a 0
+
+// ROM commands
+#define ONEWIRE_SEARCH_ROM 0xF0
+#define ONEWIRE_ALARM_SEARCH 0xEC
+#define ONEWIRE_MATCH_ROM 0x55
+#define ONEWIRE_SKIP_ROM 0xCC
+
+
+
+/*	A pulse on the bus: the line is at level0 for duration0 and then at level1 for duration1 (in us). It has the same
+	layout as an RMT item, so RMT buffers can be used as they are
+*/
+struct OneWireSymbol {
+	uint32_t duration0 : 15;
+	uint32_t level0 : 1;
+	uint32_t duration1 : 15;
+	uint32_t level1 : 1;
+};
+
+
+
+/*	Turns onewire slots into symbols and back. There is no hardware in here, so it can be tested with recorded waveforms.
+	Every slot is one symbol: the low pulse and the high time until the next slot
+*/
+class OneWireCodec {
+public:
+	static void encodeReset(OneWireSymbol* symbol);
+	static void encodeBits(const uint8_t* data, uint16_t bitCount, OneWireSymbol* symbols);
+	static bool decodePresence(const OneWireSymbol* symbols, size_t count);
+	static bool decodeBits(const OneWireSymbol* symbols, size_t count, uint8_t* data, uint16_t bitCount);
+};
+
+
+
+/*	A onewire bus. A backend only has to make a reset and a number of slots. The ROM commands, search and byte reads and
+	writes are done here on top of that
+*/
+class EvtOneWire {
+private:
+	uint8_t searchAddress[8];
+	int8_t lastDiscrepancy = -1;   // The bit where the last search took the 1 branch. -1 before the first search
+	bool lastDevice = false;
+public:
+	virtual ~EvtOneWire() {}
+	virtual bool reset() = 0;   // Returns true if a device answered with a presence pulse
+	virtual bool touchBits(const uint8_t* out, uint8_t* in, uint16_t bitCount) = 0;   // Writes bitCount bits. A 1 is also a read slot, and what was read goes to in
+	virtual void writeByte(uint8_t value, bool power = false);
+	virtual void depower() {}
+	virtual bool supportsPower() { return(false); }   // True if writeByte() can power parasite devices
+	uint8_t readByte();
+	void write(const uint8_t* data, uint16_t length);
+	void read(uint8_t* data, uint16_t length);
+	bool readBit();
+	void select(const uint8_t* address);
+	void skip();
+	void resetSearch();
+	bool search(uint8_t* address, bool alarmOnly = false);
+	static uint8_t crc8(const uint8_t* data, uint8_t length);
+};
+
+#endif
@@ -0,0 +1,56 @@
+#include "EvtOneWireBitBang.h"
+
+
+
+EvtOneWireBitBang::EvtOneWireBitBang(uint8_t pinNumber) : oneWire(pinNumber) {
+}
+
+
+
+bool EvtOneWireBitBang::reset() {
+	return(oneWire.reset() == 1);
+}
+
+
+
+/*	Makes the slots one at the time. Parameters:
+	out: the bits to write, least significant first. A 1 is also a read slot
+	in: filled with the bits read. It may be the same buffer as out. nullptr if we don't need them
+	bitCount: the number of slots
+*/
+bool EvtOneWireBitBang::touchBits(const uint8_t* out, uint8_t* in, uint16_t bitCount) {
+	for (uint16_t i = 0; i < bitCount; i++) {
+		bool bit = (out[i / 8] >> (i % 8)) & 1;
+		if (bit) {
+			bit = oneWire.read_bit();
+		} else {
+			oneWire.write_bit(0);
+		}
+		if (in == nullptr) continue;
+		if (bit) {
+			in[i / 8] |= 1 << (i % 8);
+		} else {
+			in[i / 8] &= ~(1 << (i % 8));
+		}
+	}
+	return(true);
+}
+
+
+
+/* The OneWire library drives the bus high right after the last bit when power is needed */
+void EvtOneWireBitBang::writeByte(uint8_t value, bool power) {
+	oneWire.write(value, power);
+}
+
+
+
+void EvtOneWireBitBang::depower() {
+	oneWire.depower();
+}
+
+
+
+bool EvtOneWireBitBang::supportsPower() {
+	return(true);
+}
@@ -0,0 +1,25 @@
+#ifndef _EVTONEWIREBITBANG_h
+#define _EVTONEWIREBITBANG_h
+
+#include <Arduino.h>
+#include "EvtOneWire.h"
+#include <OneWire.h> // use the one for ESP32 here: https://github.com/stickbreaker/OneWire. See this thread: https://github.com/espressif/arduino-esp32/issues/755
+
+
+
+/*	A onewire bus that is bit-banged by the CPU with the OneWire library. Interrupts are off during each slot. It works on
+	any pin and supports parasite powered devices
+*/
+class EvtOneWireBitBang : public EvtOneWire {
+private:
+	OneWire oneWire;
+public:
+	EvtOneWireBitBang(uint8_t pinNumber);
+	bool reset();
+	bool touchBits(const uint8_t* out, uint8_t* in, uint16_t bitCount);
+	void writeByte(uint8_t value, bool power = false);
+	void depower();
+	bool supportsPower();
+};
+
+#endif
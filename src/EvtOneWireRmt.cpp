@@ -0,0 +1,149 @@
+#include "EvtOneWireRmt.h"
+#include "EvtLogger.h"
+
+
+uint8_t EvtOneWireRmt::usedChannels = 0;
+portMUX_TYPE EvtOneWireRmt::mux = portMUX_INITIALIZER_UNLOCKED;
+
+static_assert(sizeof(OneWireSymbol) == sizeof(rmt_item32_t), "OneWireSymbol must have the layout of an RMT item");
+
+
+
+/* Gives the RMT channels back and lets go of the pin, so it can be bit-banged */
+EvtOneWireRmt::~EvtOneWireRmt() {
+	end();
+}
+
+
+
+/*	Sets up 2 RMT channels for a bus. Parameters:
+	pinNumber: the pin of the bus. It needs a pull-up resistor
+	Returns false if there are no free RMT channels, or they could not be set up. Then nothing is left installed
+*/
+bool EvtOneWireRmt::begin(uint8_t pinNumber) {
+	pin = pinNumber;
+	portENTER_CRITICAL(&mux);
+	for (uint8_t channel = 0; channel + 1 < RMT_CHANNEL_MAX && !hasChannels; channel += 2) {   // A free pair
+		if (usedChannels & (3 << channel)) continue;
+		usedChannels |= 3 << channel;
+		txChannel = (rmt_channel_t)channel;
+		rxChannel = (rmt_channel_t)(channel + 1);
+		hasChannels = true;
+	}
+	portEXIT_CRITICAL(&mux);
+	if (!hasChannels) {
+		logger.send(WARN, "OWR", "No free RMT channels for bus %d", pinNumber);
+		return(false);
+	}
+
+	rmt_config_t txConfig = RMT_DEFAULT_CONFIG_TX((gpio_num_t)pinNumber, txChannel);
+	txConfig.clk_div = 80;   // 1 tick is 1 us
+	txConfig.tx_config.idle_level = RMT_IDLE_LEVEL_HIGH;
+	txConfig.tx_config.idle_output_en = true;
+	rmt_config_t rxConfig = RMT_DEFAULT_CONFIG_RX((gpio_num_t)pinNumber, rxChannel);
+	rxConfig.clk_div = 80;
+	rxConfig.rx_config.idle_threshold = ONEWIRE_RMT_IDLE;
+	rxConfig.rx_config.filter_en = true;
+	rxConfig.rx_config.filter_ticks_thresh = 30;   // Spikes shorter than 30 APB clocks are ignored
+
+	txInstalled = rmt_config(&txConfig) == ESP_OK && rmt_driver_install(txChannel, 0, 0) == ESP_OK;
+	rxInstalled = txInstalled && rmt_config(&rxConfig) == ESP_OK && rmt_driver_install(rxChannel, ONEWIRE_RMT_RX_BUFFER, 0) == ESP_OK;
+	if (!rxInstalled) {
+		logger.send(ERR, "OWR", "Could not set up RMT for bus %d", pinNumber);
+		end();   // What was installed is taken down again
+		return(false);
+	}
+	rmt_get_ringbuf_handle(rxChannel, &ringbuffer);
+
+	// Both channels on the same pin. Open drain, so the devices can pull the bus low while we release it
+	rmt_set_gpio(rxChannel, RMT_MODE_RX, (gpio_num_t)pinNumber, false);
+	rmt_set_gpio(txChannel, RMT_MODE_TX, (gpio_num_t)pinNumber, false);
+	PIN_INPUT_ENABLE(GPIO_PIN_MUX_REG[pinNumber]);
+	GPIO.pin[pinNumber].pad_driver = 1;
+	ready = true;
+	return(true);
+}
+
+
+
+/* Uninstalls the RMT drivers that were installed, detaches the pin from the RMT and frees the channels */
+void EvtOneWireRmt::end() {
+	ready = false;
+	if (txInstalled) rmt_driver_uninstall(txChannel);
+	if (rxInstalled) rmt_driver_uninstall(rxChannel);
+	if (txInstalled || rxInstalled) gpio_reset_pin((gpio_num_t)pin);   // The pin goes back to plain GPIO
+	txInstalled = false;
+	rxInstalled = false;
+	ringbuffer = NULL;
+	if (hasChannels) {
+		portENTER_CRITICAL(&mux);
+		usedChannels &= ~(3 << txChannel);
+		portEXIT_CRITICAL(&mux);
+		hasChannels = false;
+	}
+}
+
+
+
+/*	Sends the symbols in txSymbols while recording the line into rxSymbols. Parameters:
+	count: the number of symbols to send
+	receivedCount: set to the number of symbols recorded
+	Returns false if nothing was recorded
+*/
+bool EvtOneWireRmt::transfer(uint16_t count, size_t &receivedCount) {
+	size_t length;
+	void* items;
+	while ((items = xRingbufferReceive(ringbuffer, &length, 0)) != NULL) vRingbufferReturnItem(ringbuffer, items);   // Old recordings
+
+	rmt_rx_start(rxChannel, true);
+	rmt_write_items(txChannel, (const rmt_item32_t*)txSymbols, count, true);   // The task sleeps until they are sent
+	items = xRingbufferReceive(ringbuffer, &length, pdMS_TO_TICKS(ONEWIRE_RMT_TIMEOUT));   // The recording ends when the line has been idle for ONEWIRE_RMT_IDLE
+	rmt_rx_stop(rxChannel);
+	if (items == NULL) return(false);
+
+	receivedCount = length / sizeof(OneWireSymbol);
+	if (receivedCount > ONEWIRE_RMT_MAX_BITS + 2) receivedCount = ONEWIRE_RMT_MAX_BITS + 2;
+	memcpy(rxSymbols, items, receivedCount * sizeof(OneWireSymbol));
+	vRingbufferReturnItem(ringbuffer, items);
+	return(true);
+}
+
+
+
+bool EvtOneWireRmt::reset() {
+	if (!ready) return(false);
+	size_t receivedCount;
+	OneWireCodec::encodeReset(txSymbols);
+	return(transfer(1, receivedCount) && OneWireCodec::decodePresence(rxSymbols, receivedCount));
+}
+
+
+
+/*	Makes the slots in chunks of ONEWIRE_RMT_MAX_BITS. Parameters:
+	out: the bits to write, least significant first. A 1 is also a read slot
+	in: filled with the bits read. It may be the same buffer as out. nullptr if we don't need them
+	bitCount: the number of slots
+	Returns false if the line could not be recorded
+*/
+bool EvtOneWireRmt::touchBits(const uint8_t* out, uint8_t* in, uint16_t bitCount) {
+	if (!ready) return(false);
+	for (uint16_t start = 0; start < bitCount; start += ONEWIRE_RMT_MAX_BITS) {   // ONEWIRE_RMT_MAX_BITS is a whole number of bytes
+		uint16_t chunk = bitCount - start < ONEWIRE_RMT_MAX_BITS ? bitCount - start : ONEWIRE_RMT_MAX_BITS;
+		size_t receivedCount;
+		OneWireCodec::encodeBits(out + start / 8, chunk, txSymbols);
+		if (!transfer(chunk, receivedCount)) return(false);
+		if (in == nullptr) continue;
+
+		uint8_t bits[ONEWIRE_RMT_MAX_BITS / 8];
+		if (!OneWireCodec::decodeBits(rxSymbols, receivedCount, bits, chunk)) return(false);
+		for (uint16_t i = 0; i < chunk; i++) {   // Only the bits of the chunk are changed in the callers buffer
+			uint16_t bit = start + i;
+			if ((bits[i / 8] >> (i % 8)) & 1) {
+				in[bit / 8] |= 1 << (bit % 8);
+			} else {
+				in[bit / 8] &= ~(1 << (bit % 8));
+			}
+		}
+	}
+	return(true);
+}
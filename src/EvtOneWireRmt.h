@@ -0,0 +1,45 @@
+#ifndef _EVTONEWIRERMT_h
+#define _EVTONEWIRERMT_h
+
+#include <Arduino.h>
+#include "EvtOneWire.h"
+#include <driver/rmt.h>
+#include <driver/gpio.h>
+#include <freertos/ringbuf.h>
+
+#define ONEWIRE_RMT_MAX_BITS 56   // Slots in one transfer. It must fit in one RMT memory block of 64 symbols
+#define ONEWIRE_RMT_IDLE 100   // us without an edge that ends a receive
+#define ONEWIRE_RMT_TIMEOUT 50   // ms to wait for the received symbols
+#define ONEWIRE_RMT_RX_BUFFER 1024   // Bytes in the receive ring buffer
+
+
+
+/*	A onewire bus made by the RMT peripheral. One RMT channel sends the slots and another records the line, both on the same
+	open drain pin. The task sleeps while the slots are sent, and interrupts are never turned off. Each bus uses 2 of the 8
+	RMT channels. Parasite power is not supported, because the pin can't drive the bus high. The channels are given back
+	when the bus is destroyed, so another bus can use them
+*/
+class EvtOneWireRmt : public EvtOneWire {
+private:
+	static uint8_t usedChannels;   // A bit for each RMT channel that belongs to a bus
+	static portMUX_TYPE mux;   // Around usedChannels. Buses may be added from several tasks at once
+	rmt_channel_t txChannel;
+	rmt_channel_t rxChannel;
+	uint8_t pin;
+	bool hasChannels = false;
+	bool txInstalled = false;
+	bool rxInstalled = false;
+	RingbufHandle_t ringbuffer = NULL;
+	bool ready = false;
+	OneWireSymbol txSymbols[ONEWIRE_RMT_MAX_BITS];
+	OneWireSymbol rxSymbols[ONEWIRE_RMT_MAX_BITS + 2];
+	bool transfer(uint16_t count, size_t &receivedCount);
+	void end();
+public:
+	~EvtOneWireRmt();
+	bool begin(uint8_t pinNumber);
+	bool reset();
+	bool touchBits(const uint8_t* out, uint8_t* in, uint16_t bitCount);
+};
+
+#endif
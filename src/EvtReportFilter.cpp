@@ -0,0 +1,72 @@
+#include "EvtReportFilter.h"
+
+
+
+/*	Adds a reading and decides if it should be reported. Parameters:
+	settings: the report options
+	value: the new reading
+	now: the time of the reading in ms
+	report: set to the value to report. It's the smoothed value
+	Returns true if the value should be reported
+*/
+bool EvtReportFilter::update(const ReportSettings &settings, float value, unsigned long now, float &report) {
+	float smoothed = smooth(settings, value);
+
+	bool due;
+	if (!reported) {   // The first reading is always reported
+		due = true;
+	} else {
+		unsigned long sinceReport = now - lastReportTime;
+		float band = fmaxf(settings.deadband, settings.relativeDeadband * fabsf(lastReported));
+		bool changed = band > 0 ? fabsf(smoothed - lastReported) > band : smoothed != lastReported;
+		due = (changed && sinceReport >= 1000UL * settings.minInterval) || (settings.heartbeat > 0 && sinceReport >= 1000UL * settings.heartbeat);
+	}
+	if (!due) return(false);
+
+	lastReported = smoothed;
+	lastReportTime = now;
+	reported = true;
+	report = smoothed;
+	return(true);
+}
+
+
+
+/* Forgets the readings and the last report. The next reading is reported. Used when a sensor comes back after being gone */
+void EvtReportFilter::reset() {
+	sampleCount = 0;
+	nextSample = 0;
+	reported = false;
+}
+
+
+
+/*	Applies the smoothing of the settings to a new reading. Parameters:
+	settings: the report options
+	value: the new reading
+	Returns the smoothed value
+*/
+float EvtReportFilter::smooth(const ReportSettings &settings, float value) {
+	if (settings.smoothing == SMOOTH_EMA) {
+		average = sampleCount == 0 ? value : average + settings.emaFactor * (value - average);
+		sampleCount = 1;
+		return(average);
+	}
+	if (settings.smoothing != SMOOTH_MEDIAN) return(value);
+
+	uint8_t window = constrain(settings.medianWindow, 1, REPORT_MEDIAN_MAX);
+	if (sampleCount > window) sampleCount = window;   // The window was made smaller
+	if (nextSample >= window) nextSample = 0;
+	samples[nextSample] = value;
+	nextSample = (nextSample + 1) % window;
+	if (sampleCount < window) sampleCount++;
+
+	float sorted[REPORT_MEDIAN_MAX];   // A few values. Insertion sort is fine
+	for (uint8_t i = 0; i < sampleCount; i++) {
+		uint8_t j = i;
+		for (; j > 0 && sorted[j - 1] > samples[i]; j--) sorted[j] = sorted[j - 1];
+		sorted[j] = samples[i];
+	}
+	if (sampleCount % 2 == 1) return(sorted[sampleCount / 2]);
+	return((sorted[sampleCount / 2 - 1] + sorted[sampleCount / 2]) / 2);
+}
@@ -0,0 +1,59 @@
+#ifndef _EVTREPORTFILTER_h
+#define _EVTREPORTFILTER_h
+
+#include <Arduino.h>
+
+#define REPORT_MEDIAN_MAX 7   // Max number of readings in a median window
+
+
+
+// How readings are smoothed before they are compared with the last reported value
+enum ReportSmoothing {
+	SMOOTH_NONE,
+	SMOOTH_MEDIAN,   // The median of the last medianWindow readings. Removes single spikes
+	SMOOTH_EMA   // Exponential moving average. Removes noise, but lags behind real changes
+};
+
+
+/*	When a reading is worth a callback. All the options are independent, and the defaults report every change of value:
+	deadband:			a value is only reported when it's more than this away from the last reported value. Because the
+						band follows the reported value, a value that wanders around the edge doesn't give a stream of reports
+	relativeDeadband:	the same as a fraction of the last reported value. 0.01 is 1%. The larger of the two bands is used
+	minInterval:		seconds. Changes are held back until this long after the last report
+	heartbeat:			seconds. The value is reported after this long even if it hasn't changed. 0 turns it off
+	smoothing:			the filter applied to the readings before the change test
+	medianWindow:		readings in the median. Max REPORT_MEDIAN_MAX
+	emaFactor:			the weight of a new reading in the EMA. 0 to 1. Lower is smoother
+*/
+struct ReportSettings {
+	float deadband = 0;
+	float relativeDeadband = 0;
+	uint16_t minInterval = 0;
+	uint16_t heartbeat = 0;
+	ReportSmoothing smoothing = SMOOTH_NONE;
+	uint8_t medianWindow = 5;
+	float emaFactor = 0.3;
+};
+
+
+
+/*	Decides which readings of a value are reported. It keeps the smoothing state and the last reported value of one
+	sensor. There is no hardware or task in here, so any module with a stream of readings can use it.
+*/
+class EvtReportFilter {
+private:
+	float samples[REPORT_MEDIAN_MAX];
+	uint8_t sampleCount = 0;
+	uint8_t nextSample = 0;
+	float average;
+	float lastReported;
+	unsigned long lastReportTime;
+	bool reported = false;
+
+	float smooth(const ReportSettings &settings, float value);
+public:
+	bool update(const ReportSettings &settings, float value, unsigned long now, float &report);
+	void reset();
+};
+
+#endif
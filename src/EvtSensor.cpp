@@ -0,0 +1,84 @@
+#include "EvtSensor.h"
+
+
+EvtSlotMap<SensorSlot, SENSOR_MAX_DRIVERS> EvtSensor::slotList;
+TaskHandle_t EvtSensor::taskHandle = NULL;
+portMUX_TYPE EvtSensor::mux = portMUX_INITIALIZER_UNLOCKED;
+
+
+
+/*	Adds a driver to the scheduler. The task is started with the first driver. The driver is started at once. Parameters:
+	driver: the driver. It must live for the rest of the program
+*/
+void EvtSensor::add(EvtSensorDriver* driver) {
+	SensorSlot slot;
+	slot.driver = driver;
+	portENTER_CRITICAL(&mux);   // Drivers may be added from several tasks at once
+	bool added = slotList.add(slot) != nullptr;
+	portEXIT_CRITICAL(&mux);
+	if (!added) {
+		logger.send(ERR, "SNS", "No room for sensor driver %s. Raise SENSOR_MAX_DRIVERS", driver->getName());
+		return;
+	}
+	logger.send(DEBUG, "SNS", "Added sensor driver %s", driver->getName());
+
+	if (taskHandle == NULL) {
+		logger.send(DEBUG, "SNS", "Starting sensor task");
+		EvtAlloc::createTask(
+			TaskSensor,				// Task to run
+			"SensorTask",			// Name of the task
+			SENSOR_STACK_SIZE,		// Stack size in words
+			NULL,					// Parameters for the task
+			1,						// Priority of the task
+			&taskHandle);			// Used to wake the task when a driver is added
+	} else {
+		wakeup();
+	}
+}
+
+
+
+/* Makes the task look at all drivers at once. Used when a driver has changed its settings */
+void EvtSensor::wakeup() {
+	if (taskHandle != NULL) xTaskNotifyGive(taskHandle);
+}
+
+
+
+/*	The task that runs the drivers. First it starts the conversions that are due, then it reads the drivers whose
+	conversions are done, and then it sleeps until the next deadline.
+	This has to be a static method because eps32 tasks can't call an instance member of a class!
+*/
+void EvtSensor::TaskSensor(void *pvParameters) {
+	while (true) {
+		unsigned long sleepTime = 1000UL * 3600;
+		for (SensorSlot &slot : slotList) {   // Start conversions on all the drivers that are due
+			if (slot.converting) continue;
+			unsigned long untilMaintain = slot.driver->maintain();   // Between conversions, so it doesn't disturb them
+			if (untilMaintain < sleepTime) sleepTime = untilMaintain;
+			if (!slot.started || millis() - slot.lastStarted >= slot.driver->getInterval()) {
+				slot.converting = slot.driver->start();
+				slot.lastStarted = millis();
+				slot.started = true;
+			}
+		}
+
+		for (SensorSlot &slot : slotList) {   // Read the drivers that are done, and find the next deadline
+			if (!slot.started) {   // Added while we were busy
+				sleepTime = 0;
+				continue;
+			}
+			unsigned long sinceStarted = millis() - slot.lastStarted;
+			if (slot.converting && sinceStarted >= slot.driver->getConversionTime()) {
+				slot.driver->read();
+				slot.converting = false;
+				sleepTime = 0;   // Go round again, so maintain() is asked when it's due
+				continue;
+			}
+			unsigned long deadline = slot.converting ? slot.driver->getConversionTime() : slot.driver->getInterval();
+			unsigned long untilDeadline = sinceStarted < deadline ? deadline - sinceStarted : 0;
+			if (untilDeadline < sleepTime) sleepTime = untilDeadline;
+		}
+		ulTaskNotifyTake(pdTRUE, sleepTime / portTICK_PERIOD_MS + 1);   // Sleeps until the next deadline, or a driver is added
+	}
+}
@@ -0,0 +1,59 @@
+#ifndef _EVTSENSOR_h
+#define _EVTSENSOR_h
+
+#include <Arduino.h>
+#include "EvtLogger.h"
+#include "EvtAlloc.h"
+#include "EvtSlotMap.h"
+
+#define SENSOR_STACK_SIZE 5000
+#define SENSOR_MAX_DRIVERS 8
+
+
+
+/*	A sensor driver. It's one bus or device that is measured over and over. The scheduler calls the steps, and the driver
+	never waits for a conversion itself:
+	maintain():				called between conversions. Housekeeping like searching a bus. Returns ms until it wants to be called again
+	start():				starts a conversion. Returns false if there is nothing to measure this time
+	getConversionTime():	ms from start() until the result can be read
+	read():					reads the result and does the callbacks
+	getInterval():			ms from one start() to the next
+*/
+class EvtSensorDriver {
+public:
+	virtual ~EvtSensorDriver() {}
+	virtual const char* getName() = 0;   // Used in the log
+	virtual unsigned long maintain() { return(0xFFFFFFFF); }
+	virtual bool start() = 0;
+	virtual unsigned long getConversionTime() = 0;
+	virtual void read() = 0;
+	virtual unsigned long getInterval() = 0;
+};
+
+
+// The scheduler state of a driver
+struct SensorSlot {
+	EvtSensorDriver *driver = nullptr;
+	unsigned long lastStarted = 0;
+	bool started = false;   // False until the first conversion
+	bool converting = false;
+};
+
+
+
+/*	One task that runs all sensor drivers. Conversions of all drivers that are due are started together, and each driver is
+	read when its conversion time is up. Between the deadlines the task sleeps. All the steps run in this task, so drivers
+	that share a bus never use it at the same time, and a new sensor type doesn't need a task of its own.
+*/
+class EvtSensor {
+private:
+	static EvtSlotMap<SensorSlot, SENSOR_MAX_DRIVERS> slotList;
+	static TaskHandle_t taskHandle;
+	static portMUX_TYPE mux;   // Around adding a driver
+	static void TaskSensor(void *pvParameters);
+public:
+	static void add(EvtSensorDriver* driver);
+	static void wakeup();
+};
+
+#endif
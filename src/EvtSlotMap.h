@@ -0,0 +1,112 @@
+#ifndef _EVTSLOTMAP_h
+#define _EVTSLOTMAP_h
+
+#include <stdint.h>
+
+
+
+/*	A fixed number of items in one array. It replaces the linked lists the modules used to keep their registries in:
+	- Items never move, so a pointer to an item stays good until it's removed. Nothing is allocated after boot
+	- A scan runs through one array, instead of following a pointer for each get(i)
+	- add() gives a handle. It holds the slot and a generation, so a handle of a removed item never finds a new item in its slot
+	- Removing an item only frees its slot, so it's safe to remove the current item while iterating
+	There is no lock in here. Adding and removing must not happen in two tasks at once, so a module that adds or removes
+	from more than one task does it with its own mux taken, or sends the change to its own task. Other tasks may iterate
+	without the lock, because an item is filled in before its slot is marked used.
+	Iterate like this:
+	for (Thermometer &thermometer : thermometerList) { ... }
+*/
+template<typename T, uint16_t N> class EvtSlotMap {
+public:
+	typedef uint32_t Handle;   // Generation in the upper 16 bits, slot in the lower. 0 is never a handle
+	static const Handle NO_HANDLE = 0;
+
+	class Iterator {
+	private:
+		EvtSlotMap *map;
+		uint16_t slot;
+		void skipFree() {
+			while (slot < map->highWater && !map->used[slot]) slot++;
+		}
+	public:
+		Iterator(EvtSlotMap* map, uint16_t slot) : map(map), slot(slot) { skipFree(); }
+		T& operator*() const { return(map->items[slot]); }
+		T* operator->() const { return(&map->items[slot]); }
+		Iterator& operator++() {
+			slot++;
+			skipFree();
+			return(*this);
+		}
+		bool operator!=(const Iterator &other) const { return(slot < map->highWater && slot != other.slot); }
+	};
+
+private:
+	T items[N];
+	volatile bool used[N] = {};
+	uint16_t generations[N] = {};
+	volatile uint16_t highWater = 0;   // One past the highest slot that has been used. Scans stop here
+	uint16_t count = 0;
+
+public:
+	/*	Adds a copy of an item. A free slot is reused, the lowest first, so the slot of an item is also its index. Parameters:
+		item: the item to copy in
+		Returns a pointer to the stored item, or nullptr if all N slots are used
+	*/
+	T* add(const T &item, Handle* handle = nullptr) {
+		uint16_t slot = 0;
+		while (slot < N && used[slot]) slot++;
+		if (slot == N) return(nullptr);
+		items[slot] = item;
+		generations[slot]++;
+		if (generations[slot] == 0) generations[slot] = 1;   // Keeps 0 from being a handle
+		used[slot] = true;   // Last, so a task that iterates never sees a half made item
+		if (slot >= highWater) highWater = slot + 1;
+		count++;
+		if (handle != nullptr) *handle = ((Handle)generations[slot] << 16) | slot;
+		return(&items[slot]);
+	}
+
+	/* Returns the item of a handle, or nullptr if it has been removed */
+	T* get(Handle handle) {
+		uint16_t slot = handle & 0xFFFF;
+		if (slot >= N || !used[slot] || generations[slot] != handle >> 16) return(nullptr);
+		return(&items[slot]);
+	}
+
+	/* Returns the item in a slot, or nullptr if the slot is free */
+	T* at(uint16_t slot) {
+		return(slot < highWater && used[slot] ? &items[slot] : nullptr);
+	}
+
+	/* Returns the slot of a stored item. It's the index used with at() */
+	uint16_t indexOf(const T* item) const {
+		return(item - items);
+	}
+
+	/* Removes the item of a handle. Returns false if it was already removed */
+	bool remove(Handle handle) {
+		T *item = get(handle);
+		if (item == nullptr) return(false);
+		remove(item);
+		return(true);
+	}
+
+	/* Removes a stored item. Its slot is free for a new item */
+	void remove(T* item) {
+		uint16_t slot = indexOf(item);
+		if (slot >= N || !used[slot]) return;
+		used[slot] = false;
+		count--;
+		while (highWater > 0 && !used[highWater - 1]) highWater--;
+	}
+
+	uint16_t size() const { return(count); }
+	uint16_t capacity() const { return(N); }
+	uint16_t slots() const { return(highWater); }   // Slots to check with at(). Some may be free
+	bool isFull() const { return(count == N); }
+
+	Iterator begin() { return(Iterator(this, 0)); }
+	Iterator end() { return(Iterator(this, N)); }
+};
+
+#endif
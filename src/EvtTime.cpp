@@ -1,8 +1,9 @@
 #include "EvtTime.h"
 
 
-LinkedList<TriggerIn*> EvtTime::triggerInList;
-LinkedList<TriggerEvery*> EvtTime::triggerEveryList;
+EvtSlotMap<TriggerIn, TIME_MAX_TRIGGERS> EvtTime::triggerInList;
+EvtSlotMap<TriggerEvery, TIME_MAX_TRIGGERS> EvtTime::triggerEveryList;
+portMUX_TYPE EvtTime::mux = portMUX_INITIALIZER_UNLOCKED;
 
 
 
@@ -10,7 +11,7 @@ LinkedList<TriggerEvery*> EvtTime::triggerEveryList;
 EvtTime::EvtTime() {
 	logger.send(DEBUG, "TIM", "Starting time launcher task");
 
-	xTaskCreate(
+	EvtAlloc::createTask(
 		taskTimerLauncher,		// Task function.
 		"TimerLauncher",		// Name of task.
 		TIME_LAUNCH_STACK_SIZE,			// Stack size in words
@@ -36,14 +37,27 @@ void EvtTime::taskTimerLauncher(void *pvParameters) {
 	This should be called regularly
 */
 void EvtTime::handleTriggerIn() {
-	for (uint8_t t = 0; t < triggerInList.size(); t++) {   // Go through each In-trigger in the list
-		TriggerIn *triggerIn = triggerInList.get(t);
-		unsigned long timePassed = millis() - triggerIn->startedAtMs;
-		if (timePassed >= triggerIn->ms) {   // Has the trigger been running more than the specified time?
-			logger.send(DEBUG, "TIM", "In-Trigger index %d has passed %d ms. Doing Callback", t, triggerIn->ms);
-			triggerIn->cbFunc(timePassed);   // Do the callback
-			triggerInList.remove(t);   // Trigger is not needed anymore. Discard it
-			delete(triggerIn);   // Also remove/free it from memory
+	for (uint16_t t = 0; t < triggerInList.slots(); t++) {   // Go through each In-trigger in the list
+		portENTER_CRITICAL(&mux);   // Triggers are added and removed by other tasks too
+		TriggerIn *triggerIn = triggerInList.at(t);
+		unsigned long timePassed = 0;
+		unsigned long ms = 0;
+		bool due = false;
+		TimeInCbFunc cbFunc;
+		if (triggerIn != nullptr) {
+			timePassed = millis() - triggerIn->startedAtMs;
+			ms = triggerIn->ms;
+			due = timePassed >= ms;   // Has the trigger been running more than the specified time?
+		}
+		if (due) {
+			cbFunc = triggerIn->cbFunc;
+			triggerInList.remove(triggerIn);   // Trigger is not needed anymore. Free its slot before the callback, so it may set up a new trigger
+		}
+		portEXIT_CRITICAL(&mux);
+
+		if (due) {
+			logger.send(DEBUG, "TIM", "In-Trigger index %d has passed %d ms. Doing Callback", t, ms);
+			cbFunc(timePassed);   // Do the callback
 		}
 	}
 }
@@ -54,15 +68,29 @@ void EvtTime::handleTriggerIn() {
 	This should be called regularly
 */
 void EvtTime::handleTriggerEvery() {
-	for (uint8_t t = 0; t < triggerEveryList.size(); t++) {   // Go through each Every-trigger in the list
-		TriggerEvery *triggerEvery = triggerEveryList.get(t);
-		unsigned long timePassed = millis() - triggerEvery->triggeredAtMs;
-		if (timePassed >= triggerEvery->ms) {   // Are we passed the limit since last triggering?
+	for (uint16_t t = 0; t < triggerEveryList.slots(); t++) {   // Go through each Every-trigger in the list
+		portENTER_CRITICAL(&mux);
+		TriggerEvery *triggerEvery = triggerEveryList.at(t);
+		unsigned long timePassed = 0;
+		unsigned long ms = 0;
+		unsigned long triggerCount = 0;
+		bool due = false;
+		TimeEveryCbFunc cbFunc;
+		if (triggerEvery != nullptr) {
+			timePassed = millis() - triggerEvery->triggeredAtMs;
+			ms = triggerEvery->ms;
+			due = timePassed >= ms;   // Are we passed the limit since last triggering?
+		}
+		if (due) {
 			triggerEvery->triggeredAtMs = millis();
-			triggerEvery->triggerCount++;
+			triggerCount = ++triggerEvery->triggerCount;
+			cbFunc = triggerEvery->cbFunc;   // A copy, because the trigger may be removed while we call it
+		}
+		portEXIT_CRITICAL(&mux);
 
-			logger.send(DEBUG, "TIM", "Every-trigger index %d has passed %d ms. Doing Callback", t, triggerEvery->ms);
-			triggerEvery->cbFunc(timePassed, triggerEvery->triggerCount);   // Do the callback
+		if (due) {
+			logger.send(DEBUG, "TIM", "Every-trigger index %d has passed %d ms. Doing Callback", t, ms);
+			cbFunc(timePassed, triggerCount);   // Do the callback
 		}
 	}
 }
@@ -75,12 +103,15 @@ void EvtTime::handleTriggerEvery() {
 */
 void EvtTime::triggerIn(unsigned long ms, TimeInCbFunc cbFunc) {
 	logger.send(DEBUG, "TIM", "Setup trigger to fire in %d ms", ms);
-	TriggerIn *triggerIn = new TriggerIn;
-	triggerIn->ms = ms;
-	triggerIn->cbFunc = cbFunc;
-	triggerIn->startedAtMs = millis();
-
-	triggerInList.add(triggerIn);
+	TriggerIn triggerIn;
+	triggerIn.ms = ms;
+	triggerIn.cbFunc = cbFunc;
+	triggerIn.startedAtMs = millis();
+
+	portENTER_CRITICAL(&mux);   // Other tasks and the launcher add and remove too
+	bool added = triggerInList.add(triggerIn) != nullptr;
+	portEXIT_CRITICAL(&mux);
+	if (!added) logger.send(ERR, "TIM", "No room for more In-triggers. Raise TIME_MAX_TRIGGERS");
 }
 
 
@@ -90,15 +121,20 @@ void EvtTime::triggerIn(unsigned long ms, TimeInCbFunc cbFunc) {
 	returns true if it was found and removed. Otherwise false 
 */
 bool EvtTime::triggerInRemove(unsigned long ms) {
-	for (uint8_t t = 0; t < triggerInList.size(); t++) {   // Go through each In-trigger in the list
-		TriggerIn *triggerIn = triggerInList.get(t);
-		if (triggerIn->ms == ms) {
-			triggerInList.remove(t);
-			delete(triggerIn);
-			logger.send(DEBUG, "TIM", "TriggerIn %d ms removed", ms);
-			return(true);
+	bool removed = false;
+	portENTER_CRITICAL(&mux);
+	for (TriggerIn &triggerIn : triggerInList) {   // Go through each In-trigger in the list
+		if (triggerIn.ms == ms) {
+			triggerInList.remove(&triggerIn);
+			removed = true;
+			break;
 		}
 	}
+	portEXIT_CRITICAL(&mux);
+	if (removed) {
+		logger.send(DEBUG, "TIM", "TriggerIn %d ms removed", ms);
+		return(true);
+	}
 	logger.send(ERR, "TIM", "Could not remove TriggerIn %d ms", ms);
 	return (false);
 }
@@ -111,13 +147,16 @@ bool EvtTime::triggerInRemove(unsigned long ms) {
 */
 void EvtTime::triggerEvery(unsigned long ms, TimeEveryCbFunc cbFunc) {
 	logger.send(DEBUG, "TIM", "Setup trigger to fire every %d ms", ms);
-	TriggerEvery *triggerEvery = new TriggerEvery;
-	triggerEvery->ms = ms;
-	triggerEvery->cbFunc = cbFunc;
-	triggerEvery->triggerCount = 0;
-	triggerEvery->triggeredAtMs = millis();
-
-	triggerEveryList.add(triggerEvery);
+	TriggerEvery triggerEvery;
+	triggerEvery.ms = ms;
+	triggerEvery.cbFunc = cbFunc;
+	triggerEvery.triggerCount = 0;
+	triggerEvery.triggeredAtMs = millis();
+
+	portENTER_CRITICAL(&mux);
+	bool added = triggerEveryList.add(triggerEvery) != nullptr;
+	portEXIT_CRITICAL(&mux);
+	if (!added) logger.send(ERR, "TIM", "No room for more Every-triggers. Raise TIME_MAX_TRIGGERS");
 }
 
 
@@ -127,15 +166,20 @@ void EvtTime::triggerEvery(unsigned long ms, TimeEveryCbFunc cbFunc) {
 	returns true if it was found and removed. Otherwise false
 */
 bool EvtTime::triggerEveryRemove(unsigned long ms) {
-	for (uint8_t t = 0; t < triggerEveryList.size(); t++) {   // Go through each In-trigger in the list
-		TriggerEvery *triggerEvery = triggerEveryList.get(t);
-		if (triggerEvery->ms == ms) {
-			triggerEveryList.remove(t);
-			delete(triggerEvery);
-			logger.send(DEBUG, "TIM", "TriggerEvery %d ms removed", ms);
-			return(true);
+	bool removed = false;
+	portENTER_CRITICAL(&mux);
+	for (TriggerEvery &triggerEvery : triggerEveryList) {   // Go through each Every-trigger in the list
+		if (triggerEvery.ms == ms) {
+			triggerEveryList.remove(&triggerEvery);
+			removed = true;
+			break;
 		}
 	}
+	portEXIT_CRITICAL(&mux);
+	if (removed) {
+		logger.send(DEBUG, "TIM", "TriggerEvery %d ms removed", ms);
+		return(true);
+	}
 	logger.send(ERR, "TIM", "Could not remove TriggerEvery %d ms", ms);
 	return (false);
 }
\ No newline at end of file
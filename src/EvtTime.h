@@ -2,18 +2,21 @@
 #define _EVTTIME_h
 
 #include <time.h>
-#include "LinkedList.h"
 #include "EvtLogger.h"
+#include "EvtAlloc.h"
+#include "EvtCallback.h"
+#include "EvtSlotMap.h"
 
 
 #define TIME_LAUNCH_STACK_SIZE 10000
+#define TIME_MAX_TRIGGERS 16   // Of each kind
 
 
-typedef void(*TimeInCbFunc) (unsigned long msPassed); // Define callback function
-typedef void(*TimeEveryCbFunc) (unsigned long msPassed, unsigned long triggerCount); // Define callback function
+typedef EvtCallback<void(unsigned long msPassed)> TimeInCbFunc; // Define callback function
+typedef EvtCallback<void(unsigned long msPassed, unsigned long triggerCount)> TimeEveryCbFunc; // Define callback function
 
 
-/* Each In-trigger is kept in this struct. A linked list of these are kept for storing many triggers */
+/* Each In-trigger is kept in this struct. A slot map of these are kept for storing many triggers */
 struct TriggerIn {
 	unsigned long ms;
 	TimeInCbFunc cbFunc;
@@ -21,7 +24,7 @@ struct TriggerIn {
 };
 
 
-/* Each In-trigger is kept in this struct. A linked list of these are kept for storing many triggers */
+/* Each Every-trigger is kept in this struct. A slot map of these are kept for storing many triggers */
 struct TriggerEvery {
 	unsigned long ms;
 	TimeEveryCbFunc cbFunc;
@@ -33,8 +36,9 @@ struct TriggerEvery {
 
 class EvtTime {
 private:
-	static LinkedList<TriggerIn*> triggerInList;
-	static LinkedList<TriggerEvery*> triggerEveryList;
+	static EvtSlotMap<TriggerIn, TIME_MAX_TRIGGERS> triggerInList;
+	static EvtSlotMap<TriggerEvery, TIME_MAX_TRIGGERS> triggerEveryList;
+	static portMUX_TYPE mux;   // Around add and remove, which are done by user tasks and the launcher
 
 	static void taskTimerLauncher(void *pvParameters);
 	static void handleTriggerIn();
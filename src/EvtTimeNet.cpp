@@ -1,10 +1,13 @@
 #include "EvtTimeNet.h"
 
-LinkedList<TriggerAt*> EvtTimeNet::triggerAtList;
-LinkedList<TriggerAtMinute*> EvtTimeNet::triggerAtMinuteList;
+EvtSlotMap<TriggerAt, TIMENET_MAX_TRIGGERS> EvtTimeNet::triggerAtList;
+EvtSlotMap<TriggerAtMinute, TIMENET_MAX_TRIGGERS> EvtTimeNet::triggerAtMinuteList;
+portMUX_TYPE EvtTimeNet::mux = portMUX_INITIALIZER_UNLOCKED;
 tm EvtTimeNet::curTime;
 uint32_t EvtTimeNet::curSecSinceMidnight;
 bool EvtTimeNet::rtcSynced;
+TaskHandle_t EvtTimeNet::syncTaskHandle = NULL;
+volatile bool EvtTimeNet::wifiReconnected = false;
 
 
 
@@ -12,7 +15,7 @@ bool EvtTimeNet::rtcSynced;
 EvtTimeNet::EvtTimeNet() {
 	logger.send(DEBUG, "TIM", "Starting net time launcher task");
 
-	xTaskCreate(
+	EvtAlloc::createTask(
 		taskNetTimerLauncher,		// Task function.
 		"NetTimerLauncher",		// Name of task.
 		TIME_NETLAUNCH_STACK_SIZE,			// Stack size in words
@@ -36,7 +39,7 @@ void EvtTimeNet::taskNetTimerLauncher(void *pvParameters) {
 
 
 /*  This task is responsible for getting NTP time and sync the RTC to it. At certain intervals it will resync
-	because the local RTC is not so precise */
+	because the local RTC is not so precise. When wifi connects it's woken up, so a missing time is synced at once */
 void EvtTimeNet::taskTimeSync(void *pvParameters) {
 	EvtTimeNet inst = *((EvtTimeNet*)pvParameters);   // We are inside static method. We need to be able to reference the instance.
 
@@ -45,10 +48,12 @@ void EvtTimeNet::taskTimeSync(void *pvParameters) {
 
 	while (true) {
 		inst.updateTimeFromRtc();   // Keep the current time updated about once every 100ms. We only need 1sec accuracy for triggers so this should be sufficient.
+		bool reconnected = wifiReconnected;
+		wifiReconnected = false;
 
-		if (WiFi.status() == WL_CONNECTED) {   // Only if we are connected on wifi it makes sense to sync the clock
+		if (EvtWiFi::isConnected()) {   // Only if we are connected on wifi it makes sense to sync the clock
 			if (!rtcSynced) {   // We don't have a valid time in the RTC
-				if (millis() - lastSynced > 1000UL * TIME_RETRY_INTERVAL || justBooted) {   // Every X sec we try syncing time until we succeed
+				if (millis() - lastSynced > 1000UL * TIME_RETRY_INTERVAL || justBooted || reconnected) {   // Every X sec we try syncing time until we succeed
 					logger.send(WARN, "TIM", "RTC time not valid. trying sync from NTP server %s", inst._ntpServer);
 					configTime(inst._gmtOffsetSec, inst._daylightOffsetSec, inst._ntpServer);
 					inst.updateTimeFromRtc();
@@ -67,7 +72,17 @@ void EvtTimeNet::taskTimeSync(void *pvParameters) {
 				}
 			}
 		}
-		vTaskDelay(100 / portTICK_PERIOD_MS);
+		ulTaskNotifyTake(pdTRUE, TIME_TRIGGER_RESOLUTION / portTICK_PERIOD_MS);   // Sleeps 100ms, or until wifi connects
+	}
+}
+
+
+
+/* Called by EvtWiFi when wifi connects or disconnects. Wakes up the sync task when we get connected */
+void EvtTimeNet::wifiChanged(bool connected) {
+	if (connected && syncTaskHandle != NULL) {
+		wifiReconnected = true;
+		xTaskNotifyGive(syncTaskHandle);
 	}
 }
 
@@ -91,8 +106,13 @@ void EvtTimeNet::updateTimeFromRtc() {
 	This should be called regularly more often than every second, because we have a 1 second resolution on our At-trigger */
 void EvtTimeNet::handleTriggerAt() {
 	if (rtcSynced) {   // Only if we have a valid RTC time it makes sense to do triggers
-		for (uint8_t t = 0; t < triggerAtList.size(); t++) {   // Go through each At-trigger in the list
-			TriggerAt *ta = triggerAtList.get(t);
+		for (uint8_t t = 0; t < triggerAtList.slots(); t++) {   // Go through each At-trigger in the list
+			portENTER_CRITICAL(&mux);   // Triggers are added and removed by other tasks
+			TriggerAt *ta = triggerAtList.at(t);
+			if (ta == nullptr) {   // A free slot
+				portEXIT_CRITICAL(&mux);
+				continue;
+			}
 			if (ta->justAdded) {   // If it's the first time we handle the trigger, we need to see if current time is before or after the trigger time
 				if (curSecSinceMidnight >= ta->secAfterMidnight) {
 					ta->triggeredDay = curTime.tm_mday;
@@ -102,10 +122,18 @@ void EvtTimeNet::handleTriggerAt() {
 
 				ta->justAdded = false;
 			}
-			if (ta->triggeredDay != curTime.tm_mday && curSecSinceMidnight >= ta->secAfterMidnight ) {   // If we havn't triggered today and trigger time is reached
-				logger.send(DEBUG, "TIM", "At-Trigger index %d has passed %02d:%02d:%02d. Doing Callback", t, ta->time.hour, ta->time.minute, ta->time.second);
-				ta->cbFunc(ta->time, ++ta->triggerCount);   // Do the callback
+			bool due = ta->triggeredDay != curTime.tm_mday && curSecSinceMidnight >= ta->secAfterMidnight;   // If we havn't triggered today and trigger time is reached
+			TriggerAt fired;
+			if (due) {
 				ta->triggeredDay = curTime.tm_mday;   // We did a trigger today. No more today...
+				ta->triggerCount++;
+				fired = *ta;   // A copy, because the trigger may be removed while we call it
+			}
+			portEXIT_CRITICAL(&mux);
+
+			if (due) {
+				logger.send(DEBUG, "TIM", "At-Trigger index %d has passed %02d:%02d:%02d. Doing Callback", t, fired.time.hour, fired.time.minute, fired.time.second);
+				fired.cbFunc(fired.time, fired.triggerCount);   // Do the callback
 			}
 		}
 	}
@@ -117,8 +145,13 @@ void EvtTimeNet::handleTriggerAt() {
 	This should be called regularly, because we have a 1 minute resolution on our At-trigger */
 void EvtTimeNet::handleTriggerAtMinute() {
 	if (rtcSynced) {   // Only if we have a valid RTC time it makes sense to do triggers
-		for (uint8_t t = 0; t < triggerAtMinuteList.size(); t++) {   // Go through each AtMinute-trigger in the list
-			TriggerAtMinute *tam = triggerAtMinuteList.get(t);
+		for (uint8_t t = 0; t < triggerAtMinuteList.slots(); t++) {   // Go through each AtMinute-trigger in the list
+			portENTER_CRITICAL(&mux);
+			TriggerAtMinute *tam = triggerAtMinuteList.at(t);
+			if (tam == nullptr) {   // A free slot
+				portEXIT_CRITICAL(&mux);
+				continue;
+			}
 			if (tam->justAdded) {   // If it's the first time we handle the trigger, we need to see if current time is before or after the trigger time
 				if (curTime.tm_min == tam->minute) {
 					tam->triggeredHour = curTime.tm_hour;
@@ -128,10 +161,18 @@ void EvtTimeNet::handleTriggerAtMinute() {
 
 				tam->justAdded = false;
 			}
-			if (tam->triggeredHour != curTime.tm_hour && curTime.tm_min == tam->minute) {   // If we havn't triggered this hour and trigger minute is reached
-				logger.send(DEBUG, "TIM", "AtMinute-Trigger index %d has reached minute %d. Doing Callback", t, tam->minute);
-				tam->cbFunc(tam->minute, ++tam->triggerCount);   // Do the callback
+			bool due = tam->triggeredHour != curTime.tm_hour && curTime.tm_min == tam->minute;   // If we havn't triggered this hour and trigger minute is reached
+			TriggerAtMinute fired;
+			if (due) {
 				tam->triggeredHour = curTime.tm_hour;   // We did a trigger this day. No more this hour...
+				tam->triggerCount++;
+				fired = *tam;
+			}
+			portEXIT_CRITICAL(&mux);
+
+			if (due) {
+				logger.send(DEBUG, "TIM", "AtMinute-Trigger index %d has reached minute %d. Doing Callback", t, fired.minute);
+				fired.cbFunc(fired.minute, fired.triggerCount);   // Do the callback
 			}
 		}
 	}
@@ -228,13 +269,14 @@ void EvtTimeNet::begin(long gmtOffsetSec, int daylightOffsetSec, char* ntpServer
 
 	logger.send(DEBUG, "TIM", "Starting time sync task");
 
-	xTaskCreate(
+	EvtAlloc::createTask(
 		taskTimeSync,		// Task function.
 		"TimerSync",		// Name of task.
 		TIME_SYNC_STACK_SIZE,			// Stack size in words
 		(void*)this,			// We need to give the static method TaskShowLog a reference to the instance of this class
 		1,						// Priority of the task.
-		NULL);
+		&syncTaskHandle);
+	EvtWiFi::onChange(wifiChanged);
 }
 
 
@@ -245,12 +287,15 @@ void EvtTimeNet::begin(long gmtOffsetSec, int daylightOffsetSec, char* ntpServer
 */
 void EvtTimeNet::triggerAt(TimeOnly time, TimerAtCbFunc cbFunc) {
 	logger.send(DEBUG, "TIM", "Setup trigger to fire when RTC time is %02d:%02d:%02d every day", time.hour, time.minute, time.second);
-	TriggerAt *ta = new TriggerAt{ time, cbFunc };
-	ta->triggerCount = 0;
-	ta->secAfterMidnight = getSecAfterMidnight({ time.hour, time.minute, time.second } );   // This is stored so we don't have to calculate everytime checked.
-	ta->justAdded = true;
-
-	triggerAtList.add(ta);   // Add it to the list
+	TriggerAt ta = { time, cbFunc };
+	ta.triggerCount = 0;
+	ta.secAfterMidnight = getSecAfterMidnight({ time.hour, time.minute, time.second } );   // This is stored so we don't have to calculate everytime checked.
+	ta.justAdded = true;
+
+	portENTER_CRITICAL(&mux);
+	bool added = triggerAtList.add(ta) != nullptr;
+	portEXIT_CRITICAL(&mux);
+	if (!added) logger.send(ERR, "TIM", "No room for more At-triggers. Raise TIMENET_MAX_TRIGGERS");   // Add it to the list
 }
 
 
@@ -270,15 +315,21 @@ void EvtTimeNet::triggerAt(char* time, TimerAtCbFunc cbfunc) {
 	Returns true if a trigger was found and deleted. Otherwise false
 */
 bool EvtTimeNet::triggerAtRemove(TimeOnly time) {
-	for (uint8_t t = 0; t < triggerAtList.size(); t++) {   // Go through each At-trigger in the list
-		TriggerAt *triggerAt = triggerAtList.get(t);
-		if (triggerAt->secAfterMidnight == getSecAfterMidnight(time)) {
-			triggerAtList.remove(t);
-			delete(triggerAt);
-			logger.send(DEBUG, "TIM", "TriggerAt %02d:%02d:%02d removed", time.hour, time.minute, time.second);
-			return(true);
+	uint32_t secAfterMidnight = getSecAfterMidnight(time);
+	bool removed = false;
+	portENTER_CRITICAL(&mux);
+	for (TriggerAt &triggerAt : triggerAtList) {   // Go through each At-trigger in the list
+		if (triggerAt.secAfterMidnight == secAfterMidnight) {
+			triggerAtList.remove(&triggerAt);
+			removed = true;
+			break;
 		}
 	}
+	portEXIT_CRITICAL(&mux);
+	if (removed) {
+		logger.send(DEBUG, "TIM", "TriggerAt %02d:%02d:%02d removed", time.hour, time.minute, time.second);
+		return(true);
+	}
 	logger.send(ERR, "TIM", "Could not remove TriggerAt %02d:%02d:%02d", time.hour, time.minute, time.second);
 	return (false);
 }
@@ -295,11 +346,14 @@ bool EvtTimeNet::triggerAtRemove(char* time) {
 */
 void EvtTimeNet::triggerAtMinute(uint8_t minute, TimerAtMinuteCbFunc cbFunc) {
 	logger.send(DEBUG, "TIM", "Setup trigger to fire when RTC minute is %02d every hour", minute);
-	TriggerAtMinute *tam = new TriggerAtMinute{ minute, cbFunc };
-	tam->triggerCount = 0;
-	tam->justAdded = true;
-
-	triggerAtMinuteList.add(tam);
+	TriggerAtMinute tam = { minute, cbFunc };
+	tam.triggerCount = 0;
+	tam.justAdded = true;
+
+	portENTER_CRITICAL(&mux);
+	bool added = triggerAtMinuteList.add(tam) != nullptr;
+	portEXIT_CRITICAL(&mux);
+	if (!added) logger.send(ERR, "TIM", "No room for more AtMinute-triggers. Raise TIMENET_MAX_TRIGGERS");
 }
 
 
@@ -309,15 +363,20 @@ void EvtTimeNet::triggerAtMinute(uint8_t minute, TimerAtMinuteCbFunc cbFunc) {
 	Returns true if a trigger was found and deleted. Otherwise false 
 */
 bool EvtTimeNet::triggerAtMinuteRemove(uint8_t minute) {
-	for (uint8_t t = 0; t < triggerAtMinuteList.size(); t++) {   // Go through each AtMinute-trigger in the list
-		TriggerAtMinute *triggerAtMinute = triggerAtMinuteList.get(t);
-		if (triggerAtMinute->minute == minute) {
-			triggerAtMinuteList.remove(t);
-			delete(triggerAtMinute);
-			logger.send(DEBUG, "TIM", "TriggerAtMinute at %d removed", minute);
-			return(true);
+	bool removed = false;
+	portENTER_CRITICAL(&mux);
+	for (TriggerAtMinute &triggerAtMinute : triggerAtMinuteList) {   // Go through each AtMinute-trigger in the list
+		if (triggerAtMinute.minute == minute) {
+			triggerAtMinuteList.remove(&triggerAtMinute);
+			removed = true;
+			break;
 		}
 	}
+	portEXIT_CRITICAL(&mux);
+	if (removed) {
+		logger.send(DEBUG, "TIM", "TriggerAtMinute at %d removed", minute);
+		return(true);
+	}
 	logger.send(ERR, "TIM", "Could not remove TriggerAtMinute %d", minute);
 	return (false);
 }
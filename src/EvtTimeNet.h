@@ -3,15 +3,19 @@
 
 #include "EvtTime.h"
 #include "EvtLogger.h"
+#include "EvtAlloc.h"
+#include "EvtCallback.h"
+#include "EvtSlotMap.h"
 #include <Arduino.h>
-#include "LinkedList.h"
 #include "WiFi.h"
+#include "EvtWiFi.h"
 
 #define TIME_SYNC_STACK_SIZE 2000
 #define TIME_NETLAUNCH_STACK_SIZE 5000
 #define TIME_TRIGGER_RESOLUTION 100   // how often the current time is updated in ms
 #define TIME_RETRY_INTERVAL 10   // How often we retry getting time from NTP in seconds
 #define TIME_RESYNC_INTERVAL 10   // How often the RTC is resynced from NTP server in minutes
+#define TIMENET_MAX_TRIGGERS 16   // Of each kind
 
 
 /* Definition of weekdays that can be used for comparisons */
@@ -51,11 +55,11 @@ struct TimeOnly {
 };
 
 
-typedef void(*TimerAtCbFunc) (TimeOnly time, unsigned long triggerCount); // Define callback function
-typedef void(*TimerAtMinuteCbFunc) (uint8_t minute, unsigned long triggerCount); // Define callback function
+typedef EvtCallback<void(TimeOnly time, unsigned long triggerCount)> TimerAtCbFunc; // Define callback function
+typedef EvtCallback<void(uint8_t minute, unsigned long triggerCount)> TimerAtMinuteCbFunc; // Define callback function
 
 
-/* Each At-trigger is kept in this struct. A linked list of these are kept for storing many triggers */
+/* Each At-trigger is kept in this struct. A slot map of these are kept for storing many triggers */
 struct TriggerAt {
 	TimeOnly time;
 	TimerAtCbFunc cbFunc;
@@ -66,7 +70,7 @@ struct TriggerAt {
 };
 
 
-/* Each AtMinute-trigger is kept in this struct. A linked list of these are kept for storing many triggers */
+/* Each AtMinute-trigger is kept in this struct. A slot map of these are kept for storing many triggers */
 struct TriggerAtMinute {
 	uint8_t minute;
 	TimerAtMinuteCbFunc cbFunc;
@@ -79,14 +83,18 @@ struct TriggerAtMinute {
 class EvtTimeNet : public EvtTime {
 
 private:
-	static LinkedList<TriggerAt*> triggerAtList;
-	static LinkedList<TriggerAtMinute*> triggerAtMinuteList;
+	static EvtSlotMap<TriggerAt, TIMENET_MAX_TRIGGERS> triggerAtList;
+	static EvtSlotMap<TriggerAtMinute, TIMENET_MAX_TRIGGERS> triggerAtMinuteList;
+	static portMUX_TYPE mux;   // Around the triggers, which are added and removed by user tasks
 	static tm curTime;
 	static uint32_t curSecSinceMidnight;
 	static bool rtcSynced;
+	static TaskHandle_t syncTaskHandle;
+	static volatile bool wifiReconnected;
 
 	static void taskTimeSync(void *pvParameters);
 	static void taskNetTimerLauncher(void *pvParameters);
+	static void wifiChanged(bool connected);
 
 	void handleTriggerAt();
 	void handleTriggerAtMinute();
@@ -3,6 +3,13 @@
 #include "EvtWiFi.h"
 
 
+EventGroupHandle_t EvtWiFi::eventGroup = NULL;
+portMUX_TYPE EvtWiFi::mux = portMUX_INITIALIZER_UNLOCKED;
+WiFiChangeCbFunc EvtWiFi::listeners[WIFI_MAX_LISTENERS];
+uint8_t EvtWiFi::listenerCount = 0;
+RTC_DATA_ATTR WiFiCache EvtWiFi::rtcCache;   // Survives deep sleep, so we don't even have to read NVS
+
+
 
 /*	Sets up a task that keeps connected to a WiFi AP. Parameters:
 	ssid: The AP's ssid
@@ -12,9 +19,10 @@ void EvtWiFi::begin(char* ssid, char* psk)
 {
 	_ssid = ssid;
 	_psk = psk;
+	getEventGroup();   // Starts listening for wifi events
 	logger.send(DEBUG, "WFI", "Starting Wifi Task");
 
-	xTaskCreate(
+	EvtAlloc::createTask(
 		TaskKeepConnected,		// Task function.
 		"WifiKeepConnected",	// Name of task.
 		WIFI_STACK_SIZE,	// Stack size in words 
@@ -25,41 +33,275 @@ void EvtWiFi::begin(char* ssid, char* psk)
 
 
 
-/* Returns true if we are connected to wifi. Otherwise false */
+/*	Connects straight to the AP and channel of the last good connection, without scanning. If it doesn't answer within
+	WIFI_FAST_CONNECT_TIMEOUT ms we scan as usual. Call it before begin(). Parameters:
+	reuseLease: if true the IP address from the last DHCP lease is used again without asking the DHCP server. It saves
+		a few hundred ms, but only use it if the DHCP server keeps giving us the same address
+*/
+void EvtWiFi::enableFastConnect(bool reuseLease) {
+	_fastConnect = true;
+	_reuseLease = reuseLease;
+}
+
+
+
+/*	Uses a fixed IP address instead of DHCP. Call it before begin(). Parameters:
+	ip: our address
+	gateway: the router
+	subnet: the subnet mask, like 255.255.255.0
+	dns: the name server. If not given the gateway is used
+*/
+void EvtWiFi::setStaticIp(IPAddress ip, IPAddress gateway, IPAddress subnet, IPAddress dns) {
+	_staticIp = true;
+	_ip = ip;
+	_gateway = gateway;
+	_subnet = subnet;
+	_dns = (uint32_t)dns == 0 ? gateway : dns;
+}
+
+
+
+/* Returns counters about connecting */
+WiFiStats EvtWiFi::getStats() {
+	return(stats);
+}
+
+
+
+/* Returns true if we are connected to wifi and have an IP address. Otherwise false */
 bool EvtWiFi::isConnected() {
-	return (WiFi.status() == WL_CONNECTED);
+	return((xEventGroupGetBits(getEventGroup()) & WIFI_CONNECTED_BIT) != 0);
+}
+
+
+
+/*	Blocks the calling task until we are connected. Parameters:
+	ms: the max time to wait. portMAX_DELAY waits forever
+	Returns true if we are connected
+*/
+bool EvtWiFi::waitForConnection(unsigned long ms) {
+	TickType_t ticks = ms == portMAX_DELAY ? portMAX_DELAY : pdMS_TO_TICKS(ms);
+	return((xEventGroupWaitBits(getEventGroup(), WIFI_CONNECTED_BIT, pdFALSE, pdTRUE, ticks) & WIFI_CONNECTED_BIT) != 0);
 }
 
 
 
-/* This task connects to wifi. If we loose the connection it reconnects */
+/*	Returns the event group with the connection state (WIFI_CONNECTED_BIT and WIFI_DISCONNECTED_BIT). The first call creates it
+	and starts listening for wifi events, so it also works when wifi is started by someone else than EvtWiFi
+*/
+EventGroupHandle_t EvtWiFi::getEventGroup() {
+	if (eventGroup != NULL) return(eventGroup);
+
+#if EVT_STATIC_ALLOCATION
+	static StaticEventGroup_t eventGroupBuffer;
+	EventGroupHandle_t newGroup = NULL;
+#else
+	EventGroupHandle_t newGroup = xEventGroupCreate();
+#endif
+	bool created = false;
+	portENTER_CRITICAL(&mux);
+	if (eventGroup == NULL) {   // Another task may have made it while we made ours
+#if EVT_STATIC_ALLOCATION
+		newGroup = xEventGroupCreateStatic(&eventGroupBuffer);   // It doesn't allocate, so it can be made here where only one task gets in
+#endif
+		eventGroup = newGroup;
+		created = true;
+	}
+	portEXIT_CRITICAL(&mux);
+
+	if (created) {
+		xEventGroupSetBits(eventGroup, WiFi.status() == WL_CONNECTED ? WIFI_CONNECTED_BIT : WIFI_DISCONNECTED_BIT);
+		WiFi.onEvent(wifiEvent);
+	} else if (newGroup != NULL) {
+		vEventGroupDelete(newGroup);
+	}
+	return(eventGroup);
+}
+
+
+
+/*	Registers a function that is called every time we get connected or disconnected. Use it in tasks that sleep on something
+	else than the event group. Parameters:
+	cbFunction: the function. It is called in the wifi event task, so it must be short and must not block
+	Returns false if there is no room for more functions
+*/
+bool EvtWiFi::onChange(WiFiChangeCbFunc cbFunction) {
+	getEventGroup();
+	bool added = false;
+	portENTER_CRITICAL(&mux);
+	if (listenerCount < WIFI_MAX_LISTENERS) {
+		listeners[listenerCount++] = cbFunction;
+		added = true;
+	}
+	portEXIT_CRITICAL(&mux);
+	if (!added) logger.send(ERR, "WFI", "No room for more than %d wifi listeners", WIFI_MAX_LISTENERS);
+	return(added);
+}
+
+
+
+/* Called by the wifi driver. Only connecting with an IP address counts, because before that the network can't be used */
+void EvtWiFi::wifiEvent(arduino_event_t* event) {
+	switch (event->event_id) {
+	case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+		setConnected(true);
+		break;
+	case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+	case ARDUINO_EVENT_WIFI_STA_LOST_IP:
+	case ARDUINO_EVENT_WIFI_STA_STOP:
+		setConnected(false);
+		break;
+	default:
+		break;
+	}
+}
+
+
+
+/*	Updates the event group and tells the listeners if the state has changed. Parameters:
+	connected: the new state
+*/
+void EvtWiFi::setConnected(bool connected) {
+	EventBits_t bits = xEventGroupGetBits(eventGroup);
+	if (((bits & WIFI_CONNECTED_BIT) != 0) == connected) return;   // The driver sends more disconnects while it retries
+
+	xEventGroupClearBits(eventGroup, connected ? WIFI_DISCONNECTED_BIT : WIFI_CONNECTED_BIT);
+	xEventGroupSetBits(eventGroup, connected ? WIFI_CONNECTED_BIT : WIFI_DISCONNECTED_BIT);
+	for (uint8_t i = 0; i < listenerCount; i++) listeners[i](connected);
+}
+
+
+
+/*	This task connects to wifi. It sleeps until the connection changes. When we get disconnected it starts connecting again
+	at once. While we are disconnected it asks the wifi module to reconnect every WIFI_RECONNECT_INTERVAL seconds
+*/
 void EvtWiFi::TaskKeepConnected(void *pvParameters) {
-	EvtWiFi inst = *((EvtWiFi*)pvParameters); // We are inside static method. We need to be able to reference the instance.
-	logger.send(INFO, "WFI", "Connecting to SSID %s", inst._ssid);
-	WiFi.begin(inst._ssid, inst._psk);
+	EvtWiFi *inst = (EvtWiFi*)pvParameters; // We are inside static method. We need to be able to reference the instance.
+	logger.send(INFO, "WFI", "Connecting to SSID %s", inst->_ssid);
+	WiFi.persistent(false);   // Otherwise the wifi driver writes the settings to flash every time we connect
+	WiFi.setAutoReconnect(false);   // We reconnect ourselves, so we can use the cached AP
+	WiFi.mode(WIFI_STA);
+	bool fast = inst->startConnect();
 
 	while (true) {   // We are inside a task, so we want to continue forever
-		while (!inst.isConnected()) {   // We are not connected. Bad.
-			inst.periodicReconnect();
-			vTaskDelay(WIFI_CHECK_FOR_CONNECTION_EVERY / portTICK_PERIOD_MS); 
+		while (!waitForConnection(fast ? WIFI_FAST_CONNECT_TIMEOUT : 1000UL * WIFI_RECONNECT_INTERVAL)) {   // We are not connected. Bad.
+			if (fast) {
+				logger.send(WARN, "WFI", "The cached AP doesn't answer. Scanning");
+				inst->stats.fastConnectFailures++;
+				inst->forgetCache();
+				fast = inst->startConnect();
+			} else {
+				logger.send(WARN, "WFI", "No Wifi. Reconnecting");
+				WiFi.reconnect();
+			}
 		}
-		logger.send(INFO, "WFI", "Connected");
 
-		while (inst.isConnected()) {   // We are already connected. Great. Do nothing.
-			vTaskDelay(WIFI_CHECK_FOR_CONNECTION_EVERY / portTICK_PERIOD_MS);
+		inst->stats.connects++;
+		inst->stats.lastConnectTime = millis() - inst->connectStartedAt;
+		if (inst->stats.lastConnectTime > inst->stats.longestConnectTime) inst->stats.longestConnectTime = inst->stats.lastConnectTime;
+		if (inst->stats.bootToConnected == 0) {
+			inst->stats.bootToConnected = millis();
+			logger.send(INFO, "WFI", "Connected %lu ms after boot (%s)", inst->stats.bootToConnected, fast ? "cached AP" : "scanned");
+		} else {
+			logger.send(INFO, "WFI", "Connected in %lu ms", inst->stats.lastConnectTime);
 		}
-		logger.send( ERR, "WFI", "We got disconnected");
+		if (inst->_fastConnect) inst->saveCache();
+
+		xEventGroupWaitBits(eventGroup, WIFI_DISCONNECTED_BIT, pdFALSE, pdTRUE, portMAX_DELAY);   // We are connected. Great. Sleep until we aren't
+		logger.send(ERR, "WFI", "We got disconnected");
+		fast = inst->startConnect();   // Most of the time the AP is still there, so the cached AP is tried first
 	}
 }
 
 
 
-/* After X seconds has passed it sends a log warning message and tells wifi module to reconnect */
-void EvtWiFi::periodicReconnect() {
-	static long lastWarning = millis();
-	if ( millis() - lastWarning > 1000UL * WIFI_RECONNECT_INTERVAL) {
-		logger.send(WARN, "WFI", "No Wifi. Reconnecting");
-		WiFi.reconnect();
-		lastWarning = millis();
+/*	Starts connecting. With fast connect and a cached AP it goes straight to its BSSID and channel. Otherwise the driver
+	scans for the SSID. Returns true if the cached AP is used
+*/
+bool EvtWiFi::startConnect() {
+	WiFiCache cache;
+	bool fast = _fastConnect && loadCache(cache);
+	connectStartedAt = millis();
+
+	if (_staticIp) {
+		WiFi.config(_ip, _gateway, _subnet, _dns);
+	} else if (fast && _reuseLease) {
+		WiFi.config(IPAddress(cache.ip), IPAddress(cache.gateway), IPAddress(cache.subnet), IPAddress(cache.dns));
+	} else {
+		WiFi.config(IPAddress((uint32_t)0), IPAddress((uint32_t)0), IPAddress((uint32_t)0));   // DHCP
+	}
+
+	if (fast) {
+		stats.fastConnects++;
+		WiFi.begin(_ssid, _psk, cache.channel, cache.bssid);
+	} else {
+		stats.fullScans++;
+		WiFi.begin(_ssid, _psk);
 	}
+	return(fast);
+}
+
+
+
+/*	Gets the cached AP and lease. RTC memory is tried first, then NVS. Parameters:
+	cache: filled with the cached values
+	Returns false if nothing is cached for our SSID
+*/
+bool EvtWiFi::loadCache(WiFiCache &cache) {
+	if (rtcCache.magic != WIFI_CACHE_MAGIC || rtcCache.ssidHash != ssidHash()) {   // After power up RTC memory is garbage
+		Preferences preferences;
+		if (preferences.begin(WIFI_CACHE_NAMESPACE, true)) {
+			if (preferences.getBytes("cache", &rtcCache, sizeof(rtcCache)) != sizeof(rtcCache)) rtcCache.magic = 0;
+			preferences.end();
+		}
+	}
+	if (rtcCache.magic != WIFI_CACHE_MAGIC || rtcCache.ssidHash != ssidHash()) return(false);
+	cache = rtcCache;
+	return(true);
+}
+
+
+
+/* Stores the AP and lease of the connection we have now. NVS is only written if something has changed */
+void EvtWiFi::saveCache() {
+	WiFiCache cache;
+	memset(&cache, 0, sizeof(cache));   // No random padding bytes, so the compare below works
+	cache.magic = WIFI_CACHE_MAGIC;
+	cache.ssidHash = ssidHash();
+	memcpy(cache.bssid, WiFi.BSSID(), sizeof(cache.bssid));
+	cache.channel = WiFi.channel();
+	cache.ip = WiFi.localIP();
+	cache.gateway = WiFi.gatewayIP();
+	cache.subnet = WiFi.subnetMask();
+	cache.dns = WiFi.dnsIP();
+
+	if (memcmp(&cache, &rtcCache, sizeof(cache)) == 0) return;
+	rtcCache = cache;
+	Preferences preferences;
+	if (preferences.begin(WIFI_CACHE_NAMESPACE, false)) {
+		preferences.putBytes("cache", &cache, sizeof(cache));
+		preferences.end();
+		logger.send(DEBUG, "WFI", "Cached AP on channel %d", cache.channel);
+	}
+}
+
+
+
+/* Forgets the cached AP, so next time we scan. Used when the AP has moved to another channel or is gone */
+void EvtWiFi::forgetCache() {
+	rtcCache.magic = 0;
+	Preferences preferences;
+	if (preferences.begin(WIFI_CACHE_NAMESPACE, false)) {
+		preferences.remove("cache");
+		preferences.end();
+	}
+}
+
+
+
+/* FNV-1a hash of the SSID */
+uint32_t EvtWiFi::ssidHash() {
+	uint32_t hash = 2166136261UL;
+	for (const char* c = _ssid; *c != 0; c++) hash = (hash ^ (uint8_t)*c) * 16777619UL;
+	return(hash);
 }
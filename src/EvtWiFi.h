@@ -1,23 +1,91 @@
 #ifndef _EVTWIFI_h
 #define _EVTWIFI_h
 
+#include <Arduino.h>
+#include "EvtAlloc.h"
+#include "EvtCallback.h"
+#include "WiFi.h"
+#include <Preferences.h>
+#include <esp_attr.h>
 
-#define WIFI_STACK_SIZE 10000
-#define WIFI_CHECK_FOR_CONNECTION_EVERY 10   // ms between each check to see if we are reconnected
+#define WIFI_STACK_SIZE 3000
 #define WIFI_RECONNECT_INTERVAL 10   // Seconds between each wifi reconnect attempt
+#define WIFI_MAX_LISTENERS 4   // Max number of functions called when the connection changes
+#define WIFI_FAST_CONNECT_TIMEOUT 3000   // ms to wait for a connection to the cached AP before falling back to a full scan
+#define WIFI_CACHE_NAMESPACE "evtwifi"   // NVS namespace of the cached AP and lease
+#define WIFI_CACHE_MAGIC 0x57494631
 
+// Bits in the event group of the connection. Tasks can block on them with xEventGroupWaitBits()
+#define WIFI_CONNECTED_BIT BIT0   // Set while we are connected and have an IP address
+#define WIFI_DISCONNECTED_BIT BIT1   // Set while we are not connected
 
 
+typedef EvtCallback<void(bool connected)> WiFiChangeCbFunc;   // Called in the wifi event task. It must be short
+
+
+// The AP and IP lease of the last good connection. Kept in RTC memory and NVS, so we can connect without scanning
+struct WiFiCache {
+	uint32_t magic;
+	uint32_t ssidHash;   // The cache is only used for the SSID it was made with
+	uint8_t bssid[6];
+	uint8_t channel;
+	uint32_t ip;
+	uint32_t gateway;
+	uint32_t subnet;
+	uint32_t dns;
+};
+
+
+// Counters about connecting. Times are in ms
+struct WiFiStats {
+	unsigned long bootToConnected = 0;   // From power up until the first connection had an IP address
+	unsigned long lastConnectTime = 0;   // From starting to connect until we had an IP address
+	unsigned long longestConnectTime = 0;
+	unsigned long connects = 0;
+	unsigned long fastConnects = 0;   // Connections straight to the cached AP and channel
+	unsigned long fastConnectFailures = 0;   // Times the cached AP did not answer and we had to scan
+	unsigned long fullScans = 0;
+};
+
+
+
+/*	Keeps us connected to a wifi AP. It's driven by the wifi events, so nothing is polled. The connection state is kept in an
+	event group that other modules can wait on, so they wake up the moment we are connected. Modules that sleep on something
+	else can have a function called on every change instead
+*/
 class EvtWiFi
 {
 private:
 	char* _ssid;
 	char* _psk;
+	bool _fastConnect = false;
+	bool _reuseLease = false;
+	bool _staticIp = false;
+	IPAddress _ip, _gateway, _subnet, _dns;
+	unsigned long connectStartedAt = 0;
+	WiFiStats stats;
+	static WiFiCache rtcCache;
+	static EventGroupHandle_t eventGroup;
+	static portMUX_TYPE mux;
+	static WiFiChangeCbFunc listeners[WIFI_MAX_LISTENERS];
+	static uint8_t listenerCount;
 	static void TaskKeepConnected(void *pvParameters);
-	void periodicReconnect();
+	static void wifiEvent(arduino_event_t* event);
+	static void setConnected(bool connected);
+	bool startConnect();
+	bool loadCache(WiFiCache &cache);
+	void saveCache();
+	void forgetCache();
+	uint32_t ssidHash();
 public:
 	void begin(char* ssid, char* psk);
-	bool isConnected();
+	void enableFastConnect(bool reuseLease = false);
+	void setStaticIp(IPAddress ip, IPAddress gateway, IPAddress subnet, IPAddress dns = IPAddress());
+	WiFiStats getStats();
+	static bool isConnected();
+	static bool waitForConnection(unsigned long ms);
+	static EventGroupHandle_t getEventGroup();
+	static bool onChange(WiFiChangeCbFunc cbFunction);
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -12,6 +12,9 @@
 #define MQTT_PORT		8883
 #define MQTT_USER		"my_mqtt_user"
 #define MQTT_PASS		"my_mqtt_password"
+#define MQTT_CA_CERT	"-----BEGIN CERTIFICATE-----\n" \
+						"...the CA certificate of your mqtt server in PEM format...\n" \
+						"-----END CERTIFICATE-----\n"	// Use nullptr for a server without TLS on port 1883
 
 // Setup for the Mqtt example:
 #define MQTT_TOPIC_INT			"my_topic_root/int"